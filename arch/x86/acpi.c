@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "inc_c/acpi.h"
+#include "inc_c/memory.h"
+#include "inc_c/string.h"
+
+// Just enough ACPI to find tables: the RSDP is somewhere in the BIOS areas of the first MB
+// (which stays mapped at 0xC0000000), and points at the RSDT, which lists the rest.
+
+acpi_rsdp_t *rsdp = NULL;
+acpi_header_t *rsdt = NULL;
+
+static bool acpi_checksum(void *table, uint32_t length) {
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        sum += ((uint8_t *)table)[i];
+    }
+    return sum == 0;
+}
+
+static acpi_rsdp_t *acpi_scan_rsdp(uint32_t start, uint32_t length) {
+    //it's always on a 16 byte boundary
+    for (uint32_t addr = start; addr < start + length; addr += 16) {
+        acpi_rsdp_t *candidate = (acpi_rsdp_t *)(addr + 0xC0000000);
+        if (strncmp(candidate->signature, "RSD PTR ", 8) == 0 && acpi_checksum(candidate, sizeof(acpi_rsdp_t))) {
+            return candidate;
+        }
+    }
+    return NULL;
+}
+
+// Tables can be anywhere in physical memory, so map the header first to find out how long it is
+static acpi_header_t *acpi_map_table(uint32_t phys) {
+    acpi_header_t *header = (acpi_header_t *)map_mmio(phys, sizeof(acpi_header_t));
+    uint32_t length = header->length;
+    if (length <= 0x1000 - (phys & 0xFFF)) {
+        return header;
+    }
+    return (acpi_header_t *)map_mmio(phys, length);
+}
+
+static bool acpi_initialize() {
+    if (rsdt != NULL) {
+        return true;
+    }
+
+    //first KB of the EBDA, whose segment is in the BIOS data area, then the BIOS ROM
+    uint32_t ebda = (uint32_t)(*(uint16_t *)(0x40E + 0xC0000000)) << 4;
+    if (ebda != 0) {
+        rsdp = acpi_scan_rsdp(ebda, 0x400);
+    }
+    if (rsdp == NULL) {
+        rsdp = acpi_scan_rsdp(0xE0000, 0x20000);
+    }
+    if (rsdp == NULL) {
+        return false;
+    }
+
+    rsdt = acpi_map_table(rsdp->rsdt_addr);
+    if (strncmp(rsdt->signature, "RSDT", 4) != 0 || !acpi_checksum(rsdt, rsdt->length)) {
+        rsdt = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Returns the table with the given signature, or NULL if there isn't one
+acpi_header_t *acpi_find_table(const char *signature) {
+    if (!acpi_initialize()) {
+        return NULL;
+    }
+
+    uint32_t count = (rsdt->length - sizeof(acpi_header_t)) / 4;
+    uint32_t *entries = (uint32_t *)(rsdt + 1);
+    for (uint32_t i = 0; i < count; i++) {
+        acpi_header_t *table = acpi_map_table(entries[i]);
+        if (strncmp(table->signature, signature, 4) == 0 && acpi_checksum(table, table->length)) {
+            return table;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "inc_c/apic.h"
+#include "inc_c/memory.h"
+#include "inc_c/hardware.h"
+#include "inc_c/clock.h"
+#include "inc_c/process.h"
+#include "inc_c/serial.h"
+#include "inc_c/smp.h"
+#include "inc_c/user.h"
+#include "drivers/PIT.h"
+#include "../../kernel/include/timer.h"
+#include "../../kernel/include/trace.h"
+
+#define TIMER_CALIBRATE_US 10000
+
+volatile uint32_t *lapic = NULL;
+
+uint32_t lapic_timer_mode = LAPIC_TIMER_OFF;
+uint32_t lapic_timer_khz = 0; //timer counts per ms, after the divide by 16
+uint64_t tsc_per_tick = 0;
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+void lapic_initialize(uint32_t phys) {
+    lapic = (volatile uint32_t *)map_mmio(phys, 0x1000);
+}
+
+// Per-CPU: every CPU has to enable its own LAPIC
+void lapic_enable() {
+    lapic_write(LAPIC_TPR, 0); //accept every interrupt
+    lapic_write(LAPIC_SVR, 0x100 | LAPIC_SPURIOUS_VECTOR);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr) {
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_PENDING) {
+        asm volatile ("pause");
+    }
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr); //writing the low half sends it
+}
+
+// Counts timer ticks across TIMER_CALIBRATE_US of PIT channel 2
+static uint32_t lapic_timer_calibrate() {
+    uint32_t flags = irq_save();
+
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    pit_wait_us(TIMER_CALIBRATE_US);
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+
+    irq_restore(flags);
+    return elapsed / (TIMER_CALIBRATE_US / 1000);
+}
+
+static bool cpu_has_tsc_deadline() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    return ecx & (1 << 24);
+}
+
+// On the BSP, once the LAPIC is mapped and before the APs start: calibrates the local APIC timer
+// and makes it the scheduler tick in place of the PIT. With a calibrated TSC the timer runs in
+// TSC-deadline mode, so every CPU can be given its own expiry time.
+void lapic_timer_initialize() {
+    if (lapic == NULL) {
+        return;
+    }
+
+    lapic_timer_khz = lapic_timer_calibrate();
+    if (lapic_timer_khz == 0) {
+        serial_printf("LAPIC timer: didn't count, keeping the PIT\n");
+        return;
+    }
+
+    if (clocksource == CLOCKSOURCE_TSC && cpu_has_tsc_deadline()) {
+        lapic_timer_mode = LAPIC_TIMER_DEADLINE;
+        tsc_per_tick = ((uint64_t)tsc_khz * 1000) / HZ;
+    } else {
+        lapic_timer_mode = LAPIC_TIMER_PERIODIC;
+    }
+
+    lapic_timer_start();
+    pit_disable_irq();
+
+    serial_printf("LAPIC timer: %d kHz, %s\n", lapic_timer_khz, lapic_timer_mode == LAPIC_TIMER_DEADLINE ? "TSC deadline" : "periodic");
+}
+
+// Per-CPU: starts this CPU's tick
+void lapic_timer_start() {
+    if (lapic_timer_mode == LAPIC_TIMER_DEADLINE) {
+        cpu_t *cpu = this_cpu();
+        lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_TSC_DEADLINE | LAPIC_TIMER_VECTOR);
+        cpu->timer_deadline = clock_cycles() + tsc_per_tick;
+        wrmsr(MSR_TSC_DEADLINE, cpu->timer_deadline);
+    } else if (lapic_timer_mode == LAPIC_TIMER_PERIODIC) {
+        lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+        lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+        lapic_write(LAPIC_TIMER_INITIAL, (lapic_timer_khz * 1000) / HZ);
+    }
+}
+
+// Every CPU's scheduler tick. Only the BSP advances jiffies and runs timers.
+void lapic_timer_interrupt(regs_t *r) {
+    cpu_t *cpu = this_cpu();
+
+    uint32_t ticks = 1;
+    if (lapic_timer_mode == LAPIC_TIMER_DEADLINE) {
+        //deadlines advance by whole ticks from the last one, so lateness doesn't add up; ticks
+        //missed with interrupts off are made up here
+        uint64_t now = clock_cycles();
+        ticks = 0;
+        while (cpu->timer_deadline <= now) {
+            cpu->timer_deadline += tsc_per_tick;
+            ticks++;
+        }
+        wrmsr(MSR_TSC_DEADLINE, cpu->timer_deadline);
+    }
+    lapic_eoi();
+
+    trace(TRACE_IRQ_ENTER, LAPIC_TIMER_VECTOR - 32, ticks);
+    process_account_tick(r, ticks);
+
+    if (cpu->index == 0) {
+        lock_kernel();
+        while (ticks-- > 0) {
+            timer_tick();
+        }
+        user_data_update();
+        unlock_kernel();
+    }
+
+    //one tick per time slice
+    cpu->resched = true;
+    if (cpu->current != NULL) {
+        schedule();
+    }
+}
@@ -7,43 +7,47 @@
 #include "inc_c/serial.h"
 #include "inc_c/arch_elf.h"
 #include "inc_c/memory.h"
+#include "inc_c/smp.h"
 #include "../../kernel/include/filesystem.h"
 
-extern page_directory_t *current_pd;
-
-elf_load_result_t elf_load_executable(void *elf_file) {
-    asm volatile ("cli");
-
-    ELF32_EHDR *elf_header = (ELF32_EHDR *)elf_file;
 
+static int elf_check_header(ELF32_EHDR *elf_header) {
     //ensure the file is an ELF file
     if (elf_header->e_ident[EI_MAG0] != ELFMAG0 || elf_header->e_ident[EI_MAG1] != ELFMAG1 || elf_header->e_ident[EI_MAG2] != ELFMAG2 || elf_header->e_ident[EI_MAG3] != ELFMAG3) {
-        asm volatile ("sti");
-        return (elf_load_result_t){ELF_ERR_NOT_ELF_FILE, NULL, NULL}; //not an ELF file
+        return ELF_ERR_NOT_ELF_FILE; //not an ELF file
     }
 
     if (elf_header->e_ident[EI_CLASS] != ELFCLASS32) {
-        asm volatile ("sti");
-        return (elf_load_result_t){ELF_ERR_NOT_32BIT, NULL, NULL}; //not a 32-bit ELF file
+        return ELF_ERR_NOT_32BIT; //not a 32-bit ELF file
     }
 
     if (elf_header->e_ident[EI_DATA] != ELFDATA2LSB) {
-        asm volatile ("sti");
-        return (elf_load_result_t){ELF_ERR_NOT_LITTLE_ENDIAN, NULL, NULL}; //not a little-endian ELF file
+        return ELF_ERR_NOT_LITTLE_ENDIAN; //not a little-endian ELF file
     }
 
     if (elf_header->e_ident[EI_VERSION] != EV_CURRENT) {
-        asm volatile ("sti");
-        return (elf_load_result_t){ELF_ERR_NOT_CURRENT_VERSION, NULL, NULL}; //not a current version ELF file
+        return ELF_ERR_NOT_CURRENT_VERSION; //not a current version ELF file
     }
 
     if (elf_header->e_type != ET_EXEC) {
-        asm volatile ("sti");
-        return (elf_load_result_t){ELF_ERR_NOT_EXECUTABLE, NULL, NULL}; //not an executable ELF file
+        return ELF_ERR_NOT_EXECUTABLE; //not an executable ELF file
+    }
+
+    return ELF_ERR_NONE;
+}
+
+elf_load_result_t elf_load_executable(void *elf_file) {
+    ELF32_EHDR *elf_header = (ELF32_EHDR *)elf_file;
+
+    int code = elf_check_header(elf_header);
+    if (code != ELF_ERR_NONE) {
+        return (elf_load_result_t){code, NULL, NULL};
     }
 
     page_directory_t *old_pd = current_pd;
     page_directory_t *new_pd = clone_page_directory(current_pd);
+    //we mustn't be switched out (or moved to another CPU) while current_pd isn't our own
+    uint32_t flags = irq_save();
     switch_page_directory(new_pd);
 
     //Attempt to load sections
@@ -76,12 +80,14 @@ elf_load_result_t elf_load_executable(void *elf_file) {
                 memset((void *)(program_header->p_vaddr + program_header->p_filesz), 0, program_header->p_memsz - program_header->p_filesz);
             }
         } else {
-            asm volatile ("sti");
+            switch_page_directory(old_pd);
+            irq_restore(flags);
             return (elf_load_result_t){ELF_ERR_INVALID_SECTION, NULL, NULL}; //unhandled program header type
         }
     }
 
     switch_page_directory(old_pd);
+    irq_restore(flags);
 
     return (elf_load_result_t){ELF_ERR_NONE, (void *)elf_header->e_entry, new_pd};
 }
@@ -111,4 +117,104 @@ elf_load_result_t elf_load_executable_path(char *path) {
     elf_load_result_t loaded = elf_load_executable(elfbuf);
     kfree(elfbuf);
     return loaded;
-}
\ No newline at end of file
+}
+// Loads a PT_LOAD segment page by page: each page gets a zeroed frame in pd (unless an earlier
+// segment already gave it one), and the part of the file that belongs in it is copied in through
+// the physical window. Only a page of the file is ever in memory at once. Pages that are all file
+// are mapped straight from the filesystem instead if it keeps them in memory (see fmap_page),
+// copy-on-write if the segment is writable.
+static int elf_load_segment(file_descriptor_t *fd, ELF32_PHDR *program_header, page_directory_t *pd, uint8_t *page) {
+    if (program_header->p_align != 0x1000 || program_header->p_filesz > program_header->p_memsz) {
+        return ELF_ERR_INVALID_SECTION;
+    }
+    if (program_header->p_vaddr + program_header->p_memsz > 0xC0000000 - 0x400000) {
+        return ELF_ERR_INVALID_SECTION; //would overlap the stack or the kernel
+    }
+
+    uint32_t file_start = program_header->p_vaddr;
+    uint32_t file_end = program_header->p_vaddr + program_header->p_filesz;
+    uint32_t aligned_vaddr = program_header->p_vaddr & 0xFFFFF000;
+    uint32_t aligned_end = (program_header->p_vaddr + program_header->p_memsz + 0xFFF) & 0xFFFFF000;
+    bool is_writable = program_header->p_flags & PF_W;
+
+    for (uint32_t vaddr = aligned_vaddr; vaddr < aligned_end; vaddr += 0x1000) {
+        //the bytes of this page that come from the file
+        uint32_t copy_start = vaddr > file_start ? vaddr : file_start;
+        uint32_t copy_end = vaddr + 0x1000 < file_end ? vaddr + 0x1000 : file_end;
+
+        if (!page_is_mapped(vaddr, pd)) {
+            uint32_t shared = 0;
+            if (copy_start == vaddr && copy_end == vaddr + 0x1000) {
+                shared = fmap_page(fd, program_header->p_offset + (vaddr - file_start));
+            }
+            if (shared != 0) {
+                if (is_writable) {
+                    map_cow_page(vaddr, shared, pd);
+                } else {
+                    map_shared_page(vaddr, shared, false, pd);
+                }
+                continue;
+            }
+
+            page_table_entry_t first_free = first_free_page();
+            uint32_t phys = (first_free.pd_entry * 0x400000) + (first_free.pt_entry * 0x1000);
+            alloc_page_kmalloc(vaddr, phys, true, false, is_writable, pd);
+            phys_fill(phys, 0, NULL, 0x1000);
+        }
+
+        if (copy_start >= copy_end) {
+            continue;
+        }
+        uint32_t length = copy_end - copy_start;
+        fseek(fd, program_header->p_offset + (copy_start - file_start), SEEK_SET);
+        if (fread((char *)page, 1, length, fd) != (int)length) {
+            return ELF_ERR_INVALID_SECTION;
+        }
+        phys_fill(virt_to_phys(vaddr, pd), copy_start - vaddr, page, length);
+    }
+    return ELF_ERR_NONE;
+}
+
+// Loads an executable from an open file into pd, which doesn't have to be the current page
+// directory, so a new address space can be built without ever running in it. On failure, pd
+// may be partly filled in, and is the caller's to free.
+elf_load_result_t elf_load_file(file_descriptor_t *fd, page_directory_t *pd) {
+    ELF32_EHDR elf_header;
+    fseek(fd, 0, SEEK_SET);
+    if (fread((char *)&elf_header, 1, sizeof(ELF32_EHDR), fd) != sizeof(ELF32_EHDR)) {
+        return (elf_load_result_t){ELF_ERR_NOT_ELF_FILE, NULL, NULL};
+    }
+    int code = elf_check_header(&elf_header);
+    if (code != ELF_ERR_NONE) {
+        return (elf_load_result_t){code, NULL, NULL};
+    }
+
+    uint8_t *page = (uint8_t *)kmalloc(0x1000);
+    uint32_t end = 0;
+    for (int i = 0; i < elf_header.e_phnum && code == ELF_ERR_NONE; i++) {
+        ELF32_PHDR program_header;
+        fseek(fd, elf_header.e_phoff + (i * elf_header.e_phentsize), SEEK_SET);
+        if (fread((char *)&program_header, 1, sizeof(ELF32_PHDR), fd) != sizeof(ELF32_PHDR)) {
+            code = ELF_ERR_INVALID_SECTION;
+        } else if (program_header.p_type == PT_NULL) {
+            //do nothing
+        } else if (program_header.p_type == PT_LOAD) {
+            code = elf_load_segment(fd, &program_header, pd, page);
+            uint32_t segment_end = (program_header.p_vaddr + program_header.p_memsz + 0xFFF) & 0xFFFFF000;
+            if (segment_end > end) {
+                end = segment_end;
+            }
+        } else {
+            code = ELF_ERR_INVALID_SECTION; //unhandled program header type
+        }
+    }
+    kfree(page);
+
+    if (code != ELF_ERR_NONE) {
+        return (elf_load_result_t){code, NULL, NULL};
+    }
+    //the heap starts empty, right after the last segment
+    pd->brk_start = end;
+    pd->brk = end;
+    return (elf_load_result_t){ELF_ERR_NONE, (void *)elf_header.e_entry, pd};
+}
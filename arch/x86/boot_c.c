@@ -12,6 +12,14 @@
 #include "inc_c/serial.h"
 #include "inc_c/process.h"
 #include "inc_c/devices.h"
+#include "inc_c/clock.h"
+#include "inc_c/fpu.h"
+#include "inc_c/smp.h"
+#include "inc_c/user.h"
+#include "inc_c/syscall.h"
+#include "../../kernel/include/trace.h"
+#include "../../kernel/include/procfs.h"
+#include "../../kernel/include/futex.h"
 
 extern uint32_t given_magic;
 extern uint32_t given_mboot;
@@ -33,6 +41,8 @@ void boot_initialize() {
 
     terminal_initialize();
     serial_initialize();
+    clock_initialize();
+    fpu_initialize();
 
     if (magic != MULTIBOOT_BOOTLOADER_MAGIC)
     {
@@ -338,12 +348,24 @@ void boot_initialize() {
 
     memory_initialize(mboot_info);
 
+    if (clocksource == CLOCKSOURCE_TSC) {
+        serial_printf("Clocksource: TSC at %d kHz%s\n", tsc_khz, tsc_invariant ? "" : " (not invariant)");
+    } else {
+        serial_printf("Clocksource: PIT\n");
+    }
+
 	serial_printf("*********** BOOTED ***********\n");
 
 	process_initialize();
+    futex_initialize();
+    user_initialize();
+    smp_initialize();
 
     ramdisk_initialize(mboot_info);
     devices_initialize();
+    procfs_initialize();
+    trace_initialize();
+    syscall_stats_initialize();
 
     terminal_register_device();
 
@@ -0,0 +1,233 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "inc_c/clock.h"
+#include "inc_c/io.h"
+#include "inc_c/hardware.h"
+#include "drivers/PIT.h"
+#include "../../kernel/include/timer.h"
+
+// Clocksource: nanosecond timestamps for the kernel.
+// The TSC is calibrated against PIT channel 2 at boot. If there's no TSC, or two calibration runs
+// don't agree, we fall back to interpolating jiffies with the PIT channel 0 counter, which is
+// slower to read but still has sub-microsecond resolution.
+
+#define CALIBRATE_MS 10
+#define CALIBRATE_LATCH (PIT_FREQUENCY / (1000 / CALIBRATE_MS))
+
+uint32_t clocksource = CLOCKSOURCE_PIT;
+uint32_t tsc_khz = 0;
+uint32_t clock_mult = 0;
+uint64_t tsc_at_boot = 0;
+uint32_t boot_epoch = 0; //seconds since 1970 when the clock was initialized, from the RTC
+bool tsc_invariant = false;
+
+bool has_tsc = false;
+uint64_t last_pit_ns = 0; //the PIT readback can briefly run behind jiffies, so keep it monotonic
+
+static void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static bool cpu_has_invariant_tsc() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000007) {
+        return false;
+    }
+    cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & (1 << 8);
+}
+
+// Counts TSC cycles across CALIBRATE_MS of PIT channel 2, returns kHz (0 on failure)
+static uint32_t tsc_calibrate_khz() {
+    uint32_t flags = irq_save();
+
+    //gate channel 2 on, keep the speaker off
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+    //channel 2, lobyte/hibyte, mode 0 (output goes high on terminal count)
+    outb(0x43, 0xB0);
+    outb(0x42, CALIBRATE_LATCH & 0xFF);
+    outb(0x42, CALIBRATE_LATCH >> 8);
+
+    uint64_t start = rdtsc();
+    uint32_t loops = 0;
+    while (!(inb(0x61) & 0x20)) {
+        loops++;
+    }
+    uint64_t end = rdtsc();
+
+    irq_restore(flags);
+
+    //if the output went high right away, the PIT isn't doing what we asked
+    if (loops < 100) {
+        return 0;
+    }
+    return (uint32_t)((end - start) / CALIBRATE_MS);
+}
+
+static uint8_t cmos_read(uint8_t reg) {
+    outb(0x70, reg);
+    return inb(0x71);
+}
+
+static uint32_t bcd_to_bin(uint32_t val) {
+    return (val & 0x0F) + (val >> 4) * 10;
+}
+
+// Days between 1970-01-01 and the given date
+static uint32_t days_from_civil(uint32_t year, uint32_t month, uint32_t day) {
+    year -= month <= 2;
+    uint32_t era = year / 400;
+    uint32_t yoe = year - era * 400;
+    uint32_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static uint32_t rtc_read_epoch() {
+    //wait for any update in progress to finish, so we don't read a half-updated time
+    while (cmos_read(0x0A) & 0x80);
+
+    uint32_t second = cmos_read(0x00);
+    uint32_t minute = cmos_read(0x02);
+    uint32_t hour = cmos_read(0x04);
+    uint32_t day = cmos_read(0x07);
+    uint32_t month = cmos_read(0x08);
+    uint32_t year = cmos_read(0x09);
+    uint8_t status_b = cmos_read(0x0B);
+
+    bool pm = hour & 0x80;
+    hour &= 0x7F;
+    if (!(status_b & 0x04)) {
+        second = bcd_to_bin(second);
+        minute = bcd_to_bin(minute);
+        hour = bcd_to_bin(hour);
+        day = bcd_to_bin(day);
+        month = bcd_to_bin(month);
+        year = bcd_to_bin(year);
+    }
+    if (!(status_b & 0x02) && pm) {
+        hour = (hour + 12) % 24;
+    }
+    year += 2000;
+
+    return days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+void clock_initialize() {
+    boot_epoch = rtc_read_epoch();
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    has_tsc = edx & (1 << 4);
+    if (!has_tsc) {
+        clocksource = CLOCKSOURCE_PIT;
+        return;
+    }
+
+    //two runs that disagree by more than 1% mean the TSC isn't ticking at a steady rate
+    uint32_t first = tsc_calibrate_khz();
+    uint32_t second = tsc_calibrate_khz();
+    uint32_t diff = first > second ? first - second : second - first;
+    if (first < 1000 || second < 1000 || diff > first / 100) {
+        clocksource = CLOCKSOURCE_PIT;
+        return;
+    }
+
+    tsc_khz = (first + second) / 2;
+    clock_mult = (uint32_t)(((uint64_t)1000000 << CLOCK_SHIFT) / tsc_khz);
+    tsc_at_boot = rdtsc();
+    clocksource = CLOCKSOURCE_TSC;
+    //a non-invariant TSC is still fine on one core without frequency scaling, but worth reporting
+    tsc_invariant = cpu_has_invariant_tsc();
+}
+
+// Raw timestamp counter, for cheap relative measurements (tracing, benchmarks). Only the TSC when
+// it's the clocksource: an uncalibrated one has no rate to convert it with, so otherwise it's ns.
+uint64_t clock_cycles() {
+    if (clocksource == CLOCKSOURCE_TSC) {
+        return rdtsc();
+    }
+    return clock_boot_ns();
+}
+
+// How fast clock_cycles counts, for whoever has to turn its values into time: ns are the cycles
+// of a 1 GHz clock
+uint32_t clock_cycles_khz() {
+    return clocksource == CLOCKSOURCE_TSC ? tsc_khz : 1000000;
+}
+
+uint64_t clock_cycles_to_ns(uint64_t cycles) {
+    if (clocksource != CLOCKSOURCE_TSC) {
+        return cycles;
+    }
+    //split the multiply so it can't overflow 64 bits
+    uint64_t high = (cycles >> 32) * clock_mult;
+    uint64_t low = (cycles & 0xFFFFFFFF) * clock_mult;
+    return (high << (32 - CLOCK_SHIFT)) + (low >> CLOCK_SHIFT);
+}
+
+// Busy-waits at least us microseconds. Works with interrupts off, so it's usable before the
+// timer is running (starting APs needs delays like that).
+void clock_udelay(uint32_t us) {
+    if (has_tsc && tsc_khz != 0) {
+        uint64_t end = rdtsc() + ((uint64_t)us * tsc_khz) / 1000;
+        while (rdtsc() < end) {
+            asm volatile ("pause");
+        }
+        return;
+    }
+
+    pit_wait_us(us);
+}
+
+uint64_t clock_boot_ns() {
+    if (clocksource == CLOCKSOURCE_TSC) {
+        return clock_cycles_to_ns(rdtsc() - tsc_at_boot);
+    }
+
+    uint32_t flags = irq_save();
+    uint64_t ns = get_jiffies_64() * (NSEC_PER_SEC / HZ) + ((uint64_t)timer_read_elapsed() * NSEC_PER_SEC) / PIT_FREQUENCY;
+    if (ns < last_pit_ns) {
+        ns = last_pit_ns;
+    }
+    last_pit_ns = ns;
+    irq_restore(flags);
+
+    return ns;
+}
+
+// There's no suspend, so monotonic time never diverges from time since boot
+uint64_t clock_monotonic_ns() {
+    return clock_boot_ns();
+}
+
+int clock_gettime(uint32_t clock_id, timespec_t *ts) {
+    uint64_t ns;
+    switch (clock_id) {
+        case CLOCK_REALTIME:
+            ns = (uint64_t)boot_epoch * NSEC_PER_SEC + clock_boot_ns();
+            break;
+        case CLOCK_MONOTONIC:
+        case CLOCK_MONOTONIC_RAW:
+            ns = clock_monotonic_ns();
+            break;
+        case CLOCK_BOOTTIME:
+            ns = clock_boot_ns();
+            break;
+        default:
+            return -1;
+    }
+
+    ts->tv_sec = (int32_t)(ns / NSEC_PER_SEC);
+    ts->tv_nsec = (int32_t)(ns % NSEC_PER_SEC);
+    return 0;
+}
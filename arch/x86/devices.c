@@ -10,11 +10,13 @@
 #include "inc_c/memory.h"
 #include "inc_c/devices.h"
 #include "inc_c/serial.h"
+#include "../../kernel/include/spinlock.h"
 
 filesystem_t device_fs = {0};
 int device_fs_registered = 0;
 
 device_t *device_head = NULL;
+spinlock_t device_lock = SPINLOCK_INIT(LOCK_LEVEL_DEVICE); //the device list; a device itself stays put once registered
 
 device_file_t *dopen(char *path, char *flags) {
     //Skip the leading slashes, if any
@@ -34,37 +36,43 @@ device_file_t *dopen(char *path, char *flags) {
     }
 
     //look for a device with the given name using strncmp
+    uint32_t lock_flags = spin_lock_irqsave(&device_lock);
     device_t *current_device = device_head;
     while (current_device != NULL) {
         if (strlen(current_device->name) == path_length && strncmp(current_device->name, path, path_length) == 0) {
-            //if we found a device, allocate a device_file_t and return it
-            device_file_t *ret = (device_file_t *)kmalloc(sizeof(device_file_t));
-            ret->flags = FILE_ISFILE_FLAG | FILE_ISOPEN_FLAG | current_device->flags;
-            ret->device = current_device;
+            break;
+        }
+        current_device = current_device->next;
+    }
+    spin_unlock_irqrestore(&device_lock, lock_flags);
+
+    if (current_device != NULL) {
+        //if we found a device, allocate a device_file_t and return it
+        device_file_t *ret = (device_file_t *)kmalloc(sizeof(device_file_t));
+        ret->flags = FILE_ISFILE_FLAG | FILE_ISOPEN_FLAG | current_device->flags;
+        ret->device = current_device;
+
+        if (flags[0] == 'r') {
+            ret->flags |= FILE_MODE_READ;
+        } else if (flags[0] == 'w') {
+            ret->flags |= FILE_MODE_WRITE;
+        } else if (flags[0] == 'a') {
+            ret->flags |= FILE_MODE_WRITE;
+        } else {
+            ret->flags |= FILE_MODE_READ | FILE_MODE_WRITE;
+        }
 
+        if (flags[1] == '+') {
             if (flags[0] == 'r') {
-                ret->flags |= FILE_MODE_READ;
-            } else if (flags[0] == 'w') {
                 ret->flags |= FILE_MODE_WRITE;
+            } else if (flags[0] == 'w') {
+                ret->flags |= FILE_MODE_READ;
             } else if (flags[0] == 'a') {
-                ret->flags |= FILE_MODE_WRITE;
-            } else {
-                ret->flags |= FILE_MODE_READ | FILE_MODE_WRITE;
-            }
-
-            if (flags[1] == '+') {
-                if (flags[0] == 'r') {
-                    ret->flags |= FILE_MODE_WRITE;
-                } else if (flags[0] == 'w') {
-                    ret->flags |= FILE_MODE_READ;
-                } else if (flags[0] == 'a') {
-                    ret->flags |= FILE_MODE_READ;
-                }
+                ret->flags |= FILE_MODE_READ;
             }
-
-            return ret;
         }
-        current_device = current_device->next;
+
+        return ret;
     }
 
     //if we didn't find a device, return NULL
@@ -92,7 +100,17 @@ int dread(void *ptr, size_t size, size_t nmemb, device_file_t *file) {
     if (!(file->flags & FILE_MODE_READ)) {
         return -1;
     }
-    return file->device->read(ptr, size * nmemb);
+
+    device_t *device = file->device;
+    while (true) {
+        uint32_t seq = device->read_queue != NULL ? device->read_queue->seq : 0;
+        int read = device->read(ptr, size * nmemb);
+        if (read != 0 || device->read_queue == NULL) {
+            return read;
+        }
+        //nothing available yet, sleep until the device has more for us
+        sleep_on_since(device->read_queue, seq);
+    }
 }
 
 int dwrite(void *ptr, size_t size, size_t nmemb, device_file_t *file) {
@@ -108,18 +126,104 @@ int dwrite(void *ptr, size_t size, size_t nmemb, device_file_t *file) {
     return file->device->write(ptr, size * nmemb);
 }
 
+// Only the first buffer may sleep for data, like dread; the rest take whatever is already there
+int dreadv(iovec_t *iov, int iovcnt, device_file_t *file) {
+    if (!(file->flags & FILE_ISOPEN_FLAG) || !(file->flags & FILE_ISFILE_FLAG) || !(file->flags & FILE_MODE_READ)) {
+        return -1;
+    }
+    device_t *device = file->device;
+    if (device->readv != NULL) {
+        return device->readv(iov, iovcnt);
+    }
+
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        int read = total == 0 ? dread(iov[i].iov_base, 1, iov[i].iov_len, file) : device->read(iov[i].iov_base, iov[i].iov_len);
+        if (read < 0) {
+            return total == 0 ? read : total;
+        }
+        total += read;
+        if ((size_t)read < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
+int dwritev(iovec_t *iov, int iovcnt, device_file_t *file) {
+    if (!(file->flags & FILE_ISOPEN_FLAG) || !(file->flags & FILE_ISFILE_FLAG) || !(file->flags & FILE_MODE_WRITE)) {
+        return -1;
+    }
+    device_t *device = file->device;
+    if (device->writev != NULL) {
+        return device->writev(iov, iovcnt);
+    }
+
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        int written = device->write(iov[i].iov_base, iov[i].iov_len);
+        if (written < 0) {
+            return total == 0 ? written : total;
+        }
+        total += written;
+        if ((size_t)written < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
+// A device has one position shared by everyone who has it open, so this moves it to offset for
+// the read and puts it back after. Never sleeps: with nothing at offset it returns 0.
+int dpread(void *ptr, size_t count, size_t offset, device_file_t *file) {
+    if (!(file->flags & FILE_ISOPEN_FLAG) || !(file->flags & FILE_ISFILE_FLAG) || !(file->flags & FILE_MODE_READ)) {
+        return -1;
+    }
+    device_t *device = file->device;
+    size_t pos = device->tell();
+    if (device->seek(offset, SEEK_SET) < 0) {
+        return -1;
+    }
+    int read = device->read(ptr, count);
+    device->seek(pos, SEEK_SET);
+    return read;
+}
+
+int dpwrite(void *ptr, size_t count, size_t offset, device_file_t *file) {
+    if (!(file->flags & FILE_ISOPEN_FLAG) || !(file->flags & FILE_ISFILE_FLAG) || !(file->flags & FILE_MODE_WRITE)) {
+        return -1;
+    }
+    device_t *device = file->device;
+    size_t pos = device->tell();
+    if (device->seek(offset, SEEK_SET) < 0) {
+        return -1;
+    }
+    int written = device->write(ptr, count);
+    device->seek(pos, SEEK_SET);
+    return written;
+}
+
 dirent_t dreaddir(device_dir_t *dir) {
     // Read the nth device, or if we don't have that many devices, return NULL
+    uint32_t flags = spin_lock_irqsave(&device_lock);
     device_t *current_device = device_head;
-    for (uint32_t i = 0; i < dir->pos; i++) {
-        if (current_device == NULL) {
-            return (dirent_t){0, {}};
-        }
+    for (uint32_t i = 0; i < dir->pos && current_device != NULL; i++) {
         current_device = current_device->next;
     }
+    if (current_device == NULL) {
+        spin_unlock_irqrestore(&device_lock, flags);
+        return (dirent_t){0, {}};
+    }
 
     dirent_t ret = {1, {}};
     strncpy(ret.name, current_device->name, 256);
+    spin_unlock_irqrestore(&device_lock, flags);
     dir->pos++;
     return ret;
 }
@@ -138,11 +242,13 @@ int dseek(device_file_t *file, size_t offset, int whence) {
         } else if (whence == SEEK_END) {
             // Read the number of devices
             uint32_t num_devices = 0;
+            uint32_t flags = spin_lock_irqsave(&device_lock);
             device_t *current_device = device_head;
             while (current_device != NULL) {
                 num_devices++;
                 current_device = current_device->next;
             }
+            spin_unlock_irqrestore(&device_lock, flags);
 
             dir->pos = num_devices + offset;
             return 0;
@@ -201,9 +307,28 @@ size_t device_tell_empty() {
     return 0;
 }
 
+// /dev/null: reads are always at the end, writes always succeed
+int null_write(void *ptr, size_t size) {
+    UNUSED(ptr);
+    return size;
+}
+
+device_t null_device = {
+    .name = "null",
+    .flags = 0,
+    .read = device_rw_empty,
+    .write = null_write,
+    .seek = device_seek_empty,
+    .tell = device_tell_empty,
+    .read_queue = NULL,
+    .next = NULL,
+};
+
 int register_device(device_t *device) {
+    uint32_t flags = spin_lock_irqsave(&device_lock);
     if (device_head == NULL) {
         device_head = device;
+        spin_unlock_irqrestore(&device_lock, flags);
         return 1;
     }
 
@@ -213,16 +338,20 @@ int register_device(device_t *device) {
     }
     current_device->next = device;
 
+    spin_unlock_irqrestore(&device_lock, flags);
     return 1;
 }
 
 int unregister_device(device_t *device) {
+    uint32_t flags = spin_lock_irqsave(&device_lock);
     if (device_head == NULL) {
+        spin_unlock_irqrestore(&device_lock, flags);
         return 0;
     }
 
     if (device_head == device) {
         device_head = device->next;
+        spin_unlock_irqrestore(&device_lock, flags);
         return 1;
     }
 
@@ -230,10 +359,12 @@ int unregister_device(device_t *device) {
     while (current_device->next != NULL) {
         if (current_device->next == device) {
             current_device->next = device->next;
+            spin_unlock_irqrestore(&device_lock, flags);
             return 1;
         }
         current_device = current_device->next;
     }
+    spin_unlock_irqrestore(&device_lock, flags);
     return 0;
 }
 
@@ -248,26 +379,43 @@ void *dcopy(void *fd) {
 dirent_t *dgetdent(dirent_t *buf, uint32_t entry_num, void *dir) {
     device_dir_t *device_dir = (device_dir_t*)dir;
     if (device_dir->flags & FILE_ISOPENDIR_FLAG) {
+        uint32_t flags = spin_lock_irqsave(&device_lock);
         device_t *current_device = device_head;
-        for (uint32_t i = 0; i < entry_num; i++) {
-            if (current_device == NULL) {
-                return NULL;
-            }
+        for (uint32_t i = 0; i < entry_num && current_device != NULL; i++) {
             current_device = current_device->next;
         }
 
         if (current_device == NULL) {
+            spin_unlock_irqrestore(&device_lock, flags);
             return NULL;
         }
 
         buf->inode = 1;
         strncpy(buf->name, current_device->name, 256);
+        spin_unlock_irqrestore(&device_lock, flags);
         return buf;
     } else {
         return NULL;
     }
 }
 
+int diterate(device_dir_t *dir, dir_context_t *ctx) {
+    if (!(dir->flags & FILE_ISOPENDIR_FLAG)) {
+        return -1;
+    }
+    uint32_t flags = spin_lock_irqsave(&device_lock);
+    device_t *current_device = device_head;
+    for (uint32_t i = 0; i < dir->pos && current_device != NULL; i++) {
+        current_device = current_device->next;
+    }
+    while (current_device != NULL && ctx->emit(ctx, current_device->name, 1, DT_CHR, dir->pos + 1)) {
+        dir->pos++;
+        current_device = current_device->next;
+    }
+    spin_unlock_irqrestore(&device_lock, flags);
+    return 0;
+}
+
 int dstat(void *file_in, stat_t *statbuf) {
     device_file_t *file = (device_file_t*)file_in; //for some reason, this is necessary to get the compiler to stop complaining
     if (!(file->flags & FILE_ISOPEN_FLAG)) {
@@ -311,9 +459,17 @@ void devices_initialize() {
     device_fs.closedir = (int(*)(void*))dclosedir;
     device_fs.copy = dcopy;
     device_fs.getdent = dgetdent;
+    device_fs.readv = (int(*)(iovec_t*, int, void*))dreadv;
+    device_fs.writev = (int(*)(iovec_t*, int, void*))dwritev;
+    device_fs.pread = (int(*)(char*, size_t, size_t, void*))dpread;
+    device_fs.pwrite = (int(*)(char*, size_t, size_t, void*))dpwrite;
+    device_fs.map_page = NULL;
+    device_fs.peek = NULL;
+    device_fs.iterate = (int(*)(void*, dir_context_t*))diterate;
     device_fs_registered = register_filesystem(&device_fs);
     if (!device_fs_registered) {
         kpanic("Failed to register device filesystem!\n");
     }
     mount_filesystem(device_fs_registered, "/dev");
+    register_device(&null_device);
 }
\ No newline at end of file
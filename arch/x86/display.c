@@ -740,14 +740,27 @@ int trm_dev_read(void *ptr, size_t size) {
     return size;
 }
 
+// All the fragments of a prompt or a coloured line in one call, straight into the VGA buffer
+int trm_dev_writev(iovec_t *iov, int iovcnt) {
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        terminal_write(iov[i].iov_base, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
 device_t trm_dev = {
-    "trm",
-    0,
-    trm_dev_read,
-    trm_dev_write,
-    trm_dev_seek,
-    trm_dev_tell,
-    NULL
+    .name = "trm",
+    .flags = 0,
+    .read = trm_dev_read,
+    .write = trm_dev_write,
+    .seek = trm_dev_seek,
+    .tell = trm_dev_tell,
+    .read_queue = NULL,
+    .next = NULL,
+    .readv = NULL,
+    .writev = trm_dev_writev,
 };
 
 void terminal_register_device() {
@@ -5,17 +5,72 @@
 #include "inc_c/display.h"
 #include "inc_c/tables.h"
 #include "inc_c/hardware.h"
+#include "../../kernel/include/timer.h"
+#include "inc_c/process.h"
+#include "inc_c/user.h"
+#include "drivers/PIT.h"
+
+uint32_t pit_divisor = 0;
 
 //PIT
 void timer_phase(int hz)
 {
-    int divisor = 1193180 / hz;
-    outb(0x43, 0x36);
+    int divisor = PIT_FREQUENCY / hz;
+    pit_divisor = divisor;
+    //mode 2 (rate generator) rather than square wave, so the counter can be read back linearly
+    outb(0x43, 0x34);
     outb(0x40, divisor & 0xFF);
     outb(0x40, divisor >> 8);
 }
 
+// Returns how many PIT input clocks have passed since the last tick
+uint32_t timer_read_elapsed()
+{
+    uint32_t flags = irq_save();
+    outb(0x43, 0x00); //latch channel 0
+    uint32_t count = inb(0x40);
+    count |= inb(0x40) << 8;
+    irq_restore(flags);
+    return pit_divisor - count;
+}
+
+void timer_handler(regs_t *r)
+{
+    //without LAPIC timers, only the BSP's time is accounted
+    process_account_tick(r, 1);
+    timer_tick();
+    user_data_update();
+    //one tick per time slice
+    this_cpu_write(resched, true);
+}
+
+// Busy-waits us microseconds on channel 2, one shot at a time; the 16 bit latch runs out at
+// about 54ms. Doesn't need interrupts, so it works for calibrating other timers.
+void pit_wait_us(uint32_t us)
+{
+    while (us > 0) {
+        uint32_t chunk = us > 50000 ? 50000 : us;
+        uint32_t latch = (uint32_t)(((uint64_t)chunk * PIT_FREQUENCY) / 1000000) + 1;
+        //gate channel 2 on, keep the speaker off
+        outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+        //channel 2, lobyte/hibyte, mode 0 (output goes high on terminal count)
+        outb(0x43, 0xB0);
+        outb(0x42, latch & 0xFF);
+        outb(0x42, latch >> 8);
+        while (!(inb(0x61) & 0x20));
+        us -= chunk;
+    }
+}
+
+// Once the local APIC timer drives the tick, IRQ 0 is only noise
+void pit_disable_irq()
+{
+    outb(0x21, inb(0x21) | 0x01);
+}
+
 void timer_install()
 {
-    timer_phase(100);
+    timer_initialize();
+    timer_phase(HZ);
+    irq_install_handler(0, timer_handler);
 }
\ No newline at end of file
@@ -1,6 +1,15 @@
 #ifndef _PIT_H
 #define _PIT_H
 
+#include <stdint.h>
+
+#define PIT_FREQUENCY 1193182
+
 void timer_install();
+uint32_t timer_read_elapsed();
+void pit_wait_us(uint32_t us);
+void pit_disable_irq();
+
+extern uint32_t pit_divisor;
 
-#endif
\ No newline at end of file
+#endif
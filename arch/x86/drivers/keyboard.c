@@ -7,9 +7,12 @@
 #include "../../kernel/include/unused.h"
 #include "inc_c/devices.h"
 #include "../../kernel/include/filesystem.h"
+#include "../../kernel/include/spinlock.h"
 
 char keypress_buffer[256];
-uint8_t keypress_buffer_size = 0;
+volatile uint8_t keypress_buffer_size = 0;
+wait_queue_t kbd_wait = WAIT_QUEUE_INIT; //readers waiting for a keypress
+spinlock_t kbd_lock = SPINLOCK_INIT(LOCK_LEVEL_DRIVER); //keypress_buffer, shared with the interrupt handler
 
 bool shift = false;
 bool caps = false;
@@ -118,6 +121,8 @@ void keyboard_interrupt_handler(regs_t *r)
             caps = !caps;
         }
 
+        //interrupts are already off in here
+        spin_lock(&kbd_lock);
         if (keypress_buffer_size < 255)
         {
             keypress_buffer[keypress_buffer_size] = scancode;
@@ -132,12 +137,15 @@ void keyboard_interrupt_handler(regs_t *r)
             }
             keypress_buffer[255] = scancode;
         }
+        spin_unlock(&kbd_lock);
+
+        wake_up(&kbd_wait);
     }
 }
 
 uint8_t keyboard_getcode()
 {
-    asm volatile("cli");
+    uint32_t flags = spin_lock_irqsave(&kbd_lock);
     if (keypress_buffer_size > 0)
     {
         keypress_buffer_size--;
@@ -147,10 +155,10 @@ uint8_t keyboard_getcode()
         {
             keypress_buffer[i] = keypress_buffer[i + 1];
         }
-        asm volatile("sti");
+        spin_unlock_irqrestore(&kbd_lock, flags);
         return scancode;
     }
-    asm volatile("sti");
+    spin_unlock_irqrestore(&kbd_lock, flags);
     return 0;
 }
 
@@ -189,13 +197,14 @@ char keyboard_getchar()
 int kbd_device_read(void *ptr, uint32_t size)
 {
     uint32_t written = 0;
-    char code;
-    while ((code = keyboard_getchar()) != 0) {
+    while (written < size && keypress_buffer_size > 0) {
+        char code = keyboard_getchar();
+        if (code == 0) {
+            //modifier or unmapped key, keep draining the buffer
+            continue;
+        }
         *(char *)(ptr + written) = code;
         written++;
-        if (written >= size) {
-            return written;
-        }
     }
 
     return written;
@@ -208,6 +217,7 @@ device_t kbd_device = {
     .write = device_rw_empty,
     .seek = device_seek_empty,
     .tell = device_tell_empty,
+    .read_queue = &kbd_wait,
     .next = NULL,
 };
 
@@ -0,0 +1,223 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "inc_c/fpu.h"
+#include "inc_c/hardware.h"
+#include "inc_c/memory.h"
+#include "inc_c/process.h"
+#include "inc_c/string.h"
+#include "inc_c/smp.h"
+
+// Lazy FPU/SSE switching. The registers belong to fpu_owner until some other task touches them:
+// switching to anyone else sets CR0.TS, so their first FPU/SSE instruction raises #NM, and only
+// then is the owner's state saved and theirs loaded. Tasks that never use the FPU never pay for it.
+// Each CPU has its own registers and owner. With several CPUs, a task switched out with live
+// registers has them saved right away, since it may resume on a CPU that can't reach them.
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+bool fpu_has_fxsr = false;
+bool fpu_has_sse = false;
+
+uint8_t fpu_init_state[FPU_STATE_SIZE] __attribute__((aligned(16))); //what a task sees the first time it uses the FPU
+
+static inline void clts() {
+    asm volatile ("clts");
+    this_cpu()->fpu_ts_set = false;
+}
+
+static inline void stts() {
+    uint32_t cr0;
+    asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile ("mov %0, %%cr0" : : "r"(cr0 | CR0_TS));
+    this_cpu()->fpu_ts_set = true;
+}
+
+// Whether process' newest state is in this CPU's registers
+static inline bool fpu_live(cpu_t *cpu, process_t *process) {
+    return process != NULL && cpu->fpu_owner == process && process->fpu_cpu == cpu->index;
+}
+
+static inline void fpu_save(void *state) {
+    if (fpu_has_fxsr) {
+        asm volatile ("fxsave (%0)" : : "r"(state) : "memory");
+    } else {
+        //fnsave also reinitializes the FPU, which doesn't matter since it's about to be reloaded
+        asm volatile ("fnsave (%0)" : : "r"(state) : "memory");
+    }
+}
+
+static inline void fpu_restore(void *state) {
+    if (fpu_has_fxsr) {
+        asm volatile ("fxrstor (%0)" : : "r"(state) : "memory");
+    } else {
+        asm volatile ("frstor (%0)" : : "r"(state) : "memory");
+    }
+}
+
+// FXSAVE needs a 16 byte aligned area, and kmalloc doesn't promise that
+static void fpu_alloc_state(process_t *process) {
+    process->fpu_alloc = kmalloc(FPU_STATE_SIZE + 15);
+    process->fpu_state = (void *)(((uint32_t)process->fpu_alloc + 15) & ~15);
+}
+
+// Per-CPU part: every CPU has to turn on its own FPU and SSE
+void fpu_cpu_initialize() {
+    uint32_t cr0;
+    asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    asm volatile ("mov %0, %%cr0" : : "r"(cr0));
+
+    if (fpu_has_fxsr) {
+        uint32_t cr4;
+        asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= CR4_OSFXSR;
+        if (fpu_has_sse) {
+            //SSE exceptions go to #XM rather than being reported as x87 errors
+            cr4 |= CR4_OSXMMEXCPT;
+        }
+        asm volatile ("mov %0, %%cr4" : : "r"(cr4));
+    }
+
+    asm volatile ("fninit");
+
+    this_cpu()->fpu_owner = NULL;
+    this_cpu()->fpu_ts_set = false;
+}
+
+void fpu_initialize() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    fpu_has_fxsr = edx & (1 << 24);
+    fpu_has_sse = edx & (1 << 25);
+
+    fpu_cpu_initialize();
+
+    memset(fpu_init_state, 0, sizeof(fpu_init_state));
+    fpu_save(fpu_init_state);
+    if (!fpu_has_fxsr) {
+        asm volatile ("fninit");
+    }
+}
+
+// Called by the scheduler before switching from prev to next
+void fpu_switch(struct process *prev, struct process *next) {
+    cpu_t *cpu = this_cpu();
+
+    if (smp_active && !cpu->fpu_ts_set && fpu_live(cpu, prev)) {
+        //prev may have used the registers this time slice, and may resume on another CPU
+        fpu_save(((process_t *)prev)->fpu_state);
+    }
+
+    if (fpu_live(cpu, next)) {
+        //its state never left the registers, so no trap needed
+        if (cpu->fpu_ts_set) {
+            clts();
+        }
+    } else if (!cpu->fpu_ts_set) {
+        stts();
+    }
+}
+
+// #NM: the current task touched the FPU while someone else's state was loaded
+void fpu_trap() {
+    clts();
+
+    cpu_t *cpu = this_cpu();
+    process_t *process = cpu->current;
+    if (process == NULL || fpu_live(cpu, process)) {
+        return;
+    }
+
+    //with several CPUs the owner was saved when it was switched out
+    if (!smp_active && fpu_live(cpu, cpu->fpu_owner)) {
+        fpu_save(((process_t *)cpu->fpu_owner)->fpu_state);
+    }
+    if (process->fpu_state == NULL) {
+        fpu_alloc_state(process);
+        memcpy(process->fpu_state, fpu_init_state, FPU_STATE_SIZE);
+    }
+    fpu_restore(process->fpu_state);
+    cpu->fpu_owner = process;
+    process->fpu_cpu = cpu->index;
+}
+
+// Gives the child a copy of the parent's FPU state, if the parent has one
+void fpu_fork(struct process *parent, struct process *child) {
+    uint32_t flags = irq_save();
+
+    child->fpu_state = NULL;
+    child->fpu_alloc = NULL;
+    if (parent->fpu_state != NULL) {
+        if (fpu_live(this_cpu(), parent)) {
+            //the registers are newer than the saved copy
+            clts();
+            fpu_save(parent->fpu_state);
+            fpu_restore(parent->fpu_state);
+        }
+        fpu_alloc_state(child);
+        memcpy(child->fpu_state, parent->fpu_state, FPU_STATE_SIZE);
+    }
+
+    irq_restore(flags);
+}
+
+// The process is exiting, so whatever's in the registers can be thrown away
+void fpu_release(struct process *process) {
+    uint32_t flags = irq_save();
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        if (cpus[i].fpu_owner == process) {
+            cpus[i].fpu_owner = NULL;
+        }
+    }
+    irq_restore(flags);
+}
+
+void fpu_free(struct process *process) {
+    if (process->fpu_alloc != NULL) {
+        kfree(process->fpu_alloc);
+    }
+    process->fpu_alloc = NULL;
+    process->fpu_state = NULL;
+}
+
+// The process is replacing its program, which starts out with a clean FPU like a new task would.
+// Its next FPU instruction traps, and gets fpu_init_state.
+void fpu_exec(struct process *process) {
+    uint32_t flags = irq_save();
+    fpu_release(process);
+    if (!this_cpu()->fpu_ts_set) {
+        stts();
+    }
+    fpu_free(process);
+    irq_restore(flags);
+}
+
+// Lets kernel code use x87/SSE registers. Saves the owner's state first, and keeps interrupts off
+// until kernel_fpu_end so nothing can switch tasks in the middle.
+uint32_t kernel_fpu_begin() {
+    uint32_t flags = irq_save();
+
+    cpu_t *cpu = this_cpu();
+    clts();
+    if (fpu_live(cpu, cpu->fpu_owner) && (cpu->fpu_owner == cpu->current || !smp_active)) {
+        fpu_save(((process_t *)cpu->fpu_owner)->fpu_state);
+    }
+    cpu->fpu_owner = NULL;
+    asm volatile ("fninit");
+
+    return flags;
+}
+
+void kernel_fpu_end(uint32_t flags) {
+    //nobody owns the registers now, so the next task to touch them reloads its state
+    stts();
+    irq_restore(flags);
+}
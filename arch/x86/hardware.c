@@ -10,4 +10,19 @@ void hardware_initialize()
     syscall_initialize();
     timer_install();
     keyboard_install();
+}
+
+// Disables interrupts and returns the previous EFLAGS, so nested sections don't re-enable them early
+uint32_t irq_save()
+{
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Puts EFLAGS back exactly as irq_save found it, so interrupts end up off again if they were off
+// before, even if something in between turned them on
+void irq_restore(uint32_t flags)
+{
+    asm volatile("push %0; popf" : : "g"(flags) : "memory", "cc");
 }
\ No newline at end of file
@@ -20,9 +20,10 @@ paging_init:
     mov %ecx, page_directory-VIRTUAL_ADDRESS+0x4
     mov %ecx, page_directory-VIRTUAL_ADDRESS+0xC04
 
-    /* Enable paging */
+    /* Enable paging, and write protection so even the kernel faults writing to a read-only */
+    /* user page, which copy-on-write depends on */
     mov %cr0, %ecx
-    or $0x80000000, %ecx
+    or $0x80010000, %ecx
     mov %ecx, %cr0
 
     /* bump stack up by 3GB */
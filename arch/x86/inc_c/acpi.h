@@ -0,0 +1,52 @@
+#ifndef _ACPI_H
+#define _ACPI_H
+
+#include <stdint.h>
+
+typedef struct {
+    char signature[8]; //"RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_addr;
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    char signature[4];
+    uint32_t length; //including this header
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+// MADT ("APIC"): the interrupt controllers, and through them the CPUs
+typedef struct {
+    acpi_header_t header;
+    uint32_t lapic_addr;
+    uint32_t flags;
+    //variable length entries follow, each starting with madt_entry_t
+} __attribute__((packed)) acpi_madt_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) madt_entry_t;
+
+#define MADT_TYPE_LAPIC 0
+
+typedef struct {
+    madt_entry_t entry;
+    uint8_t acpi_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed)) madt_lapic_t;
+
+#define MADT_LAPIC_ENABLED 0x1
+
+acpi_header_t *acpi_find_table(const char *signature);
+
+#endif
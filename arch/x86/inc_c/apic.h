@@ -0,0 +1,69 @@
+#ifndef _APIC_H
+#define _APIC_H
+
+#include <stdint.h>
+
+#include "inc_c/hardware.h"
+
+#define LAPIC_ID 0x020
+#define LAPIC_TPR 0x080
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SVR 0x0F0
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+#define LAPIC_TIMER_VECTOR 0xEF
+
+#define LVT_MASKED 0x00010000
+#define LVT_TIMER_PERIODIC 0x00020000
+#define LVT_TIMER_TSC_DEADLINE 0x00040000
+
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+#define MSR_TSC_DEADLINE 0x6E0
+
+#define LAPIC_TIMER_OFF 0 //no local APIC, the PIT drives the tick
+#define LAPIC_TIMER_PERIODIC 1
+#define LAPIC_TIMER_DEADLINE 2 //one shot, armed with an absolute TSC value
+
+#define ICR_INIT 0x00000500
+#define ICR_STARTUP 0x00000600
+#define ICR_DELIVERY_PENDING 0x00001000
+#define ICR_ASSERT 0x00004000
+#define ICR_LEVEL 0x00008000
+#define ICR_ALL_BUT_SELF 0x000C0000
+
+extern volatile uint32_t *lapic;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static inline uint32_t lapic_id() {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+static inline void lapic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_initialize(uint32_t phys);
+void lapic_enable();
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr);
+void lapic_timer_initialize();
+void lapic_timer_start();
+void lapic_timer_interrupt(regs_t *r);
+
+extern uint32_t lapic_timer_mode;
+extern uint32_t lapic_timer_khz;
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include "inc_c/memory.h"
+#include "../../kernel/include/filesystem.h"
 
 typedef struct {
     int code;
@@ -21,5 +22,6 @@ typedef struct {
 
 elf_load_result_t elf_load_executable(void *elf_file);
 elf_load_result_t elf_load_executable_path(char *path);
+elf_load_result_t elf_load_file(file_descriptor_t *fd, page_directory_t *pd);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,37 @@
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../../kernel/include/timer.h"
+
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+#define CLOCK_MONOTONIC_RAW 4
+#define CLOCK_BOOTTIME 7
+
+#define NSEC_PER_SEC 1000000000ULL
+
+#define CLOCKSOURCE_PIT 0
+#define CLOCKSOURCE_TSC 1
+
+#define CLOCK_SHIFT 22 //cycles -> ns conversion is (cycles * clock_mult) >> CLOCK_SHIFT
+
+void clock_initialize();
+uint64_t clock_cycles();
+uint32_t clock_cycles_khz();
+uint64_t clock_boot_ns();
+uint64_t clock_monotonic_ns();
+uint64_t clock_cycles_to_ns(uint64_t cycles);
+void clock_udelay(uint32_t us);
+int clock_gettime(uint32_t clock_id, timespec_t *ts);
+
+extern uint32_t clocksource;
+extern uint32_t tsc_khz;
+extern uint32_t clock_mult;
+extern uint64_t tsc_at_boot;
+extern uint32_t boot_epoch;
+extern bool tsc_invariant;
+
+#endif
@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 
+#include "../../kernel/include/waitqueue.h"
+#include "../../kernel/include/filesystem.h"
+
 typedef struct {
     uint32_t flags;
     uint32_t pos;
@@ -17,7 +20,10 @@ typedef struct device {
     int (*seek)(size_t offset, int whence);
     size_t (*tell)();
     //other functions generally return 0/NULL on success and -1/NULL on failure since devices are not files
+    wait_queue_t *read_queue; //if set, reads returning no data sleep here until the device wakes the queue
     struct device *next;
+    int (*readv)(iovec_t *iov, int iovcnt); //optional, otherwise vectored I/O is one read or write per buffer
+    int (*writev)(iovec_t *iov, int iovcnt);
 } device_t;
 
 typedef struct {
@@ -0,0 +1,24 @@
+#ifndef _FPU_H
+#define _FPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct process;
+
+#define FPU_STATE_SIZE 512 //FXSAVE area; FSAVE only needs 108 bytes of it
+
+void fpu_initialize();
+void fpu_cpu_initialize();
+void fpu_switch(struct process *prev, struct process *next);
+void fpu_trap();
+void fpu_fork(struct process *parent, struct process *child);
+void fpu_release(struct process *process);
+void fpu_free(struct process *process);
+void fpu_exec(struct process *process);
+uint32_t kernel_fpu_begin();
+void kernel_fpu_end(uint32_t flags);
+
+extern bool fpu_has_fxsr;
+
+#endif
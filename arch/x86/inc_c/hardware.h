@@ -15,5 +15,7 @@ typedef struct {
 void hardware_initialize();
 void irq_install_handler(int irq, void (*handler)(regs_t *r));
 void irq_uninstall_handler(int irq);
+uint32_t irq_save();
+void irq_restore(uint32_t flags);
 
 #endif
\ No newline at end of file
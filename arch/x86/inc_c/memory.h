@@ -6,6 +6,10 @@
 
 #include "inc_c/multiboot.h"
 
+#define PAGE_SHARED 0x200 //available bit: a kernel-owned frame mapped into user space, see map_shared_page
+#define PAGE_COW 0x400 //available bit: a read-only PAGE_SHARED page the user may write to, see map_cow_page
+#define PAGE_LAZY 0x800 //available bit, in a not-present entry: reserved, zeroed on first touch, see map_lazy_page
+
 typedef struct {
     uint32_t pd_entry;
     uint32_t pt_entry;
@@ -41,6 +45,9 @@ typedef struct {
     uint32_t virt[1024]; //virtual addresses of the page tables
     bool is_full[1024];
     uint32_t phys_addr;
+    uint32_t refcount; //tasks using it; threads share their creator's
+    uint32_t brk_start; //where the program's heap starts, just past its highest segment, see brk
+    uint32_t brk; //where the heap ends now
 } __attribute__((packed)) page_directory_t;
 
 void memory_initialize(multiboot_info_t *mboot_info);
@@ -52,13 +59,27 @@ void kfree(void *ptr);
 void kfree_a(void *ptr);
 void heap_dump();
 page_table_entry_t first_free_page();
+bool find_free_page(page_table_entry_t *page);
 void alloc_page(uint32_t virt, uint32_t phys, bool make, bool is_kernel, bool is_writeable);
 void alloc_page_kmalloc(uint32_t virt, uint32_t phys, bool make, bool is_kernel, bool is_writeable, page_directory_t *pd);
 page_directory_t *clone_page_directory(page_directory_t *directory);
 void switch_page_directory(page_directory_t *directory);
 void free_page_directory(page_directory_t *directory);
+void page_directory_get(page_directory_t *directory);
+void page_directory_put(page_directory_t *directory);
 uint32_t virt_to_phys(uint32_t virt, page_directory_t *pd);
+void map_shared_page(uint32_t virt, uint32_t phys, bool is_writeable, page_directory_t *pd);
+void map_cow_page(uint32_t virt, uint32_t phys, page_directory_t *pd);
+bool cow_page_fault(uint32_t virt, page_directory_t *pd);
+void map_lazy_page(uint32_t virt, bool is_writeable, page_directory_t *pd);
+bool lazy_page_fault(uint32_t virt, page_directory_t *pd);
 void free_page(uint32_t virt, page_directory_t *pd);
+void unmap_page(uint32_t virt, page_directory_t *pd);
 void phys_copypage(uint32_t src, uint32_t dest);
+void phys_fill(uint32_t phys, uint32_t offset, const void *src, uint32_t length);
+bool page_is_mapped(uint32_t virt, page_directory_t *pd);
+bool page_is_used(uint32_t virt, page_directory_t *pd);
+bool page_is_writable(uint32_t virt, page_directory_t *pd);
+void *map_mmio(uint32_t phys, uint32_t size);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,54 @@
+#ifndef _MMAP_H
+#define _MMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../../kernel/include/filesystem.h"
+
+// mmap(addr, length, prot, flags, fd, offset) maps length bytes of fd from offset (which must be
+// page aligned), or zeroes with MAP_ANONYMOUS, into the calling process, and returns where.
+// Without MAP_FIXED, addr is only a hint; with it, whatever was mapped there is replaced.
+// Anonymous pages are only reserved: each gets a zeroed frame the first time it's touched.
+//
+// Pages the filesystem already keeps in memory for good (see filesystem_t.map_page, the ramdisk
+// does) are mapped straight from there, so mapping a file costs page table entries, not copies:
+// read-only, or copy-on-write with MAP_PRIVATE and PROT_WRITE. Any other page is read into a
+// frame of its own, and the part past the end of the file is zeroes. Nothing is ever written
+// back, so MAP_SHARED with PROT_WRITE is only allowed for anonymous memory.
+//
+// x86 pages can't be write-only or execute-only, so every mapping must have PROT_READ.
+//
+// brk(addr) moves the program break, the end of the heap that starts just past the program's
+// highest segment, and returns where it ends up; brk(0) just asks. Heap pages are reserved the
+// same way as anonymous ones. sbrk is the user code page's, see user.h, since the break is kept
+// in user_process_data_t and reading it needs no syscall.
+
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+
+#define MAP_SHARED 0x1
+#define MAP_PRIVATE 0x2
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+
+#define MAP_FAILED ((void *)-1)
+
+#define MMAP_BASE 0x40000000 //where mmap starts looking for room when it isn't given an address
+
+// What SYSCALL_MMAP's ebx points to, since there are more arguments than registers
+typedef struct {
+    uint32_t addr;
+    uint32_t length;
+    uint32_t prot;
+    uint32_t flags;
+    int32_t fd; //ignored with MAP_ANONYMOUS
+    uint32_t offset;
+} mmap_args_t;
+
+void *mmap(void *addr, size_t length, int prot, int flags, file_descriptor_t *fd, size_t offset);
+int munmap(void *addr, size_t length);
+uint32_t brk(uint32_t addr);
+
+#endif
@@ -2,28 +2,70 @@
 #define _PROCESS_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "inc_c/hardware.h"
 #include "../../kernel/include/filesystem.h"
 #include "inc_c/memory.h"
+#include "../../kernel/include/waitqueue.h"
+#include "../../kernel/include/timer.h"
+#include "inc_c/smp.h"
+
+// Callee-saved registers plus where to resume, like a jmp_buf. Used to start a forked child
+// exactly where its parent called save_context.
+typedef struct {
+    uint32_t edi, esi, ebx, ebp;
+    uint32_t esp, eip;
+} jmp_context_t;
+
+// Counters for /proc. Each is only ever bumped by the CPU the task is running on, so they cost
+// an increment and need no locking.
+typedef struct {
+    uint32_t utime; //ticks spent in program code
+    uint32_t stime; //ticks spent in the kernel
+    uint32_t nvcsw; //times it gave up the CPU to sleep or exit
+    uint32_t nivcsw; //times it was preempted
+    uint32_t page_faults;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint32_t start_jiffies;
+} process_stats_t;
 
 typedef struct process {
-    int pid;
+    int pid; //unique to each task, threads included
+    int tgid; //pid of the task that started its thread group; its own pid unless it's a thread
     volatile uint32_t status;
+    uint32_t flags;
+    char name[16];
     uint32_t stack_pos;
     uint32_t stack_size;
-    uint32_t esp, ebp;
+    uint32_t context_esp; //saved by switch_context: points at callee-saved registers and a return address
     uint32_t entry_or_return;
-    file_descriptor_t *fds[256];
-    uint32_t num_fds;
-    uint32_t max_fds;
-    struct process *next;
-    page_directory_t *pd;
+    fd_table_t *files; //shared by the threads of a process
+    struct uring *uring; //set up by uring_setup, NULL until then
+    struct process *next; //all-tasks list
+    struct process *prev;
+    struct process *hash_next; //next process in the same pid hash bucket
+    struct process *run_next; //next runnable process, only valid while on the run queue
+    struct process *wait_next; //next sleeper, only valid while on a wait queue
+    page_directory_t *pd; //shared by the threads of a process
+    wait_queue_t exit_queue; //woken when the process finishes
+    void *kstack; //kmalloc'd kernel stack, new tasks start on it. Freed by the reaper.
+    void *thread_arg; //passed to a kernel or user thread's entry function
+    jmp_context_t fork_context; //where a forked child resumes
+    void *fpu_state; //16 byte aligned FXSAVE area, allocated the first time the task uses the FPU
+    void *fpu_alloc;
+    uint32_t fpu_cpu; //which CPU last loaded fpu_state into its registers
+    uint32_t cpu; //whose run queue it goes on
+    volatile bool on_cpu; //still running, or not yet fully switched out; nobody else may switch to it
+    int32_t lock_depth; //big kernel lock depth, saved while switched out
+    process_stats_t stats;
 
     // Things to pass to the process
     int argc;
     char **argv;
     char **envp;
+    void *args_alloc; //kernel copy of argv and envp for a spawned or exec'd program, freed once they're on its stack
 } process_t;
 
 #define TASK_STATUS_INITIALIZED 0
@@ -32,14 +74,102 @@ typedef struct process {
 #define TASK_STATUS_STOPPED 3
 #define TASK_STATUS_FINISHED 4
 #define TASK_STATUS_FORKED 5
+#define TASK_STATUS_EXITING 6 //off the CPU for good, waiting for the reaper to free its resources
+
+#define PROCESS_FLAG_KTHREAD 0x1 //runs in kernel_pd on a kmalloc'd stack, no fds or argv
+#define PROCESS_FLAG_IDLE 0x2 //a CPU's idle thread, runs without the big kernel lock
+#define PROCESS_FLAG_PINNED 0x4 //never moved off the CPU in ->cpu
+#define PROCESS_FLAG_THREAD 0x8 //shares its creator's page directory and fds, stays around after exiting until joined
+#define PROCESS_FLAG_JOINING 0x10 //a thread someone is already waiting for in thread_join
+#define PROCESS_FLAG_DETACHED 0x20 //not a thread, and nobody holds the struct: the reaper frees it
+
+#define KSTACK_SIZE 0x4000 //every task gets one; kernel threads run on it for their whole life, the rest for syscalls and interrupts
+#define PROCESS_STACK_SIZE 0x4000 //user stack of a spawned or exec'd program
+#define PROCESS_ARGS_MAX 0x2000 //most bytes argv and envp can take up together, pointers included
+
+// Thread stacks are stacked below the main one, in the 4MB under the kernel that programs can't
+// load into, down to the user code page at its bottom (see user.h). Each has an unmapped page
+// below it, so running off the end faults instead of scribbling over the next thread's stack.
+#define THREAD_STACK_SIZE 0x4000
+#define THREAD_STACK_GAP 0x1000
+#define THREAD_STACK_AREA 0x400000
+
+#define PID_MAX 32768 //pids wrap around to PID_MIN after this
+#define PID_MIN 1 //pid 0 is the kernel, and is never recycled
+#define PID_HASH_SIZE 256 //must be a power of two
+
+// What a spawned child's fd table should look like, like posix_spawn_file_actions_t. The child
+// starts with a copy of every fd the caller has open (or none, with SPAWN_INHERIT_NONE), then the
+// actions are applied to that copy in order. The caller's own fds are never touched.
+#define SPAWN_INHERIT_NONE 0x1
+
+#define SPAWN_ACTION_DUP2 0 //fd is copied to new_fd, replacing whatever was there
+#define SPAWN_ACTION_CLOSE 1 //fd is closed
+#define SPAWN_ACTION_OPEN 2 //path is opened with mode as fd, replacing whatever was there
+
+typedef struct {
+    uint32_t action;
+    int fd;
+    int new_fd;
+    char *path;
+    char *mode;
+} spawn_file_action_t;
+
+typedef struct {
+    uint32_t flags;
+    uint32_t count;
+    spawn_file_action_t *actions;
+} spawn_file_actions_t;
+
+// A consistent copy of what /proc shows about a process, see process_get_info
+typedef struct {
+    int pid;
+    int tgid;
+    char name[16];
+    uint32_t status;
+    uint32_t flags;
+    uint32_t cpu;
+    uint32_t num_fds;
+    uint32_t resident_pages; //present pages below the kernel in its page directory
+    uint32_t lazy_pages; //reserved by brk or anonymous mmap, but not touched yet
+    uint32_t heap_size; //bytes between the start of the heap and the program break
+    process_stats_t stats;
+} process_info_t;
+
+// Load averages are fixed point with FSHIFT fractional bits, like Linux
+#define FSHIFT 11
+#define FIXED_1 (1 << FSHIFT)
+#define LOAD_FREQ (5 * HZ) //how often the averages are updated
 
 void process_initialize();
 process_t *process_load_elf(char *path);
+process_t *process_spawn(char *path, char **argv, char **envp, spawn_file_actions_t *actions);
+int process_spawn_detached(char *path, char **argv, char **envp, spawn_file_actions_t *actions);
+int process_exec(char *path, char **argv, char **envp);
 process_t *create_task(void *entry_point, uint32_t stack_size, page_directory_t *pd, int argc, char **argv, char **envp);
 void free_process(process_t *process);
+void process_release(process_t *process);
 uint32_t fork();
+void process_yield();
+void schedule();
+void schedule_tail();
+void process_block();
+void process_wake(process_t *process);
+process_t *process_by_pid(int pid);
+bool process_get_info(int pid, process_info_t *info);
+int process_nth_pid(uint32_t n);
+uint32_t process_count();
+void process_account_tick(regs_t *r, uint32_t ticks);
+process_t *thread_create(void *entry_point, void *arg);
+void thread_exit(int code);
+int thread_join(int tid, int *code);
+process_t *kthread_create(int (*fn)(void *arg), void *arg, char *name);
+void kthread_exit(int code);
+int idle_task(void *arg);
+process_t *idle_create(cpu_t *cpu);
 
 extern process_t *head_process;
-extern process_t *current_process;
+extern uint32_t next_pid;
+extern uint32_t load_averages[3]; //1, 5 and 15 minutes, FIXED_1 is a load of 1
 
 #endif
\ No newline at end of file
@@ -19,6 +19,9 @@
 //  - The file and directory entries for the directory
 //  - 2 bytes: a magic number declaring the end of the directory (uint16)
 
+//Each file's data starts on a page boundary of the image (which is loaded page aligned), so
+//mmap can map it without copying. The gaps between files are zeroes.
+
 #include <stdint.h>
 
 #define FILE_ENTRY_MAGIC 0xBAE7
@@ -67,6 +70,9 @@ void ramdisk_initialize();
 ramdisk_file_t *ropen(char *path, char *flags);
 int rread(void *ptr, size_t size, size_t nmemb, ramdisk_file_t *file);
 int rseek(ramdisk_file_t *file, size_t offset, int whence);
+int rpread(void *ptr, size_t count, size_t offset, ramdisk_file_t *file);
+uint32_t rmap_page(ramdisk_file_t *file, size_t offset);
+int rpeek(char **buf, size_t count, size_t offset, ramdisk_file_t *file);
 ramdisk_dir_t *ropendir(char *path);
 
 #endif
\ No newline at end of file
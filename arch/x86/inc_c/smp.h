@@ -0,0 +1,101 @@
+#ifndef _SMP_H
+#define _SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "inc_c/memory.h"
+#include "inc_c/tables.h"
+#include "inc_c/apic.h"
+#include "../../kernel/include/spinlock.h"
+
+struct process;
+
+#define MAX_CPUS 8
+
+#define IPI_RESCHEDULE_VECTOR 0xF0
+#define IPI_TLB_FLUSH_VECTOR 0xF1
+#define IRQ_COUNT_VECTORS (256 - 32) //every vector above the exceptions
+
+// Everything a CPU needs to itself. Only ever touched by its own CPU, except the run queue
+// (under rq_lock) and online/idle, which are read by whoever picks a CPU for a new task.
+typedef struct cpu {
+    struct cpu *self; //what this_cpu reads through %gs
+    uint32_t index;
+    uint32_t apic_id;
+    volatile bool online;
+    struct process *current;
+    struct process *idle;
+    struct process *prev; //task being switched away from, until schedule_tail marks it off the CPU
+    page_directory_t *pd;
+    volatile bool resched; //need_resched for this CPU
+    int32_t lock_depth; //how many times the running task holds the big kernel lock
+    volatile bool lock_wait; //spinning for the big kernel lock, with interrupts off
+    volatile bool tlb_flush; //has to reload cr3 before it touches user memory again, see smp_flush_tlb
+    uint64_t timer_deadline; //TSC value the next tick is due at, in LAPIC_TIMER_DEADLINE mode
+    uint32_t locks_held; //bit per LOCK_LEVEL_* held, only kept with LOCK_DEBUG
+    uint32_t irq_counts[IRQ_COUNT_VECTORS]; //interrupts taken, by vector - 32, for /proc/interrupts
+
+    spinlock_t rq_lock;
+    struct process *rq_head;
+    struct process *rq_tail;
+    volatile uint32_t rq_length;
+
+    struct process *fpu_owner; //whose state is in this CPU's FPU registers
+    bool fpu_ts_set; //mirrors CR0.TS
+
+    gdt_entry_t gdt[GDT_ENTRIES];
+    gdt_ptr_t gdt_ptr;
+    tss_t tss;
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern uint32_t num_cpus;
+extern bool smp_active;
+extern uint8_t apic_to_cpu[256];
+
+// A field of the CPU we're running on, read or written in one instruction through the per-CPU
+// segment in %gs (see GDT_CPU_SELECTOR), so being preempted and moved to another CPU can't come
+// between finding the CPU and using the field.
+#define this_cpu_read(field) ({ \
+    __typeof__(((cpu_t *)0)->field) this_cpu_value; \
+    asm volatile ("mov %%gs:%c1, %0" : "=q"(this_cpu_value) : "i"(offsetof(cpu_t, field))); \
+    this_cpu_value; \
+})
+#define this_cpu_write(field, value) do { \
+    __typeof__(((cpu_t *)0)->field) this_cpu_value = (value); \
+    asm volatile ("mov %0, %%gs:%c1" : : "q"(this_cpu_value), "i"(offsetof(cpu_t, field)) : "memory"); \
+} while (0)
+
+// The pointer is only good while nothing can move us: with interrupts off, or for fields that are
+// the same on every CPU a task could be on. Holding the big kernel lock isn't enough, since
+// irq_handler preempts kernel code too, and the lock is dropped in schedule, where another CPU
+// can steal the task (run_queue_steal). So anything that reads, then writes, its CPU's fields
+// does it under irq_save.
+static inline cpu_t *this_cpu() {
+    return this_cpu_read(self);
+}
+
+// The running task and its address space are the same whichever CPU it's on, so one read is
+// always right. need_resched may be read on the CPU we're about to leave, which only costs a
+// schedule() sooner or later than needed.
+#define current_process (this_cpu_read(current))
+#define current_pd (this_cpu_read(pd))
+#define need_resched (this_cpu_read(resched))
+
+void smp_initialize();
+void smp_send_reschedule(cpu_t *cpu);
+void smp_send_reschedule_all();
+void smp_reschedule_interrupt();
+void smp_flush_tlb(page_directory_t *pd);
+void smp_tlb_flush_interrupt();
+
+void lock_kernel();
+void unlock_kernel();
+int32_t release_kernel_lock();
+void reacquire_kernel_lock(int32_t depth);
+
+extern spinlock_t kernel_lock;
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef _SYSCALL_H
 #define _SYSCALL_H
 
+#include <stdint.h>
+
 #include "inc_c/hardware.h"
 
 #define SYSCALL_READ 0
@@ -8,10 +10,45 @@
 #define SYSCALL_OPEN 2
 #define SYSCALL_CLOSE 3
 #define SYSCALL_FSTAT 5
+#define SYSCALL_LSEEK 8
+#define SYSCALL_MMAP 9
+#define SYSCALL_MUNMAP 11
+#define SYSCALL_BRK 12
+#define SYSCALL_PREAD 17
+#define SYSCALL_PWRITE 18
+#define SYSCALL_READV 19
+#define SYSCALL_WRITEV 20
+#define SYSCALL_NANOSLEEP 35
+#define SYSCALL_GETPID 39
+#define SYSCALL_SENDFILE 40
+#define SYSCALL_CLONE 56
+#define SYSCALL_SPAWN 58
+#define SYSCALL_EXEC 59
 #define SYSCALL_EXIT 60
+#define SYSCALL_THREAD_JOIN 61
 #define SYSCALL_GETDENT 78
+#define SYSCALL_FUTEX 202
+#define SYSCALL_GETDENTS64 217
+#define SYSCALL_CLOCK_GETTIME 228
+#define SYSCALL_URING_SETUP 240
+#define SYSCALL_URING_ENTER 241
+
+#define SYSCALL_HIST_BUCKETS 32
+
+typedef void (*syscall_handler_t)(regs_t *regs);
+
+typedef struct {
+    uint32_t calls;
+    uint32_t errors; //calls that returned -1
+    uint64_t cycles; //clock_cycles() spent in the handler, over all calls that returned
+    uint32_t histogram[SYSCALL_HIST_BUCKETS]; //by log2 of the cycles each call took
+} syscall_stat_t;
+
+extern syscall_handler_t syscall_handlers[256];
+extern syscall_stat_t syscall_stats[256];
 
 void syscall_handler(regs_t *regs);
 void syscall_initialize();
+void syscall_stats_initialize();
 
 #endif
\ No newline at end of file
@@ -17,6 +17,23 @@ typedef struct {
     uint32_t base;
 } __attribute__((packed)) gdt_ptr_t;
 
+// Only esp0/ss0 matter to us: they're the stack the CPU switches to on an interrupt from ring 3
+typedef struct {
+    uint32_t prev_tss;
+    uint32_t esp0, ss0;
+    uint32_t esp1, ss1;
+    uint32_t esp2, ss2;
+    uint32_t cr3, eip, eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs;
+    uint32_t ldt;
+    uint16_t trap, iomap_base;
+} __attribute__((packed)) tss_t;
+
+#define GDT_ENTRIES 7 //null, kernel code/data, user code/data, TSS, per-CPU data
+#define GDT_TSS_SELECTOR 0x28
+#define GDT_CPU_SELECTOR 0x30 //%gs in the kernel: based at this CPU's cpu_t, see this_cpu
+
 typedef struct {
     uint16_t offset_low;
     uint16_t selector;
@@ -33,5 +50,7 @@ typedef struct {
 void gdt_initialize();
 void idt_initialize();
 void tables_initialize();
+void gdt_install_cpu(gdt_entry_t *cpu_gdt, gdt_ptr_t *cpu_gdt_ptr, tss_t *tss, void *cpu, uint32_t cpu_size);
+void idt_install_cpu();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdint.h>
+
+#include "inc_c/hardware.h"
+
+struct process;
+
+// Submission and completion rings, like io_uring: a program queues syscalls in memory it shares
+// with the kernel, and has a whole batch run with one uring_enter instead of one trap each.
+//
+// uring_setup(addr, entries) maps the rings at addr, which must be page aligned, below the shared
+// user pages and not mapped yet. entries is the size of the submission ring, a power of two up to
+// URING_MAX_ENTRIES; the completion ring is twice as big. The memory starts with a
+// uring_header_t, and the rings are at the offsets it gives.
+//
+// To submit, fill in sqes[sq_tail & (entries - 1)] and bump sq_tail. uring_enter(count) then
+// runs up to count queued entries, in order, exactly as if they'd been made as syscalls, and
+// posts each result to cqes[cq_tail & (2 * entries - 1)]. The program consumes completions by
+// bumping cq_head. Entries stay queued if the completion ring is full.
+// Returns how many entries it ran, or -1 if the rings have been unmapped, even partway through.
+//
+// Entries run one after another on the calling thread, so one that sleeps (a read from a tty
+// with nothing typed yet) holds up the rest of the batch until it completes. By then sq_head is
+// already past it, so the program may reuse its slot, but its completion only shows up once it
+// has finished.
+
+#define URING_MAX_ENTRIES 256
+
+typedef struct {
+    uint32_t opcode; //syscall number: SYSCALL_READ, WRITE, READV, WRITEV, PREAD, PWRITE, LSEEK,
+                     //SENDFILE, OPEN, CLOSE, FSTAT, GETDENT or GETDENTS64
+    uint32_t args[4]; //what would be in ebx, ecx, edx and esi
+    uint32_t user_data; //copied to the completion
+} uring_sqe_t;
+
+typedef struct {
+    uint32_t user_data;
+    int32_t result; //what the syscall would have returned in eax
+} uring_cqe_t;
+
+typedef struct {
+    volatile uint32_t sq_head; //advanced by the kernel
+    volatile uint32_t sq_tail; //advanced by the program
+    volatile uint32_t cq_head; //advanced by the program
+    volatile uint32_t cq_tail; //advanced by the kernel
+    uint32_t entries;
+    uint32_t sq_offset; //from the start of the header
+    uint32_t cq_offset;
+} uring_header_t;
+
+// Kernel side, one per task that called uring_setup
+typedef struct uring {
+    uring_header_t *header; //user addresses, in the owner's address space
+    uring_sqe_t *sqes;
+    uring_cqe_t *cqes;
+    uint32_t entries;
+    uint32_t size; //of the whole mapping, in bytes
+} uring_t;
+
+int uring_setup(uint32_t addr, uint32_t entries);
+int uring_enter(uint32_t count);
+void uring_release(struct process *process);
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef _USER_H
+#define _USER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "inc_c/memory.h"
+#include "inc_c/smp.h"
+#include "inc_c/hardware.h"
+#include "../../kernel/include/timer.h"
+
+// Programs run in ring 3, on the user segments gdt_initialize sets up
+#define USER_CS 0x1B
+#define USER_DS 0x23
+
+// Every program gets a few read-only pages at USER_SHARED_BASE, at the bottom of the 4MB below
+// the kernel that programs can't load into:
+//   USER_CODE_BASE          kernel code that runs in ring 3, starting with its entry points
+//   USER_DATA_BASE          user_data_t, the same frame in every address space
+//   USER_PROCESS_DATA_BASE  user_process_data_t, one per address space
+// so the hottest queries (time, pid) never have to enter the kernel.
+#define USER_SHARED_BASE 0xBFC00000
+#define USER_SHARED_SIZE 0x4000 //room kept free of thread stacks
+#define USER_CODE_BASE USER_SHARED_BASE
+#define USER_DATA_BASE (USER_SHARED_BASE + 0x1000)
+#define USER_PROCESS_DATA_BASE (USER_SHARED_BASE + 0x2000)
+
+// Entry points, called with the usual cdecl convention unless noted:
+//   syscall        number in eax, arguments in ebx, ecx, edx, esi, result in eax, every other
+//                  register preserved. Uses SYSENTER if the CPU has it, int 0x80 otherwise.
+//   getpid         int getpid()
+//   clock_gettime  int clock_gettime(uint32_t clock_id, timespec_t *ts), like the syscall
+//   sbrk           void *sbrk(int32_t increment), on top of SYSCALL_BRK, see mmap.h
+// A program's entry point, and a thread's, return into an exit stub in the same page.
+#define USER_ENTRY_SYSCALL (USER_CODE_BASE + 0)
+#define USER_ENTRY_GETPID (USER_CODE_BASE + 8)
+#define USER_ENTRY_CLOCK_GETTIME (USER_CODE_BASE + 16)
+#define USER_ENTRY_SBRK (USER_CODE_BASE + 24)
+
+// Kernel state readers can't get any other way without a syscall. seq is a seqlock: odd while
+// user_data_update is writing, so a reader retries if it's odd or changed across its reads.
+typedef struct {
+    volatile uint32_t seq;
+    uint32_t clocksource; //CLOCKSOURCE_*
+    uint32_t hz; //ticks per second
+    uint32_t tsc_khz;
+    uint32_t clock_mult; //cycles -> ns is (cycles * clock_mult) >> CLOCK_SHIFT
+    uint32_t boot_epoch; //seconds since 1970 at boot
+    uint64_t tsc_at_boot;
+    uint64_t jiffies;
+    uint64_t tick_ns; //ns since boot at the last tick, for when the clocksource is the PIT
+} user_data_t;
+
+typedef struct {
+    int32_t pid; //the tgid, shared by every thread
+    uint32_t brk; //the program break, kept up to date by brk for sbrk
+} user_process_data_t;
+
+// Code placed in the user code page. It runs in ring 3 at another address than it was linked
+// at, so it can't call the kernel, use globals, or anything the compiler might put in .rodata
+// (switch tables, 64-bit division helpers): only constants and USER_*_BASE.
+#define USER_TEXT __attribute__((section(".user_text")))
+
+#define MSR_SYSENTER_CS 0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+void user_initialize();
+void user_cpu_initialize(cpu_t *cpu);
+void user_map_shared(page_directory_t *pd);
+void user_set_pid(page_directory_t *pd, int pid);
+void user_set_brk(page_directory_t *pd, uint32_t brk);
+void user_data_update();
+uint32_t user_address(void *symbol);
+bool access_ok(const void *addr, uint32_t len, bool write);
+bool access_ok_string(const char *str);
+bool access_ok_strings(char *const *array);
+void sysenter_handler(regs_t *r);
+
+extern void enter_user_mode(uint32_t eip, uint32_t esp) __attribute__((noreturn));
+extern uint8_t user_code_start[];
+extern uint8_t user_code_end[];
+extern uint8_t user_syscall[];
+extern uint8_t user_sysenter[];
+extern uint8_t user_sysenter_return[];
+extern uint8_t user_int80[];
+extern uint8_t user_exit[];
+
+extern bool sysenter_supported;
+
+#endif
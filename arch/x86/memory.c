@@ -7,6 +7,7 @@
 #include "inc_c/memory.h"
 #include "inc_c/string.h"
 #include "inc_c/serial.h"
+#include "inc_c/smp.h"
 #include "../../kernel/include/errors.h"
 #include "../../kernel/include/unused.h"
 
@@ -18,17 +19,21 @@ extern uint32_t page_directory[]; // defined in paging.s
 heap_header_t *kheap = NULL;
 uint32_t kheap_end = (uint32_t)&KERNEL_END;
 #define INIT_MAP_END 0x800000 // 8 MB (set up in paging.s)
+#define MMIO_BASE 0xFF000000 // device memory (LAPIC, ACPI tables) is mapped from here
+#define MMIO_END 0xFF400000
 memory_region_t *memory_map = NULL;
 uint32_t total_mem_size = 0;
 
 bitmap_1024_t *page_directory_bitmaps[1024]; // physical memory bitmap for memory allocation
 page_directory_t kernel_pd __attribute__((aligned(4096))); // kernel page directory
-page_directory_t *current_pd = &kernel_pd; // current page directory
+uint32_t mmio_next = MMIO_BASE; // next free virtual address for map_mmio
 
 page_table_t *prealloc_table = NULL; // page table for preallocated memory
 uint32_t prealloc_phys;
 bitmap_1024_t *prealloc_bitmap = NULL; // bitmap for preallocated memory
 
+spinlock_t heap_lock = SPINLOCK_INIT(LOCK_LEVEL_HEAP); // the heap headers and the prealloc_* spares
+
 void memory_initialize(multiboot_info_t *mboot_info)
 {
     kassert_msg(mboot_info->flags & MULTIBOOT_INFO_MEM_MAP, "No memory map provided by bootloader.");
@@ -181,7 +186,8 @@ bool is_in_usable_memory(uint32_t phys_addr)
     return false;
 }
 
-page_table_entry_t first_free_page()
+// first_free_page for callers that can back out: false instead of a kpanic once there's none left
+bool find_free_page(page_table_entry_t *page)
 {
     for (uint32_t i = 0; i < 1024; i++)
     {
@@ -193,7 +199,8 @@ page_table_entry_t first_free_page()
                 //check if it overlaps at all, wither with the end or start
                 if (region->start < i * 1024 * 1024 + 1024 * 1024 && region->end > i * 1024 * 1024)
                 {
-                    return (page_table_entry_t){.pd_entry = i, .pt_entry = 0};
+                    *page = (page_table_entry_t){.pd_entry = i, .pt_entry = 0};
+                    return true;
                 }
                 region = region->next;
             }
@@ -212,13 +219,23 @@ page_table_entry_t first_free_page()
                     }
                     if ((page_directory_bitmaps[i]->bitmap[j] & (1 << k)) == 0)
                     {
-                        return (page_table_entry_t){.pd_entry = i, .pt_entry = j * 32 + k};
+                        *page = (page_table_entry_t){.pd_entry = i, .pt_entry = j * 32 + k};
+                        return true;
                     }
                 }
             }
         }
     }
-    kpanic("No free pages available!");
+    return false;
+}
+
+page_table_entry_t first_free_page()
+{
+    page_table_entry_t page;
+    if (!find_free_page(&page)) {
+        kpanic("No free pages available!");
+    }
+    return page;
 }
 
 
@@ -226,15 +243,91 @@ void phys_copypage(uint32_t src, uint32_t dest) {
     ((page_table_t *)current_pd->virt[0x3FF])->pt_entry[1022] = (src & 0xFFFFF000) | 0x3;
     ((page_table_t *)current_pd->virt[0x3FF])->pt_entry[1023] = (dest & 0xFFFFF000) | 0x3;
     
+    //the window is reused, so drop whatever this CPU has cached for it
+    asm volatile ("invlpg (%0)" : : "r"(0xFFFFE000) : "memory");
+    asm volatile ("invlpg (%0)" : : "r"(0xFFFFF000) : "memory");
+
     memcpy((void *)0xFFFFF000, (void *)0xFFFFE000, 4096);
 }
 
+// Writes length bytes from src (or zeroes, if src is NULL) at offset in a physical page, through
+// the same window as phys_copypage. Lets a page directory be filled in without switching to it.
+void phys_fill(uint32_t phys, uint32_t offset, const void *src, uint32_t length) {
+    uint32_t flags = irq_save();
+    ((page_table_t *)current_pd->virt[0x3FF])->pt_entry[1023] = (phys & 0xFFFFF000) | 0x3;
+    asm volatile ("invlpg (%0)" : : "r"(0xFFFFF000) : "memory");
+
+    if (src != NULL) {
+        memcpy((void *)(0xFFFFF000 + offset), src, length);
+    } else {
+        memset((void *)(0xFFFFF000 + offset), 0, length);
+    }
+    irq_restore(flags);
+}
+
+bool page_is_mapped(uint32_t virt, page_directory_t *pd) {
+    page_table_t *table = (page_table_t *)pd->virt[virt >> 22];
+    return table != NULL && (table->pt_entry[(virt >> 12) & 0x3FF] & 0x1);
+}
+
+// Whether the kernel can write to virt in pd on the program's behalf: it's writable, or the fault
+// that writing it takes is one page_fault_resolve fixes (copy-on-write or lazy)
+bool page_is_writable(uint32_t virt, page_directory_t *pd) {
+    page_table_t *table = (page_table_t *)pd->virt[virt >> 22];
+    if (table == NULL) {
+        return false;
+    }
+    uint32_t entry = table->pt_entry[(virt >> 12) & 0x3FF];
+    if (entry & 0x1) {
+        return (entry & 0x2) || (entry & PAGE_COW);
+    }
+    return (entry & PAGE_LAZY) && (entry & 0x2);
+}
+
+// Whether virt is taken in pd: mapped, or reserved by map_lazy_page
+bool page_is_used(uint32_t virt, page_directory_t *pd) {
+    page_table_t *table = (page_table_t *)pd->virt[virt >> 22];
+    return table != NULL && (table->pt_entry[(virt >> 12) & 0x3FF] & (0x1 | PAGE_LAZY));
+}
+
+// Maps physical device memory into the kernel's address space, uncached. The frames aren't
+// marked in the physical bitmap since they aren't RAM we'd ever hand out.
+// Page directories cloned before this won't see the mapping, so only call it during boot.
+void *map_mmio(uint32_t phys, uint32_t size) {
+    uint32_t offset = phys & 0xFFF;
+    uint32_t pages = (offset + size + 0xFFF) / 0x1000;
+    kassert_msg(mmio_next + pages * 0x1000 <= MMIO_END, "Out of MMIO address space.");
+
+    uint32_t pd_entry = MMIO_BASE >> 22;
+    if (kernel_pd.virt[pd_entry] == 0) {
+        uint32_t table_phys;
+        page_table_t *table = (page_table_t *)kmalloc_ap(sizeof(page_table_t), &table_phys);
+        memset(table->pt_entry, 0, sizeof(table->pt_entry));
+        kernel_pd.entries[pd_entry] = table_phys | 0x3;
+        kernel_pd.virt[pd_entry] = (uint32_t)table;
+        kernel_pd.is_full[pd_entry] = false;
+    }
+
+    uint32_t virt = mmio_next;
+    page_table_t *table = (page_table_t *)kernel_pd.virt[pd_entry];
+    for (uint32_t i = 0; i < pages; i++) {
+        //present, writable, write-through, cache disabled
+        table->pt_entry[((virt >> 12) & 0x3FF) + i] = ((phys & 0xFFFFF000) + i * 0x1000) | 0x1B;
+    }
+    mmio_next += pages * 0x1000;
+
+    return (void *)(virt + offset);
+}
+
 
 page_directory_t *clone_page_directory(page_directory_t *directory) {
     uint32_t phys;
     page_directory_t *new_directory = (page_directory_t *)kmalloc_ap(sizeof(page_directory_t), &phys);
     memset(new_directory, 0, sizeof(page_directory_t));
     new_directory->phys_addr = phys;
+    new_directory->refcount = 1;
+    new_directory->brk_start = directory->brk_start;
+    new_directory->brk = directory->brk;
 
     for (uint32_t pde = 0; pde < 1024; pde++) {
         if (directory->entries[pde] & 0x1) {
@@ -243,6 +336,11 @@ page_directory_t *clone_page_directory(page_directory_t *directory) {
             new_directory->is_full[pde] = directory->is_full[pde];
 
             for (uint32_t pte = 0; pte < 1024; pte++) {
+                if (((page_table_t *)directory->virt[pde])->pt_entry[pte] & PAGE_LAZY) {
+                    //nothing's been put there yet, so the clone gets a zeroed frame of its own too
+                    ((page_table_t *)new_directory->virt[pde])->pt_entry[pte] = ((page_table_t *)directory->virt[pde])->pt_entry[pte];
+                    continue;
+                }
                 if (((page_table_t *)directory->virt[pde])->pt_entry[pte] & 0x1) {
                     //if it's the same as the kernel, skip it
                     uint32_t kernel_entry = ((page_table_t *)kernel_pd.virt[pde])->pt_entry[pte] & 0xFFFFF000;
@@ -252,6 +350,11 @@ page_directory_t *clone_page_directory(page_directory_t *directory) {
                         ((page_table_t *)new_directory->virt[pde])->pt_entry[pte] = this_entry | 0x3;
                         continue;
                     }
+                    //pages every address space shares are shared with the clone too
+                    if (((page_table_t *)directory->virt[pde])->pt_entry[pte] & PAGE_SHARED) {
+                        ((page_table_t *)new_directory->virt[pde])->pt_entry[pte] = ((page_table_t *)directory->virt[pde])->pt_entry[pte];
+                        continue;
+                    }
 
                     //page_table_entry_t entry = first_free_page();
 
@@ -275,6 +378,9 @@ void free_page_directory(page_directory_t *directory) {
                             continue;
                         }
                     }
+                    if (((page_table_t *)directory->virt[pde])->pt_entry[pte] & PAGE_SHARED) {
+                        continue; //not ours to free
+                    }
                     uint32_t phys = ((page_table_t *)directory->virt[pde])->pt_entry[pte] & 0xFFFFF000;
                     uint32_t pd_entry = phys >> 22;
                     uint32_t pt_entry = (phys >> 12) & 0x3FF;
@@ -288,10 +394,21 @@ void free_page_directory(page_directory_t *directory) {
     kfree(directory);
 }
 
+void page_directory_get(page_directory_t *directory) {
+    __sync_add_and_fetch(&directory->refcount, 1);
+}
+
+// Drops a reference; the last one frees the directory and every user page in it
+void page_directory_put(page_directory_t *directory) {
+    if (__sync_sub_and_fetch(&directory->refcount, 1) == 0) {
+        free_page_directory(directory);
+    }
+}
+
 
 void switch_page_directory(page_directory_t *directory) {
     //bochs magic breakpoint
-    current_pd = directory;
+    this_cpu_write(pd, directory);
     asm volatile("mov %0, %%cr3":: "r"(directory->phys_addr));
 }
 
@@ -360,13 +477,12 @@ void alloc_page_kmalloc(uint32_t virt, uint32_t phys, bool make, bool is_kernel,
     if (pd->virt[pd_entry] == 0 && make) {
         uint32_t phys;
         pd->virt[pd_entry] = (uint32_t)kmalloc_ap(0x1000, &phys);
-        pd->entries[pd_entry] = phys | 0x1;
+        memset((void *)pd->virt[pd_entry], 0, 0x1000);
+        //the table's other pages may differ, so their own entries decide what's allowed
+        pd->entries[pd_entry] = phys | 0x3;
         if (!is_kernel) {
             pd->entries[pd_entry] |= 0x4;
         }
-        if (is_writeable) {
-            pd->entries[pd_entry] |= 0x2;
-        }
         pd->is_full[pd_entry] = false;
     }
     if ((*(page_table_t *)(pd->virt[pd_entry])).pt_entry[pt_entry] & 0x1) {
@@ -374,7 +490,14 @@ void alloc_page_kmalloc(uint32_t virt, uint32_t phys, bool make, bool is_kernel,
     }
 
     //set the page table entry
-    ((page_table_t *)(pd->virt[pd_entry]))->pt_entry[pt_entry] = phys | 0x3;
+    uint32_t entry = phys | 0x1;
+    if (!is_kernel) {
+        entry |= 0x4;
+    }
+    if (is_writeable) {
+        entry |= 0x2;
+    }
+    ((page_table_t *)(pd->virt[pd_entry]))->pt_entry[pt_entry] = entry;
 
     uint32_t phys_pd_entry = phys >> 22;
     uint32_t phys_pt_entry = (phys >> 12) & 0x3FF;
@@ -397,6 +520,111 @@ void alloc_page_kmalloc(uint32_t virt, uint32_t phys, bool make, bool is_kernel,
     return;
 }
 
+// Maps a frame the kernel owns into pd, for the user to see, without taking it out of the
+// physical page bitmaps; free_page_directory leaves it alone
+void map_shared_page(uint32_t virt, uint32_t phys, bool is_writeable, page_directory_t *pd) {
+    uint32_t pd_entry = virt >> 22;
+    uint32_t pt_entry = (virt >> 12) & 0x3FF;
+
+    if (pd->virt[pd_entry] == 0) {
+        uint32_t table_phys;
+        pd->virt[pd_entry] = (uint32_t)kmalloc_ap(0x1000, &table_phys);
+        memset((void *)pd->virt[pd_entry], 0, 0x1000);
+        pd->entries[pd_entry] = table_phys | 0x7;
+        pd->is_full[pd_entry] = false;
+    }
+    if ((*(page_table_t *)(pd->virt[pd_entry])).pt_entry[pt_entry] & 0x1) {
+        kpanic("Attempted to allocate already allocated page!");
+    }
+    ((page_table_t *)(pd->virt[pd_entry]))->pt_entry[pt_entry] = (phys & 0xFFFFF000) | PAGE_SHARED | 0x5 | (is_writeable ? 0x2 : 0);
+}
+
+// Maps a frame the kernel owns read-only, like map_shared_page, but the user may still write to
+// it: the first write gets the page a private copy, see cow_page_fault
+void map_cow_page(uint32_t virt, uint32_t phys, page_directory_t *pd) {
+    map_shared_page(virt, phys, false, pd);
+    ((page_table_t *)(pd->virt[virt >> 22]))->pt_entry[(virt >> 12) & 0x3FF] |= PAGE_COW;
+}
+
+// A write fault at virt: if it's a PAGE_COW page, it's given a frame of its own with a copy of
+// the shared one, writable, and the write can be retried. Returns false for any other page.
+// Call with the kernel lock held; pd must be the current page directory.
+bool cow_page_fault(uint32_t virt, page_directory_t *pd) {
+    page_table_t *table = (page_table_t *)pd->virt[virt >> 22];
+    if (table == NULL) {
+        return false;
+    }
+    uint32_t pt_entry = (virt >> 12) & 0x3FF;
+    if ((table->pt_entry[pt_entry] & 0x7) == 0x7) {
+        //another thread already copied it, this CPU just had the read-only entry cached
+        asm volatile ("invlpg (%0)" : : "r"(virt) : "memory");
+        return true;
+    }
+    if (!(table->pt_entry[pt_entry] & 0x1) || !(table->pt_entry[pt_entry] & PAGE_COW)) {
+        return false;
+    }
+
+    uint32_t shared = table->pt_entry[pt_entry] & 0xFFFFF000;
+    uint32_t flags = irq_save();
+    page_table_entry_t first = first_free_page();
+    uint32_t phys = first.pd_entry * 0x400000 + first.pt_entry * 0x1000;
+    table->pt_entry[pt_entry] = 0;
+    alloc_page_kmalloc(virt & 0xFFFFF000, phys, false, false, true, pd);
+    phys_copypage(shared, phys);
+    irq_restore(flags);
+
+    smp_flush_tlb(pd);
+    return true;
+}
+
+// Reserves virt in pd without giving it a frame: the first access faults, and lazy_page_fault
+// gives it a zeroed one then. So memory a program asks for but never touches costs nothing.
+void map_lazy_page(uint32_t virt, bool is_writeable, page_directory_t *pd) {
+    uint32_t pd_entry = virt >> 22;
+    uint32_t pt_entry = (virt >> 12) & 0x3FF;
+
+    if (pd->virt[pd_entry] == 0) {
+        uint32_t table_phys;
+        pd->virt[pd_entry] = (uint32_t)kmalloc_ap(0x1000, &table_phys);
+        memset((void *)pd->virt[pd_entry], 0, 0x1000);
+        pd->entries[pd_entry] = table_phys | 0x7;
+        pd->is_full[pd_entry] = false;
+    }
+    if ((*(page_table_t *)(pd->virt[pd_entry])).pt_entry[pt_entry] & (0x1 | PAGE_LAZY)) {
+        kpanic("Attempted to allocate already allocated page!");
+    }
+    //not present, so the CPU ignores the rest; the writable bit is kept for lazy_page_fault
+    ((page_table_t *)(pd->virt[pd_entry]))->pt_entry[pt_entry] = PAGE_LAZY | 0x4 | (is_writeable ? 0x2 : 0);
+}
+
+// A fault on a page that isn't present: if map_lazy_page reserved it, it gets its zeroed frame
+// and the access can be retried. Returns false for any other page. Call with the kernel lock
+// held; pd must be the current page directory.
+bool lazy_page_fault(uint32_t virt, page_directory_t *pd) {
+    page_table_t *table = (page_table_t *)pd->virt[virt >> 22];
+    if (table == NULL) {
+        return false;
+    }
+    uint32_t pt_entry = (virt >> 12) & 0x3FF;
+    uint32_t entry = table->pt_entry[pt_entry];
+    if (entry & 0x1) {
+        //another thread touched it first; not-present entries are never cached, so no invlpg
+        return true;
+    }
+    if (!(entry & PAGE_LAZY)) {
+        return false;
+    }
+
+    //zeroed before it's mapped, so other threads of the program never see what was there
+    uint32_t flags = irq_save();
+    page_table_entry_t first = first_free_page();
+    uint32_t phys = first.pd_entry * 0x400000 + first.pt_entry * 0x1000;
+    phys_fill(phys, 0, NULL, 0x1000);
+    alloc_page_kmalloc(virt & 0xFFFFF000, phys, false, false, entry & 0x2, pd);
+    irq_restore(flags);
+    return true;
+}
+
 void free_page(uint32_t virt, page_directory_t *pd) {
     //get the page directory entry
     uint32_t pd_entry = virt >> 22;
@@ -410,11 +638,11 @@ void free_page(uint32_t virt, page_directory_t *pd) {
         kpanic("Attempted to free non-allocated page!");
     }
 
-    //set the page table entry
+    //clear the page table entry, remembering which frame it pointed at
+    uint32_t phys = ((page_table_t *)(pd->virt[pd_entry]))->pt_entry[pt_entry] & 0xFFFFF000;
     ((page_table_t *)(pd->virt[pd_entry]))->pt_entry[pt_entry] = 0;
 
     //set the bitmap
-    uint32_t phys = ((page_table_t *)(pd->virt[pd_entry]))->pt_entry[pt_entry] & 0xFFFFF000;
     uint32_t phys_pd_entry = phys >> 22;
     uint32_t phys_pt_entry = (phys >> 12) & 0x3FF;
     page_directory_bitmaps[phys_pd_entry]->bitmap[phys_pt_entry / 32] &= ~(1 << (phys_pt_entry % 32));
@@ -431,6 +659,19 @@ void free_page(uint32_t virt, page_directory_t *pd) {
     return;
 }
 
+// Takes virt out of pd, freeing its frame unless it's a PAGE_SHARED one (or a PAGE_LAZY one that
+// never got a frame). Other CPUs may still have it cached, so the caller has to smp_flush_tlb
+// once it's done.
+void unmap_page(uint32_t virt, page_directory_t *pd) {
+    page_table_t *table = (page_table_t *)pd->virt[virt >> 22];
+    uint32_t pt_entry = (virt >> 12) & 0x3FF;
+    if ((table->pt_entry[pt_entry] & PAGE_SHARED) || !(table->pt_entry[pt_entry] & 0x1)) {
+        table->pt_entry[pt_entry] = 0;
+    } else {
+        free_page(virt, pd);
+    }
+}
+
 
 void heap_expand() {
     //expand the heap by 1MB (1024 pages)
@@ -486,7 +727,8 @@ uint32_t virt_to_phys(uint32_t virt, page_directory_t *pd)
     }
 }
 
-void *kmalloc_int(uint32_t size, bool align, uint32_t *phys)
+// Called with heap_lock held
+static void *heap_alloc(uint32_t size, bool align, uint32_t *phys)
 {
     if (kheap == NULL)
     {
@@ -628,17 +870,18 @@ void *kmalloc_int(uint32_t size, bool align, uint32_t *phys)
     // We couldn't find a header that was big enough, so we need to expand the heap
     heap_expand();
     if (prealloc_table == NULL) {
-        prealloc_table = (page_table_t *)kmalloc_ap(sizeof(page_table_t), &prealloc_phys);
+        prealloc_table = (page_table_t *)heap_alloc(sizeof(page_table_t), true, &prealloc_phys);
         memset(prealloc_table->pt_entry, 0, sizeof(prealloc_table->pt_entry));
     }
     if (prealloc_bitmap == NULL) {
-        prealloc_bitmap = (bitmap_1024_t *)kmalloc(sizeof(bitmap_1024_t));
+        prealloc_bitmap = (bitmap_1024_t *)heap_alloc(sizeof(bitmap_1024_t), false, NULL);
         memset(prealloc_bitmap->bitmap, 0, sizeof(prealloc_bitmap->bitmap));
     }
-    return kmalloc_int(size, align, phys);
+    return heap_alloc(size, align, phys);
 }
 
-void kfree_int(void *ptr, bool unaligned)
+// Called with heap_lock held
+static void heap_free(void *ptr, bool unaligned)
 {
     kassert_msg(kheap != NULL, "kfree called before kheap initialization!");
     heap_header_t *header = (heap_header_t *)((uint32_t)ptr - sizeof(heap_header_t));
@@ -677,6 +920,23 @@ void kfree_int(void *ptr, bool unaligned)
     }
 }
 
+// The heap is used from interrupt handlers and by the scheduler without the big kernel lock, so
+// every allocation and free takes heap_lock with interrupts off
+void *kmalloc_int(uint32_t size, bool align, uint32_t *phys)
+{
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    void *ptr = heap_alloc(size, align, phys);
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return ptr;
+}
+
+void kfree_int(void *ptr, bool unaligned)
+{
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    heap_free(ptr, unaligned);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
 void kfree(void *ptr)
 {
     kfree_int(ptr, false);
@@ -0,0 +1,178 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "inc_c/mmap.h"
+#include "inc_c/user.h"
+#include "inc_c/memory.h"
+#include "inc_c/process.h"
+#include "inc_c/smp.h"
+#include "../../kernel/include/filesystem.h"
+
+extern page_directory_t kernel_pd;
+
+// Whether [start, start + size) is a valid place for a mapping, all of it below the shared pages
+static bool mmap_range_valid(uint32_t start, uint32_t size) {
+    return start != 0 && (start & 0xFFF) == 0 && start < USER_SHARED_BASE && size <= USER_SHARED_BASE - start;
+}
+
+static bool mmap_range_free(uint32_t start, uint32_t size, page_directory_t *pd) {
+    for (uint32_t virt = start; virt < start + size; virt += 0x1000) {
+        if (page_is_used(virt, pd)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The lowest address from MMAP_BASE up with size bytes free, or 0 if there's no room. Missing
+// page tables are skipped 4MB at a time.
+static uint32_t mmap_find_free(uint32_t size, page_directory_t *pd) {
+    uint32_t start = MMAP_BASE;
+    uint32_t virt = MMAP_BASE;
+    while (virt - start < size) {
+        if (virt >= USER_SHARED_BASE) {
+            return 0;
+        }
+        if (pd->virt[virt >> 22] == 0) {
+            virt = (virt & 0xFFC00000) + 0x400000;
+        } else if (page_is_used(virt, pd)) {
+            virt += 0x1000;
+            start = virt;
+        } else {
+            virt += 0x1000;
+        }
+    }
+    return start;
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, file_descriptor_t *fd, size_t offset) {
+    process_t *self = current_process;
+    page_directory_t *pd = self->pd;
+    if ((self->flags & PROCESS_FLAG_KTHREAD) || pd == &kernel_pd) {
+        return MAP_FAILED;
+    }
+    if (length == 0 || length > USER_SHARED_BASE || (offset & 0xFFF) != 0 || !(prot & PROT_READ)) {
+        return MAP_FAILED;
+    }
+    bool shared = flags & MAP_SHARED;
+    if (shared == !!(flags & MAP_PRIVATE)) {
+        return MAP_FAILED; //exactly one of them
+    }
+    bool anonymous = flags & MAP_ANONYMOUS;
+    if (!anonymous && (fd == NULL || !(fd->flags & FILE_ISOPEN_FLAG) || (shared && (prot & PROT_WRITE)))) {
+        return MAP_FAILED;
+    }
+
+    uint32_t size = (length + 0xFFF) & ~0xFFF;
+    uint32_t start = (uint32_t)addr;
+    if (flags & MAP_FIXED) {
+        if (!mmap_range_valid(start, size)) {
+            return MAP_FAILED;
+        }
+        munmap(addr, size);
+    } else if (!mmap_range_valid(start, size) || !mmap_range_free(start, size, pd)) {
+        start = mmap_find_free(size, pd);
+        if (start == 0) {
+            return MAP_FAILED;
+        }
+    }
+
+    if (anonymous) {
+        //nothing to read in, so the pages only get frames once they're touched
+        for (uint32_t done = 0; done < size; done += 0x1000) {
+            map_lazy_page(start + done, prot & PROT_WRITE, pd);
+        }
+        return (void *)start;
+    }
+
+    uint8_t *page = NULL;
+    for (uint32_t done = 0; done < size; done += 0x1000) {
+        uint32_t virt = start + done;
+        uint32_t shared = fmap_page(fd, offset + done);
+        if (shared != 0) {
+            if (prot & PROT_WRITE) {
+                map_cow_page(virt, shared, pd);
+            } else {
+                map_shared_page(virt, shared, false, pd);
+            }
+            continue;
+        }
+
+        //the physical page bitmaps have no lock of their own yet
+        uint32_t irq = irq_save();
+        page_table_entry_t first = first_free_page();
+        uint32_t phys = first.pd_entry * 0x400000 + first.pt_entry * 0x1000;
+        alloc_page_kmalloc(virt, phys, true, false, prot & PROT_WRITE, pd);
+        irq_restore(irq);
+        phys_fill(phys, 0, NULL, 0x1000);
+
+        //it may be read-only to us as well, so it's filled in through the physical window
+        if (page == NULL) {
+            page = (uint8_t *)kmalloc(0x1000);
+        }
+        int read = fpread((char *)page, 0x1000, offset + done, fd);
+        if (read < 0) {
+            kfree(page);
+            munmap((void *)start, done + 0x1000);
+            return MAP_FAILED;
+        }
+        phys_fill(phys, 0, page, read);
+    }
+    if (page != NULL) {
+        kfree(page);
+    }
+    return (void *)start;
+}
+
+// Unmaps every page in the range that's mapped or reserved, whatever put it there
+int munmap(void *addr, size_t length) {
+    uint32_t start = (uint32_t)addr;
+    page_directory_t *pd = current_process->pd;
+    if (pd == &kernel_pd || length == 0 || !mmap_range_valid(start, length)) {
+        return -1;
+    }
+
+    uint32_t end = (start + length + 0xFFF) & ~0xFFF;
+    uint32_t irq = irq_save();
+    for (uint32_t virt = start; virt < end; virt += 0x1000) {
+        if (page_is_used(virt, pd)) {
+            unmap_page(virt, pd);
+        }
+    }
+    irq_restore(irq);
+
+    smp_flush_tlb(pd);
+    return 0;
+}
+
+// Moves the end of the calling process's heap to addr, reserving pages lazily as it grows and
+// giving them back as it shrinks. Returns the break as it is afterwards: addr, or the old one if
+// it couldn't be moved there (addr 0 is just a query).
+uint32_t brk(uint32_t addr) {
+    process_t *self = current_process;
+    page_directory_t *pd = self->pd;
+    if ((self->flags & PROCESS_FLAG_KTHREAD) || pd == &kernel_pd || pd->brk_start == 0) {
+        return 0; //no program loaded, so no heap
+    }
+    if (addr < pd->brk_start || addr >= USER_SHARED_BASE) {
+        return pd->brk;
+    }
+
+    uint32_t old_end = (pd->brk + 0xFFF) & ~0xFFF;
+    uint32_t new_end = (addr + 0xFFF) & ~0xFFF;
+    if (new_end > old_end) {
+        if (!mmap_range_free(old_end, new_end - old_end, pd)) {
+            return pd->brk; //it would run into a mapping
+        }
+        for (uint32_t virt = old_end; virt < new_end; virt += 0x1000) {
+            map_lazy_page(virt, true, pd);
+        }
+    } else if (new_end < old_end) {
+        munmap((void *)new_end, old_end - new_end);
+    }
+
+    pd->brk = addr;
+    user_set_brk(pd, addr);
+    return addr;
+}
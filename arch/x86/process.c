@@ -3,374 +3,1233 @@
 #include "inc_c/display.h"
 #include "inc_c/hardware.h"
 #include "inc_c/string.h"
+#include "../../kernel/include/unused.h"
 #include "../../kernel/include/filesystem.h"
+#include "../../kernel/include/timer.h"
+#include "../../kernel/include/trace.h"
 #include "inc_c/memory.h"
 #include "inc_c/serial.h"
 #include "inc_c/process.h"
 #include "inc_c/arch_elf.h"
 #include "../../kernel/include/errors.h"
 #include "inc_c/io.h"
+#include "inc_c/fpu.h"
 #include "inc_c/string.h"
+#include "inc_c/user.h"
+#include "inc_c/uring.h"
 
 process_t *head_process = NULL;
-process_t *current_process = NULL;
+process_t *tail_process = NULL;
 uint32_t next_pid = 0;
 
-uint32_t interrupt_esp;
-uint32_t interrupt_ebp;
+//live processes by pid, so lookups don't have to walk the whole list
+process_t *pid_hash[PID_HASH_SIZE];
+
+//the all-tasks list, pid_hash and next_pid
+spinlock_t process_list_lock = SPINLOCK_INIT(LOCK_LEVEL_PROCESS_LIST);
+
+#define PID_HASH(pid) ((uint32_t)(pid) & (PID_HASH_SIZE - 1))
 
 process_t kernel_process;
 
+//fixed point load averages, recalculated every LOAD_FREQ ticks by loadavg_timer
+uint32_t load_averages[3];
+timer_t loadavg_timer;
+
+//processes that have exited but still hold a page directory or stack, linked through run_next
+process_t *reap_list = NULL;
+wait_queue_t reaper_wait = WAIT_QUEUE_INIT;
+
 extern page_directory_t kernel_pd;   // kernel page directory
-extern page_directory_t *current_pd; // current page directory
+
+extern void switch_context(uint32_t *prev_esp, uint32_t next_esp, uint32_t next_cr3);
+extern void task_trampoline();
+extern uint32_t save_context(jmp_context_t *context) __attribute__((returns_twice));
+extern void resume_context(jmp_context_t *context) __attribute__((noreturn));
+
+static void process_entry(process_t *self);
+static void kthread_entry(process_t *self);
+static void fork_child_entry(process_t *self);
+static void loadavg_update(void *data);
 
 void serial_dump_process() {
-    process_t *current_process = head_process;
-    while (current_process != NULL) {
-        serial_printf("Process: 0x%x\n", current_process);
-        serial_printf("  PID: 0x%x\n", current_process->pid);
-        serial_printf("  ESP: 0x%x\n", current_process->esp);
-        serial_printf("  EBP: 0x%x\n", current_process->ebp);
-        serial_printf("  Entry: 0x%x\n", current_process->entry_or_return);
-        serial_printf("  Next: 0x%x\n", current_process->next);
-        serial_printf("  PD: 0x%x\n", current_process->pd);
-        serial_printf("  Status: 0x%x\n", current_process->status);
-        serial_printf("  FDS: 0x%x\n", current_process->fds);
-        serial_printf("  Num FDS: 0x%x\n", current_process->num_fds);
-        serial_printf("  Max FDS: 0x%x\n", current_process->max_fds);
-        current_process = current_process->next;
+    process_t *process = head_process;
+    while (process != NULL) {
+        serial_printf("Process: 0x%x\n", process);
+        serial_printf("  PID: 0x%x\n", process->pid);
+        serial_printf("  CPU: %d\n", process->cpu);
+        serial_printf("  Context: 0x%x\n", process->context_esp);
+        serial_printf("  Entry: 0x%x\n", process->entry_or_return);
+        serial_printf("  Next: 0x%x\n", process->next);
+        serial_printf("  PD: 0x%x\n", process->pd);
+        serial_printf("  Status: 0x%x\n", process->status);
+        serial_printf("  FDS: 0x%x\n", process->files);
+        if (process->files != NULL) {
+            serial_printf("  Num FDS: 0x%x\n", process->files->num_fds);
+            serial_printf("  Max FDS: 0x%x\n", process->files->max_fds);
+        }
+        process = process->next;
     }
 }
 
-extern uint32_t stack_top;
-void process_initialize()
-{
-    head_process = &kernel_process;
-    head_process->pid = next_pid++;
-    head_process->next = NULL;
-    head_process->num_fds = 0;
-    head_process->max_fds = 256;
-    head_process->pd = &kernel_pd;
-    head_process->status = TASK_STATUS_RUNNING;
-    head_process->ebp = (uint32_t)&stack_top;
-    head_process->stack_pos = (uint32_t)&stack_top;
-    head_process->stack_size = 0x4000;
-    memset(head_process->fds, 0, sizeof(head_process->fds));
-    current_process = head_process;
+// Each CPU has its own run queue: runnable processes in the order they'll get that CPU. A CPU's
+// current process is never on it. Called with interrupts disabled.
+void run_queue_push(process_t *process) {
+    cpu_t *cpu = &cpus[process->cpu];
+    spin_lock(&cpu->rq_lock);
+    process->run_next = NULL;
+    if (cpu->rq_tail == NULL) {
+        cpu->rq_head = process;
+    } else {
+        cpu->rq_tail->run_next = process;
+    }
+    cpu->rq_tail = process;
+    cpu->rq_length++;
+    spin_unlock(&cpu->rq_lock);
 }
 
-process_t *create_task(void *entry_point, uint32_t stack_size, page_directory_t *pd, int argc, char **argv, char **envp) {
-    process_t *new_process = (process_t *)kmalloc(sizeof(process_t));
+process_t *run_queue_pop(cpu_t *cpu) {
+    spin_lock(&cpu->rq_lock);
+    process_t *process = cpu->rq_head;
+    if (process != NULL) {
+        cpu->rq_head = process->run_next;
+        if (cpu->rq_head == NULL) {
+            cpu->rq_tail = NULL;
+        }
+        cpu->rq_length--;
+        process->run_next = NULL;
+    }
+    spin_unlock(&cpu->rq_lock);
+    return process;
+}
+
+// For a CPU that's run out of work: takes the first process that's allowed to move from the
+// CPU with the longest queue
+static process_t *run_queue_steal(cpu_t *cpu) {
+    cpu_t *busiest = NULL;
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        if (&cpus[i] != cpu && cpus[i].online && cpus[i].rq_length > 0) {
+            if (busiest == NULL || cpus[i].rq_length > busiest->rq_length) {
+                busiest = &cpus[i];
+            }
+        }
+    }
+    if (busiest == NULL) {
+        return NULL;
+    }
+
+    spin_lock(&busiest->rq_lock);
+    process_t *before = NULL;
+    process_t *process = busiest->rq_head;
+    while (process != NULL && (process->flags & PROCESS_FLAG_PINNED)) {
+        before = process;
+        process = process->run_next;
+    }
+    if (process != NULL) {
+        if (before == NULL) {
+            busiest->rq_head = process->run_next;
+        } else {
+            before->run_next = process->run_next;
+        }
+        if (busiest->rq_tail == process) {
+            busiest->rq_tail = before;
+        }
+        busiest->rq_length--;
+        process->run_next = NULL;
+        process->cpu = cpu->index;
+    }
+    spin_unlock(&busiest->rq_lock);
+
+    return process;
+}
+
+// Where a new process starts: the online CPU with the least to do
+static uint32_t pick_cpu() {
+    uint32_t best = 0;
+    uint32_t best_load = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        if (!cpus[i].online) {
+            continue;
+        }
+        uint32_t load = cpus[i].rq_length + (cpus[i].current != cpus[i].idle ? 1 : 0);
+        if (load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+// Something was just queued on cpu. If it's another CPU sitting in its idle loop, it won't look at
+// its queue until the next tick, so poke it now.
+static void kick_cpu(cpu_t *cpu) {
+    if (cpu == this_cpu()) {
+        cpu->resched = true;
+    } else if (cpu->current == cpu->idle) {
+        smp_send_reschedule(cpu);
+    }
+}
+
+static void pid_hash_insert(process_t *process) {
+    process_t **bucket = &pid_hash[PID_HASH(process->pid)];
+    process->hash_next = *bucket;
+    *bucket = process;
+}
+
+static void pid_hash_remove(process_t *process) {
+    process_t **link = &pid_hash[PID_HASH(process->pid)];
+    while (*link != NULL && *link != process) {
+        link = &(*link)->hash_next;
+    }
+    if (*link != NULL) {
+        *link = process->hash_next;
+    }
+    process->hash_next = NULL;
+}
+
+// Called with process_list_lock held
+static process_t *pid_lookup(int pid) {
+    process_t *wanted_process = pid_hash[PID_HASH(pid)];
+    while (wanted_process != NULL) {
+        if (wanted_process->pid == pid) {
+            return wanted_process;
+        }
+        wanted_process = wanted_process->hash_next;
+    }
+    return NULL;
+}
+
+// Hands out the next unused pid. Once next_pid wraps, pids still held by live processes are skipped.
+// Called with process_list_lock held.
+static int alloc_pid() {
+    while (true) {
+        if (next_pid >= PID_MAX) {
+            next_pid = PID_MIN;
+        }
+        int pid = next_pid++;
+        if (pid_lookup(pid) == NULL) {
+            return pid;
+        }
+    }
+}
+
+// Gives the process its pid too, under the same lock, so two CPUs can't hand out the same one
+static void process_list_add(process_t *process) {
+    uint32_t flags = spin_lock_irqsave(&process_list_lock);
+    process->pid = alloc_pid();
+    process->tgid = process->pid; //thread_create puts threads in their creator's group
+    process->next = NULL;
+    process->prev = tail_process;
+    if (tail_process == NULL) {
+        head_process = process;
+    } else {
+        tail_process->next = process;
+    }
+    tail_process = process;
+    pid_hash_insert(process);
+    spin_unlock_irqrestore(&process_list_lock, flags);
+}
+
+static void process_list_remove(process_t *process) {
+    uint32_t flags = spin_lock_irqsave(&process_list_lock);
+    if (process->prev == NULL) {
+        head_process = process->next;
+    } else {
+        process->prev->next = process->next;
+    }
+    if (process->next == NULL) {
+        tail_process = process->prev;
+    } else {
+        process->next->prev = process->prev;
+    }
+    process->next = NULL;
+    process->prev = NULL;
+    pid_hash_remove(process);
+    spin_unlock_irqrestore(&process_list_lock, flags);
+}
+
+// Saves prev's callee-saved registers and stack pointer, and loads next's. cr3 is only reloaded if
+// the address space actually changes, so switching between kernel threads doesn't flush the TLB.
+// Returns when something switches back to prev.
+static inline void switch_to(process_t *prev, process_t *next) {
+    uint32_t cr3 = 0;
+    if (current_pd != next->pd) {
+        this_cpu_write(pd, next->pd);
+        cr3 = next->pd->phys_addr;
+    }
+    switch_context(&prev->context_esp, next->context_esp, cr3);
+}
+
+// Builds the frame switch_context pops for a task that has never run, so the first switch to it
+// lands in task_trampoline, which calls entry(task) with interrupts enabled
+static void task_setup_frame(process_t *task, void (*entry)(process_t *self)) {
+    uint32_t *frame = (uint32_t *)((uint32_t)task->kstack + KSTACK_SIZE);
+    *--frame = (uint32_t)task_trampoline; //return address
+    *--frame = 0; //ebp
+    *--frame = (uint32_t)entry; //ebx
+    *--frame = (uint32_t)task; //esi
+    *--frame = 0; //edi
+    task->context_esp = (uint32_t)frame;
+}
 
+static void process_set_name(process_t *process, const char *name) {
+    uint32_t i = 0;
+    while (name != NULL && name[i] != '\0' && i < sizeof(process->name) - 1) {
+        process->name[i] = name[i];
+        i++;
+    }
+    process->name[i] = '\0';
+}
+
+// Kernel threads stay on the BSP, where the device interrupts they mostly wait on arrive
+static void kthread_setup(process_t *thread, int (*fn)(void *arg), void *arg, char *name) {
+    memset(thread, 0, sizeof(process_t));
+    thread->flags = PROCESS_FLAG_KTHREAD | PROCESS_FLAG_PINNED;
+    thread->cpu = 0;
+    thread->pd = &kernel_pd;
+    thread->status = TASK_STATUS_INITIALIZED;
+    thread->files = fd_table_create();
+    thread->stack_size = KSTACK_SIZE;
+    thread->kstack = kmalloc(KSTACK_SIZE);
+    thread->stack_pos = (uint32_t)thread->kstack + KSTACK_SIZE;
+    thread->entry_or_return = (uint32_t)fn;
+    thread->thread_arg = arg;
+    thread->stats.start_jiffies = jiffies;
+    wait_queue_init(&thread->exit_queue);
+    process_set_name(thread, name);
+    task_setup_frame(thread, kthread_entry);
+}
+
+// Starts fn(arg) as a kernel thread. It shares kernel_pd, starts with no fds, and is scheduled
+// like any other process. Returning from fn (or calling kthread_exit) ends the thread; like a process,
+// the struct is left for the creator to free once exit_queue reports it finished.
+process_t *kthread_create(int (*fn)(void *arg), void *arg, char *name) {
+    process_t *thread = (process_t *)kmalloc(sizeof(process_t));
+    kthread_setup(thread, fn, arg, name);
+
+    process_list_add(thread);
+
+    uint32_t flags = irq_save();
+    run_queue_push(thread);
+    if (thread->cpu != this_cpu()->index) {
+        kick_cpu(&cpus[thread->cpu]);
+    }
+    irq_restore(flags);
+
+    return thread;
+}
+
+void kthread_exit(int code) {
     asm volatile ("cli");
+    current_process->entry_or_return = code;
+    free_process(current_process);
+}
+
+// First code run on a new kernel thread's stack, see task_setup_frame
+static void kthread_entry(process_t *self) {
+    if (!(self->flags & PROCESS_FLAG_IDLE)) {
+        lock_kernel();
+    }
+    int (*fn)(void *arg) = (int (*)(void *arg))self->entry_or_return;
+    kthread_exit(fn(self->thread_arg));
+}
+
+int idle_task(void *arg) {
+    UNUSED(arg);
+    while (true) {
+        asm volatile ("sti; hlt");
+    }
+    return 0;
+}
+
+// Each CPU has an idle thread of its own. It's never on a run queue or the process list; the
+// scheduler falls back to it when there's nothing else to run.
+process_t *idle_create(cpu_t *cpu) {
+    process_t *idle = (process_t *)kmalloc(sizeof(process_t));
+    kthread_setup(idle, idle_task, NULL, "idle");
+    idle->pid = -1;
+    idle->tgid = -1;
+    idle->flags |= PROCESS_FLAG_IDLE;
+    idle->cpu = cpu->index;
+    return idle;
+}
+
+// Unmaps the stack_size bytes of stack below stack_top from pd, whichever of its pages are there
+static void stack_free_pages(page_directory_t *pd, uint32_t stack_top, uint32_t stack_size) {
+    uint32_t flags = irq_save();
+    for (uint32_t i = stack_size; i > 0; i -= 0x1000) {
+        if (page_is_mapped(stack_top - i, pd)) {
+            free_page(stack_top - i, pd);
+        }
+    }
+    irq_restore(flags);
+}
 
-    //uint32_t stack = (uint32_t)kmalloc(stack_size) + stack_size;
+// Unmaps a task's user stack from its page directory, for when the directory outlives it
+static void task_free_stack(process_t *process) {
+    stack_free_pages(process->pd, process->stack_pos, process->stack_size);
+}
+
+// Frees what an exited process couldn't free itself while it was still running on it
+int reaper_task(void *arg) {
+    UNUSED(arg);
+    while (true) {
+        wait_event(&reaper_wait, reap_list != NULL);
+
+        uint32_t flags = irq_save();
+        process_t *process = reap_list;
+        reap_list = NULL;
+        irq_restore(flags);
 
-    if (current_process->pid != 0) {
-        //free the previous stack's pages
-        for (uint32_t i = 0; i < current_process->stack_size; i += 0x1000) {
-            free_page(virt_to_phys(current_process->stack_pos - i, pd), pd);
+        while (process != NULL) {
+            process_t *next = process->run_next;
+            process->run_next = NULL;
+
+            //it may still be switching away on another CPU, on the stack we're about to free
+            while (process->on_cpu) {
+                cpu_relax();
+            }
+
+            kfree(process->kstack);
+            process->kstack = NULL;
+            fpu_free(process);
+            if (!(process->flags & PROCESS_FLAG_KTHREAD)) {
+                //the stack pages belong to the page directory, so they're released along with it,
+                //unless other threads are still running in it
+                if (process->pd->refcount > 1) {
+                    task_free_stack(process);
+                }
+                page_directory_put(process->pd);
+            }
+            process->pd = NULL;
+
+            //We leave it up to the creator of the process to free the process struct itself
+            //This way, when a process ends, the return status is still available.
+            process->status = TASK_STATUS_FINISHED;
+            wake_up(&process->exit_queue);
+            if (process->flags & PROCESS_FLAG_DETACHED) {
+                process_release(process); //nobody has it to free, or to read the status from
+            }
+
+            process = next;
         }
     }
+    return 0;
+}
+
+extern uint32_t stack_top;
+void process_initialize()
+{
+    memset(pid_hash, 0, sizeof(pid_hash));
+    head_process = NULL;
+    tail_process = NULL;
+    next_pid = 0; //so the kernel gets pid 0
+
+    kernel_process.flags = PROCESS_FLAG_PINNED; //kernel_main runs on the BSP's boot stack
+    kernel_process.cpu = 0;
+    kernel_process.on_cpu = true;
+    process_list_add(&kernel_process);
+    head_process->files = fd_table_create();
+    head_process->pd = &kernel_pd;
+    head_process->status = TASK_STATUS_RUNNING;
+    head_process->context_esp = 0; //filled in the first time we switch away
+    head_process->stack_pos = (uint32_t)&stack_top;
+    head_process->stack_size = 0x4000;
+    head_process->run_next = NULL;
+    head_process->wait_next = NULL;
+    wait_queue_init(&head_process->exit_queue);
+    this_cpu_write(current, head_process);
+    this_cpu()->idle = idle_create(this_cpu());
+
+    reap_list = NULL;
+    wait_queue_init(&reaper_wait);
+    kthread_create(reaper_task, NULL, "reaper");
+
+    memset(load_averages, 0, sizeof(load_averages));
+    timer_init(&loadavg_timer, loadavg_update, NULL);
+    timer_add(&loadavg_timer, jiffies + LOAD_FREQ);
+}
 
-    uint32_t stack = 0xC0000000 - stack_size;
+// Maps a fresh stack of stack_size bytes ending at stack_top in pd
+static void task_alloc_stack(page_directory_t *pd, uint32_t stack_top, uint32_t stack_size) {
+    //the physical page bitmaps have no lock of their own yet
+    uint32_t flags = irq_save();
+    uint32_t stack = stack_top - stack_size;
     for (uint32_t i = 0; i < stack_size; i += 0x1000) {
         page_table_entry_t first = first_free_page();
         alloc_page_kmalloc(stack + i, first.pd_entry * 0x400000 + first.pt_entry * 0x1000, true, false, true, pd);
     }
-    stack = 0xC0000000;
+    irq_restore(flags);
+}
 
-    new_process->pid = next_pid++;
-    new_process->next = NULL;
-    new_process->num_fds = 0;
-    new_process->max_fds = 256;
+// Sets up everything but putting it on a run queue, so fork can finish the task before any
+// other CPU can pick it up. The caller gives it its fd table.
+static process_t *task_alloc(void *entry_point, uint32_t stack, uint32_t stack_size, page_directory_t *pd, int argc, char **argv, char **envp) {
+    process_t *new_process = (process_t *)kmalloc(sizeof(process_t));
+
+    task_alloc_stack(pd, stack, stack_size);
+
+    new_process->flags = 0;
+    new_process->name[0] = '\0';
+    new_process->kstack = kmalloc(KSTACK_SIZE);
+    new_process->thread_arg = NULL;
+    new_process->fpu_state = NULL;
+    new_process->fpu_alloc = NULL;
+    new_process->fpu_cpu = 0;
+    new_process->cpu = pick_cpu();
+    new_process->on_cpu = false;
+    new_process->lock_depth = 0;
+    memset(&new_process->stats, 0, sizeof(process_stats_t));
+    new_process->stats.start_jiffies = jiffies;
+    new_process->files = NULL;
     new_process->pd = pd;
     new_process->status = TASK_STATUS_INITIALIZED;
-    new_process->esp = (uint32_t)stack;
-    new_process->ebp = (uint32_t)stack;
     new_process->stack_pos = stack; //static location of the stack top in memory
     new_process->stack_size = stack_size;
     new_process->argc = argc;
     new_process->argv = argv;
     new_process->envp = envp;
-    memset(new_process->fds, 0, sizeof(new_process->fds));
-    for (int i = 0; i < 256; i++) {
-        if (current_process->fds[i] != NULL) {
-            new_process->fds[i] = copy_descriptor(current_process->fds[i], i);
-        } else {
-            new_process->fds[i] = NULL;
-        }
-    }
+    new_process->args_alloc = NULL;
+    new_process->uring = NULL;
+    new_process->run_next = NULL;
+    new_process->wait_next = NULL;
+    wait_queue_init(&new_process->exit_queue);
 
-    // Add to linked list
-    process_t *current_process = head_process;
-    while (current_process->next != NULL) {
-        current_process = current_process->next;
-    }
-    current_process->next = new_process;
+    process_list_add(new_process);
 
     new_process->entry_or_return = (uint32_t)entry_point;
+    task_setup_frame(new_process, process_entry);
+
+    return new_process;
+}
+
+static void task_start(process_t *process) {
+    run_queue_push(process);
+    if (process->cpu != this_cpu()->index) {
+        kick_cpu(&cpus[process->cpu]);
+    }
+}
 
+// Starts entry_point in ring 3 in pd, which only needs the program's own pages mapped
+process_t *create_task(void *entry_point, uint32_t stack_size, page_directory_t *pd, int argc, char **argv, char **envp) {
+    user_map_shared(pd);
+    process_t *new_process = task_alloc(entry_point, 0xC0000000, stack_size, pd, argc, argv, envp);
+    user_set_pid(pd, new_process->tgid);
+    new_process->files = fd_table_copy(current_process->files);
+    task_start(new_process);
     return new_process;
 }
 
-extern uint32_t read_eip();
 uint32_t fork() {
-    asm volatile ("cli");
+    uint32_t flags = irq_save();
+
+    page_directory_t *pd = clone_page_directory(current_pd);
+    if (current_process->pid != 0 && !(current_process->flags & PROCESS_FLAG_KTHREAD)) {
+        //the clone has our stack's pages, but task_alloc maps the child a fresh stack there
+        stack_free_pages(pd, current_process->stack_pos, current_process->stack_size);
+    }
 
-    process_t *new_process = create_task(NULL, current_process->stack_size, clone_page_directory(current_pd), 0, 0, 0);
+    process_t *new_process = task_alloc(NULL, 0xC0000000, current_process->stack_size, pd, 0, 0, 0);
+    new_process->files = fd_table_copy(current_process->files);
 
     new_process->status = TASK_STATUS_FORKED;
+    fpu_fork(current_process, new_process);
 
     process_t *parent_process = current_process;
 
-    uint32_t eip = read_eip();
+    //the child resumes from here (with save_context returning 0) on a copy of our stack
+    if (save_context(&new_process->fork_context) == 0) {
+        irq_restore(flags);
+        return 0;
+    }
+
+    //copy the stack from the current process; it's at the same address in the child
+    uint32_t old_stack_offset = parent_process->stack_pos - (new_process->fork_context.esp & ~0xFFF);
+
+    //copy all pages
+    for (uint32_t i = 0; i < old_stack_offset; i += 0x1000) {
+        uint32_t phys = virt_to_phys(parent_process->stack_pos - old_stack_offset + i, current_pd);
+        uint32_t new_phys = virt_to_phys(new_process->stack_pos - old_stack_offset + i, new_process->pd);
+        phys_copypage(phys, new_phys);
+    }
 
+    task_setup_frame(new_process, fork_child_entry);
+    //the child comes back into our caller, which thinks it holds the big kernel lock
+    new_process->lock_depth = this_cpu()->lock_depth;
+    task_start(new_process);
+
+    irq_restore(flags);
+    return new_process->pid;
+}
+
+void free_process(process_t *process) {
     asm volatile ("cli");
 
-    uint32_t esp, ebp;
-    asm volatile ("mov %%esp, %0" : "=r" (esp));
-    asm volatile ("mov %%ebp, %0" : "=r" (ebp));
+    //it keeps its pid, and stays on the list, until process_release: whoever frees the struct
+    //may still be reading it, and a new process with the same pid would be mistaken for it
+
+    //close all file descriptors, unless other threads still have them
+    fd_table_put(process->files);
+    process->files = NULL;
+    uring_release(process);
+
+    //we're still running on this process' stack, so the reaper frees it (and the page directory)
+    //once we're off the CPU, then marks the process finished
+    fpu_release(process);
+
+    process->status = TASK_STATUS_EXITING;
+    process->run_next = reap_list;
+    reap_list = process;
+    wake_up(&reaper_wait);
+
+    //the scheduler never picks an exiting process again, so this doesn't return
+    process_yield();
+    kpanic("Finished process %d was scheduled again!", process->pid);
+}
+
+// Frees a finished process' struct, once its creator is done with its exit code. Only then does
+// its pid go back to alloc_pid.
+void process_release(process_t *process) {
+    process_list_remove(process);
+    kfree(process);
+}
+
+// Gives up the CPU. The caller resumes right here the next time it's scheduled.
+void process_yield() {
+    uint32_t flags = irq_save();
+    schedule();
+    irq_restore(flags);
+}
+
+// Takes the current process off the CPU until process_wake is called on it.
+// Must be called with interrupts disabled, after the process has been put somewhere it can be woken from.
+void process_block() {
+    current_process->status = TASK_STATUS_WAITING;
+    process_yield();
+}
 
-    if (current_process == parent_process) {
+void process_wake(process_t *process) {
+    uint32_t flags = irq_save();
+    if (process->status == TASK_STATUS_WAITING) {
+        process->status = TASK_STATUS_RUNNING;
+        run_queue_push(process);
+        kick_cpu(&cpus[process->cpu]);
+        trace(TRACE_SCHED_WAKE, process->pid, 0);
+    }
+    irq_restore(flags);
+}
 
-        //copy the stack from the current process and update pointers
-        uint32_t old_stack_offset = parent_process->stack_pos - esp;
+process_t *process_by_pid(int pid) {
+    uint32_t flags = spin_lock_irqsave(&process_list_lock);
+    process_t *process = pid_lookup(pid);
+    spin_unlock_irqrestore(&process_list_lock, flags);
+    return process;
+}
 
-        //copy all pages
-        for (uint32_t i = 0; i < old_stack_offset; i += 0x1000) {
-            uint32_t phys = virt_to_phys(parent_process->stack_pos - old_stack_offset + i, current_pd);
-            uint32_t new_phys = virt_to_phys(new_process->stack_pos - old_stack_offset + i, new_process->pd);
-            phys_copypage(phys, new_phys);
+// Fills in info's memory use: present pages below the kernel, and pages reserved that haven't
+// been touched yet
+static void count_pages(page_directory_t *pd, process_info_t *info) {
+    info->resident_pages = 0;
+    info->lazy_pages = 0;
+    info->heap_size = 0;
+    if (pd == NULL || pd == &kernel_pd) {
+        return; //kernel threads only have the kernel's memory
+    }
+    for (uint32_t pde = 0; pde < 0xC0000000 >> 22; pde++) {
+        page_table_t *table = (page_table_t *)pd->virt[pde];
+        if (table == NULL) {
+            continue;
+        }
+        for (uint32_t pte = 0; pte < 1024; pte++) {
+            if (table->pt_entry[pte] & 0x1) {
+                info->resident_pages++;
+            } else if (table->pt_entry[pte] & PAGE_LAZY) {
+                info->lazy_pages++;
+            }
         }
+    }
+    info->heap_size = pd->brk - pd->brk_start;
+}
 
-        new_process->esp = new_process->stack_pos - old_stack_offset;
-        new_process->ebp = new_process->esp + (ebp - esp);
+// Copies out what /proc shows about a process. The copy is taken under process_list_lock, so
+// the process can't be freed halfway through. Returns false if there's no such process.
+bool process_get_info(int pid, process_info_t *info) {
+    uint32_t flags = spin_lock_irqsave(&process_list_lock);
+    process_t *process = pid_lookup(pid);
+    if (process == NULL) {
+        spin_unlock_irqrestore(&process_list_lock, flags);
+        return false;
+    }
+    info->pid = process->pid;
+    memcpy(info->name, process->name, sizeof(info->name));
+    info->status = process->status;
+    info->flags = process->flags;
+    info->cpu = process->cpu;
+    info->tgid = process->tgid;
+    info->num_fds = process->files != NULL ? process->files->num_fds : 0;
+    count_pages(process->pd, info);
+    info->stats = process->stats;
+    spin_unlock_irqrestore(&process_list_lock, flags);
+    return true;
+}
 
-        new_process->entry_or_return = eip;
-        asm volatile ("sti");
-        return new_process->pid;
-    } else {
-        asm volatile ("sti");
-        return 0;
+// The pid of the nth process on the all-tasks list, or -1 past the end. For listing /proc.
+int process_nth_pid(uint32_t n) {
+    uint32_t flags = spin_lock_irqsave(&process_list_lock);
+    process_t *process = head_process;
+    for (uint32_t i = 0; i < n && process != NULL; i++) {
+        process = process->next;
     }
+    int pid = process != NULL ? process->pid : -1;
+    spin_unlock_irqrestore(&process_list_lock, flags);
+    return pid;
 }
 
-void free_process(process_t *process) {
-    process_t *current_process = head_process;
-    while (current_process->next != process) {
-        current_process = current_process->next;
+uint32_t process_count() {
+    uint32_t flags = spin_lock_irqsave(&process_list_lock);
+    uint32_t count = 0;
+    for (process_t *process = head_process; process != NULL; process = process->next) {
+        count++;
     }
-    current_process->next = process->next;
+    spin_unlock_irqrestore(&process_list_lock, flags);
+    return count;
+}
 
-    //close all file descriptors
-    for (int i = 0; i < 256; i++) {
-        if (process->fds[i] != NULL) {
-            fclose(process->fds[i]);
+// Charges the ticks to whatever this CPU's tick interrupted. Programs run in ring 3, so the
+// interrupted cs tells user time from kernel time.
+void process_account_tick(regs_t *r, uint32_t ticks) {
+    process_t *process = current_process;
+    if (process == NULL) {
+        return;
+    }
+    if ((r->cs & 3) == 3) {
+        process->stats.utime += ticks;
+    } else {
+        process->stats.stime += ticks;
+    }
+}
+
+// Load average: an exponentially decaying average of the runnable and running processes,
+// sampled every LOAD_FREQ ticks. The factors are e^(-5s/1min), e^(-5s/5min) and e^(-5s/15min)
+// in FSHIFT fixed point.
+static const uint32_t load_exp[3] = {1884, 2014, 2037};
+
+static void loadavg_update(void *data) {
+    UNUSED(data);
+    uint32_t active = 0;
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        if (!cpus[i].online) {
+            continue;
         }
+        active += cpus[i].rq_length;
+        if (cpus[i].current != cpus[i].idle) {
+            active++;
+        }
+    }
+    for (uint32_t i = 0; i < 3; i++) {
+        load_averages[i] = (load_averages[i] * load_exp[i] + active * FIXED_1 * (FIXED_1 - load_exp[i])) >> FSHIFT;
     }
+    timer_add(&loadavg_timer, jiffies + LOAD_FREQ);
+}
 
-    //free the stack
-    kfree((void *)(process->stack_pos - process->stack_size));
 
-    switch_page_directory(&kernel_pd);
+extern void call_on_stack(uint32_t stack, void (*fn)(process_t *process), process_t *process);
 
-    process->status = TASK_STATUS_FINISHED;
+// First code run by a new process, on its kernel stack in its own address space.
+// Copies argv and envp to the top of the process' stack and drops to ring 3 there.
+static void process_entry(process_t *self) {
+    uint32_t stack = self->stack_pos;
+    if (self->argv != NULL) {
+        uint32_t argc = 0;
+        uint32_t argv_size = 0;
+        argc = 0;
+        while (self->argv[argc] != NULL) {
+            argv_size += strlen(self->argv[argc]) + 1;
+            argc++;
+        }
 
-    //We leave it up to the creator of the process to free the process struct itself
-    //This way, when a process ends, the return status is still available.
+        stack -= (argc + 1) * sizeof(char *); // argv + NULL
+        char **new_argv = (char **)stack;
+        stack -= argv_size; // argv strings
+        uint32_t new_argv_pos = stack;
+        //copy the arguments
+        for (uint32_t i = 0; i < argc; i++) {
+            new_argv[i] = (char *)new_argv_pos;
+            strcpy((char *)new_argv_pos, self->argv[i]);
+            new_argv_pos += strlen(self->argv[i]) + 1;
+        }
+        new_argv[argc] = NULL;
+        self->argv = new_argv;
+    }
+    if (self->envp != NULL) {
+        uint32_t envp_size = 0;
+        uint32_t envc = 0;
+        while (self->envp[envc] != NULL) {
+            envp_size += strlen(self->envp[envc]) + 1;
+            envc++;
+        }
 
-    asm volatile ("sti");
+        stack -= (envc + 1) * sizeof(char *); // envp + NULL
+        char **new_envp = (char **)stack;
+        stack -= envp_size; // envp strings
+        uint32_t new_envp_pos = stack;
+
+        //copy the environment
+        for (uint32_t i = 0; i < envc; i++) {
+            new_envp[i] = (char *)new_envp_pos;
+            strcpy((char *)new_envp_pos, self->envp[i]);
+            new_envp_pos += strlen(self->envp[i]) + 1;
+        }
+        new_envp[envc] = NULL;
+        self->envp = new_envp;
+    }
+    if (self->args_alloc != NULL) {
+        kfree(self->args_alloc);
+        self->args_alloc = NULL;
+    }
 
-    //free the page directory
-    free_page_directory(process->pd);
+    //entry(argc, argv, envp) in ring 3, returning into user_exit
+    uint32_t *frame = (uint32_t *)((stack & ~0xF) - 20);
+    frame[0] = user_address(user_exit);
+    frame[1] = self->argc;
+    frame[2] = (uint32_t)self->argv;
+    frame[3] = (uint32_t)self->envp;
+    enter_user_mode(self->entry_or_return, (uint32_t)frame);
+}
 
-    while (true);
+// First code run by a forked child: picks up where the parent called save_context in fork
+static void fork_child_entry(process_t *self) {
+    if (self->lock_depth > 0) {
+        reacquire_kernel_lock(self->lock_depth);
+    }
+    resume_context(&self->fork_context);
 }
 
-process_t *process_by_pid(int pid) {
-    process_t *wanted_process = head_process;
-    while (wanted_process != NULL) {
-        if (wanted_process->pid == pid) {
-            return wanted_process;
+// Called with interrupts disabled. Picks the next task for this CPU and switches to it; returns
+// once the current task is scheduled again, possibly on another CPU.
+void schedule() {
+    cpu_t *cpu = this_cpu();
+    process_t *prev = cpu->current;
+
+    cpu->resched = false;
+
+    // Only a process that's still runnable goes back in line; sleepers are requeued by process_wake
+    if (prev->status == TASK_STATUS_RUNNING && prev != cpu->idle) {
+        run_queue_push(prev);
+    }
+
+    process_t *next = run_queue_pop(cpu);
+    if (next == NULL) {
+        next = run_queue_steal(cpu);
+    }
+    if (next == NULL) {
+        next = cpu->idle; // Nothing to run, so halt until the next interrupt
+    }
+    if (next->status == TASK_STATUS_INITIALIZED || next->status == TASK_STATUS_FORKED) {
+        next->status = TASK_STATUS_RUNNING;
+    }
+
+    if (next == prev) {
+        //still let a CPU that's waiting for the big kernel lock in, or a task that never sleeps
+        //could keep it forever
+        if (cpu->lock_depth > 0 && smp_active) {
+            int32_t depth = release_kernel_lock();
+            for (int i = 0; i < 64; i++) {
+                cpu_relax();
+            }
+            reacquire_kernel_lock(depth);
         }
-        wanted_process = wanted_process->next;
+        return;
+    }
+
+    //if next was just switched out somewhere else, that CPU may still be on next's stack
+    while (next->on_cpu) {
+        cpu_relax();
+    }
+    next->on_cpu = true;
+    next->cpu = cpu->index;
+
+    cpu->current = next;
+    cpu->prev = prev;
+
+    if (prev->status == TASK_STATUS_RUNNING) {
+        prev->stats.nivcsw++;
+    } else {
+        prev->stats.nvcsw++;
+    }
+    trace(TRACE_SCHED_SWITCH, prev->pid, next->pid);
+
+    fpu_switch(prev, next);
+    //where the CPU puts next's stack when it's interrupted in ring 3, or enters with SYSENTER
+    if (next->kstack != NULL) {
+        cpu->tss.esp0 = (uint32_t)next->kstack + KSTACK_SIZE;
+    }
+
+    prev->lock_depth = release_kernel_lock();
+    switch_to(prev, next);
+
+    schedule_tail();
+    if (prev->lock_depth > 0) {
+        reacquire_kernel_lock(prev->lock_depth);
     }
-    return NULL;
 }
 
+// First thing a task does once it's on a CPU, whether it's resuming in schedule or starting in
+// task_trampoline: the task we switched away from is now safe to run elsewhere.
+void schedule_tail() {
+    cpu_t *cpu = this_cpu();
+    if (cpu->prev != NULL) {
+        cpu->prev->on_cpu = false;
+        cpu->prev = NULL;
+    }
+}
 
-extern int init_program(uint32_t argc, char** argv, char **envp, void* entry_point);
-extern void jump_to_program(uint32_t esp, uint32_t ebp);
+char *test_argv[] = {"Hello", "World", NULL};
 
-void timer_interrupt_handler(uint32_t ebp, uint32_t esp)
-{
-	outb(0x20, 0x20); //this isn't a regular IRQ handler, this is coming directly tables_asm, so we need to send an EOI to the PIC
-
-	process_t *old_process = current_process;
-
-	if (old_process->status == TASK_STATUS_RUNNING)
-	{
-        // Already running, so save context
-		old_process->ebp = ebp;
-		old_process->esp = esp;
-	}
-
-	process_t *new_process = old_process->next;
-    if (new_process == NULL)
-    {
-        new_process = head_process; // If we ran off the end of the list, go back to the beginning
-    }
-    while (new_process->status != TASK_STATUS_RUNNING && new_process->status != TASK_STATUS_INITIALIZED && new_process->status != TASK_STATUS_FORKED)
-    {
-        new_process = new_process->next;
-        if (new_process == NULL)
-        {
-            new_process = head_process; // If we ran off the end of the list, go back to the beginning
+// argv and envp copied into one kernel allocation, see args_pack
+typedef struct {
+    void *alloc;
+    int argc;
+    char **argv;
+    char **envp;
+} process_args_t;
+
+static uint32_t args_count(char **list, uint32_t *strings_size) {
+    uint32_t count = 0;
+    while (list != NULL && list[count] != NULL) {
+        *strings_size += strlen(list[count]) + 1;
+        count++;
+    }
+    return count;
+}
+
+static char *args_copy(char **list, uint32_t count, char **pointers, char *strings) {
+    for (uint32_t i = 0; i < count; i++) {
+        pointers[i] = strings;
+        strcpy(strings, list[i]);
+        strings += strlen(list[i]) + 1;
+    }
+    pointers[count] = NULL;
+    return strings;
+}
+
+// Copies argv and envp out of the caller's address space, so the new program can still get them
+// once it's running in its own. process_entry puts them on its stack and frees the copy.
+static bool args_pack(char **argv, char **envp, process_args_t *args) {
+    uint32_t strings_size = 0;
+    uint32_t argc = args_count(argv, &strings_size);
+    uint32_t envc = args_count(envp, &strings_size);
+    uint32_t pointers_size = (argc + 1 + envc + 1) * sizeof(char *);
+    if (pointers_size + strings_size > PROCESS_ARGS_MAX) {
+        return false;
+    }
+
+    char **pointers = (char **)kmalloc(pointers_size + strings_size);
+    char *strings = (char *)pointers + pointers_size;
+    args->alloc = pointers;
+    args->argc = argc;
+    args->argv = argv != NULL ? pointers : NULL;
+    args->envp = envp != NULL ? pointers + argc + 1 : NULL;
+    strings = args_copy(argv, argc, pointers, strings);
+    args_copy(envp, envc, pointers + argc + 1, strings);
+    return true;
+}
+
+// Builds a new address space from scratch and loads path into it, without ever switching to it.
+// Returns NULL if path isn't a loadable executable.
+static page_directory_t *load_program(char *path, void **entry_point) {
+    file_descriptor_t *fd = fopen(path, "r");
+    if (fd->flags & FILE_NOTFOUND_FLAG || !(fd->flags & FILE_ISOPEN_FLAG)) {
+        fclose(fd);
+        return NULL;
+    }
+
+    page_directory_t *pd = clone_page_directory(&kernel_pd); //only the kernel's mappings
+    user_map_shared(pd);
+    elf_load_result_t loaded = elf_load_file(fd, pd);
+    fclose(fd);
+    if (loaded.code != ELF_ERR_NONE) {
+        free_page_directory(pd);
+        return NULL;
+    }
+
+    user_set_brk(pd, pd->brk);
+    *entry_point = loaded.entry_point;
+    return pd;
+}
+
+// name without the directory
+static char *path_basename(char *path) {
+    char *name = path;
+    for (char *c = path; *c != '\0'; c++) {
+        if (*c == '/') {
+            name = c + 1;
         }
     }
+    return name;
+}
 
-    current_process = new_process;
-
-    serial_printf("pswitch %d -> %d\n", old_process->pid, new_process->pid);
-
-	if (new_process->status == TASK_STATUS_INITIALIZED)
-	{
-		new_process->status = TASK_STATUS_RUNNING;
-        // First time running, so set up stack and jump to entry point
-        asm volatile ("mov %0, %%cr3" : : "r" (new_process->pd->phys_addr));
-        current_pd = new_process->pd;
-        uint32_t stack = new_process->stack_pos;
-        if (new_process->argv != NULL) {
-            uint32_t argc = 0;
-            uint32_t argv_size = 0;
-            argc = 0;
-            while (new_process->argv[argc] != NULL) {
-                argv_size += strlen(new_process->argv[argc]) + 1;
-                argc++;
-            }
+static bool spawn_file_action(file_descriptor_t **fds, spawn_file_action_t *action) {
+    if (action->fd < 0 || action->fd >= 256) {
+        return false;
+    }
 
-            stack -= (argc + 1) * sizeof(char *); // argv + NULL
-            char **new_argv = (char **)stack;
-            stack -= argv_size; // argv strings
-            uint32_t new_argv_pos = stack;
-            //copy the arguments
-            for (uint32_t i = 0; i < argc; i++) {
-                new_argv[i] = (char *)new_argv_pos;
-                strcpy((char *)new_argv_pos, new_process->argv[i]);
-                new_argv_pos += strlen(new_process->argv[i]) + 1;
-            }
-            new_argv[argc] = NULL;
-            new_process->argv = new_argv;
+    if (action->action == SPAWN_ACTION_DUP2) {
+        if (action->new_fd < 0 || action->new_fd >= 256 || fds[action->fd] == NULL) {
+            return false;
         }
-        if (new_process->envp != NULL) {
-            uint32_t envp_size = 0;
-            uint32_t envc = 0;
-            if (new_process->envp != NULL) {
-                while (new_process->envp[envc] != NULL) {
-                    envp_size += strlen(new_process->envp[envc]) + 1;
-                    envc++;
-                }
+        if (action->new_fd != action->fd) {
+            if (fds[action->new_fd] != NULL) {
+                fclose_detached(fds[action->new_fd]);
             }
+            fds[action->new_fd] = copy_descriptor(fds[action->fd], action->new_fd);
+        }
+    } else if (action->action == SPAWN_ACTION_CLOSE) {
+        if (fds[action->fd] != NULL) {
+            fclose_detached(fds[action->fd]);
+            fds[action->fd] = NULL;
+        }
+    } else if (action->action == SPAWN_ACTION_OPEN) {
+        //opened in our table, since that's the only one fopen knows, then moved over
+        file_descriptor_t *fd = fopen(action->path, action->mode);
+        if (fd->flags & FILE_NOTFOUND_FLAG) {
+            fclose(fd);
+            return false;
+        }
+        if (fds[action->fd] != NULL) {
+            fclose_detached(fds[action->fd]);
+        }
+        fds[action->fd] = copy_descriptor(fd, action->fd);
+        fclose(fd);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Builds a spawned child's fd table out of copies of ours, so nothing here changes our own fds.
+// Returns NULL if an action failed.
+static fd_table_t *spawn_build_fds(spawn_file_actions_t *actions) {
+    fd_table_t *files;
+    if (actions == NULL || !(actions->flags & SPAWN_INHERIT_NONE)) {
+        files = fd_table_copy(current_process->files);
+    } else {
+        files = fd_table_create();
+    }
 
-            stack -= (envc + 1) * sizeof(char *); // envp + NULL
-            char **new_envp = (char **)stack;
-            stack -= envp_size; // envp strings
-            uint32_t new_envp_pos = stack;
+    for (uint32_t i = 0; actions != NULL && i < actions->count; i++) {
+        if (!spawn_file_action(files->fds, &actions->actions[i])) {
+            fd_table_put(files);
+            return NULL;
+        }
+    }
 
-            //copy the environment
-            for (uint32_t i = 0; i < envc; i++) {
-                new_envp[i] = (char *)new_envp_pos;
-                strcpy((char *)new_envp_pos, new_process->envp[i]);
-                new_envp_pos += strlen(new_process->envp[i]) + 1;
-            }
-            new_envp[envc] = NULL;
-            new_process->envp = new_envp;
+    files->num_fds = 0;
+    for (int i = 0; i < 256; i++) {
+        if (files->fds[i] != NULL) {
+            files->num_fds++;
         }
+    }
+    return files;
+}
+
+// Starts path as a new process with the extra process_flags, and puts its pid in *pid before
+// anything can run it (or, if it's detached, free it). See process_spawn.
+static process_t *spawn_task(char *path, char **argv, char **envp, spawn_file_actions_t *actions, uint32_t process_flags, int *pid) {
+    process_args_t args;
+    if (!args_pack(argv, envp, &args)) {
+        return NULL;
+    }
+
+    fd_table_t *files = spawn_build_fds(actions);
+    if (files == NULL) {
+        kfree(args.alloc);
+        return NULL;
+    }
+
+    void *entry_point;
+    page_directory_t *pd = load_program(path, &entry_point);
+    if (pd == NULL) {
+        fd_table_put(files);
+        kfree(args.alloc);
+        return NULL;
+    }
+
+    process_t *new_process = task_alloc(entry_point, 0xC0000000, PROCESS_STACK_SIZE, pd, args.argc, args.argv, args.envp);
+    user_set_pid(pd, new_process->tgid);
+    new_process->args_alloc = args.alloc;
+    new_process->files = files;
+    process_set_name(new_process, path_basename(path));
+    new_process->flags |= process_flags;
+
+    //we can't be preempted with interrupts off, so we keep the big kernel lock the child would
+    //need to exit until pid is read
+    uint32_t flags = irq_save();
+    task_start(new_process);
+    *pid = new_process->pid;
+    irq_restore(flags);
+    return new_process;
+}
+
+// Starts path as a new process, like posix_spawn. Unlike fork then exec, the caller's address
+// space is never copied: the child's is built directly from the kernel's mappings and the ELF
+// file. actions decides which fds the child gets, and may be NULL to give it all of ours.
+// The struct is the caller's to free once exit_queue reports the process finished.
+// Returns NULL if the program couldn't be loaded or an action failed.
+process_t *process_spawn(char *path, char **argv, char **envp, spawn_file_actions_t *actions) {
+    int pid;
+    return spawn_task(path, argv, envp, actions, 0, &pid);
+}
+
+// process_spawn for a program's children, which only ever get a pid: the reaper frees the struct
+// once the child has finished. Returns the pid, or -1.
+int process_spawn_detached(char *path, char **argv, char **envp, spawn_file_actions_t *actions) {
+    int pid = -1;
+    spawn_task(path, argv, envp, actions, PROCESS_FLAG_DETACHED, &pid);
+    return pid;
+}
 
-        //adjust the new process' esp
-        new_process->esp = stack;
-
-        asm volatile ("mov %0, %%esp" : : "r" (new_process->esp));
-        asm volatile ("mov %0, %%ebp" : : "r" (new_process->ebp));
-        asm volatile ("sti");
-        //set the function up as an function returning an int
-        int return_code = init_program(new_process->argc, new_process->argv, new_process->envp, (void *)new_process->entry_or_return);
-        asm volatile ("cli");
-        new_process->entry_or_return = return_code;
-        //remove the process from the scheduler
-        free_process(new_process);
-        kpanic("Something went wrong with the scheduler!");
-	} else if (new_process->status == TASK_STATUS_FORKED) {
-        // We're just returning to the parent process' address, so set esp/ebp and jump to entry
-        asm volatile ("mov %0, %%cr3" : : "r" (new_process->pd->phys_addr));
-        current_pd = new_process->pd;
-
-        new_process->status = TASK_STATUS_RUNNING;
-        asm volatile ("mov %0, %%esp" : : "r" (new_process->esp));
-        asm volatile ("mov %0, %%ebp" : : "r" (new_process->ebp));
-        asm volatile ("sti");
-        //jump to the address
-        asm volatile ("jmp *%0" : : "r" (new_process->entry_or_return));
-    }
-
-    asm volatile ("mov %0, %%cr3" : : "r" (new_process->pd->phys_addr));
-    current_pd = new_process->pd;
-
-    asm volatile ("mov %0, %%esp" : : "r" (new_process->esp));
-    asm volatile ("mov %0, %%ebp" : : "r" (new_process->ebp));
-    asm volatile ("popa");
+// Runs on the kernel stack, with interrupts off, once nothing refers to the old program's
+// address space any more: swaps in the new one and starts it like a new task
+static void exec_finish(process_t *self) {
+    page_directory_t *old_pd = current_pd;
+    switch_page_directory(self->pd);
+    page_directory_put(old_pd);
+    uring_release(self); //its rings went with the old address space
+    fpu_exec(self);
+
+    //we never return from the syscall that took it
+    release_kernel_lock();
     asm volatile ("sti");
-    asm volatile ("iret");
+    process_entry(self);
+}
 
+// Replaces the calling process' program with path. The pid, fds and stats stay. Only returns
+// if the new program couldn't be loaded, in which case the old one carries on untouched.
+int process_exec(char *path, char **argv, char **envp) {
+    process_t *self = current_process;
+    if ((self->flags & PROCESS_FLAG_KTHREAD) || self->pd == &kernel_pd || self->kstack == NULL) {
+        return -1;
+    }
+    if (self->pd->refcount > 1) {
+        return -1; //other threads are still running in this address space
+    }
 
-	kpanic("Something went wrong with the scheduler!");
+    process_args_t args;
+    if (!args_pack(argv, envp, &args)) {
+        return -1;
+    }
+
+    void *entry_point;
+    page_directory_t *pd = load_program(path, &entry_point);
+    if (pd == NULL) {
+        kfree(args.alloc);
+        return -1;
+    }
+    task_alloc_stack(pd, 0xC0000000, PROCESS_STACK_SIZE);
+    user_set_pid(pd, self->tgid);
+
+    //path, argv and envp may all be in the old address space, so nothing reads them past here
+    process_set_name(self, path_basename(path));
+
+    asm volatile ("cli");
+    self->pd = pd;
+    self->entry_or_return = (uint32_t)entry_point;
+    self->stack_pos = 0xC0000000;
+    self->stack_size = PROCESS_STACK_SIZE;
+    self->argc = args.argc;
+    self->argv = args.argv;
+    self->envp = args.envp;
+    self->args_alloc = args.alloc;
+
+    //throw away the syscall's frames; the old program's stack goes away with its page directory
+    call_on_stack((uint32_t)self->kstack + KSTACK_SIZE, exec_finish, self);
+    return -1;
 }
 
+// First code run by a new thread, on its kernel stack in the shared address space
+static void thread_entry(process_t *self) {
+    //entry(arg) in ring 3, returning into user_exit
+    uint32_t *frame = (uint32_t *)((self->stack_pos & ~0xF) - 20);
+    frame[0] = user_address(user_exit);
+    frame[1] = (uint32_t)self->thread_arg;
+    enter_user_mode(self->entry_or_return, (uint32_t)frame);
+}
 
-char *test_argv[] = {"Hello", "World", NULL};
+// The top of the first thread stack slot in pd that isn't in use, or 0 if they all are
+static uint32_t thread_stack_find(page_directory_t *pd) {
+    uint32_t stride = THREAD_STACK_SIZE + THREAD_STACK_GAP;
+    for (uint32_t top = 0xC0000000 - stride; top - THREAD_STACK_SIZE >= USER_SHARED_BASE + USER_SHARED_SIZE; top -= stride) {
+        if (!page_is_mapped(top - 0x1000, pd)) {
+            return top;
+        }
+    }
+    return 0;
+}
 
-process_t *process_load_elf(char *path) {
-	file_descriptor_t *fd = fopen(path, "r");
-	if (fd->flags & FILE_NOTFOUND_FLAG || !(fd->flags & FILE_ISOPEN_FLAG))
-	{
-		terminal_printf("Could not locate %s!\n", path);
-		while (true);
-	}
-
-	stat_t stat;
-	int stat_ret = fstat(fd, &stat);
-	if (stat_ret != 0)
-	{
-		terminal_printf("Could not stat %s!\n", path);
-		while (true);
-	}
-	int size = stat.st_size;
-
-	terminal_printf("Size of %s: %d\n", path, size);
-	char *elfbuf = kmalloc(size);
-	int read = fread(elfbuf, 1, size, fd);
-	if (read != size)
-	{
-		terminal_printf("Could not read %s!\n", path);
-		while (true);
-	}
-	terminal_printf("Read %d bytes from %s\n", read, path);
-
-	fclose(fd);
-	
-	elf_load_result_t loaded = elf_load_executable(elfbuf);
-	if (loaded.code != 0)
-	{
-		terminal_printf("Could not load %s! Error code: %d\n", path, loaded.code);
-		while (true);
-	}
-	kfree(elfbuf);
-
-
-    process_t *new_process = create_task((void *)loaded.entry_point, 0x1000, loaded.pd, 2, test_argv, NULL);
+// Starts entry_point(arg) as a new thread of the calling process, on a stack of its own. It
+// shares the caller's page directory and fd table, and gets its own pid to use as a thread id.
+// Returns NULL for kernel threads, or if there's no room left for another stack.
+process_t *thread_create(void *entry_point, void *arg) {
+    process_t *self = current_process;
+    if ((self->flags & PROCESS_FLAG_KTHREAD) || self->pd == &kernel_pd) {
+        return NULL;
+    }
+    uint32_t stack = thread_stack_find(self->pd);
+    if (stack == 0) {
+        return NULL;
+    }
 
-    asm volatile ("sti");
-    
+    page_directory_get(self->pd);
+    process_t *thread = task_alloc(entry_point, stack, THREAD_STACK_SIZE, self->pd, 0, NULL, NULL);
+    thread->flags = PROCESS_FLAG_THREAD;
+    thread->tgid = self->tgid;
+    thread->thread_arg = arg;
+    fd_table_get(self->files);
+    thread->files = self->files;
+    process_set_name(thread, self->name);
+    task_setup_frame(thread, thread_entry);
+
+    uint32_t flags = irq_save();
+    task_start(thread);
+    irq_restore(flags);
+    return thread;
+}
+
+// Ends the calling task, thread or not. Its address space and fds are only freed with the last
+// thread using them.
+void thread_exit(int code) {
+    asm volatile ("cli");
+    current_process->entry_or_return = code;
+    free_process(current_process);
+}
+
+// Waits for one of the caller's threads to finish and frees it, putting its exit code in *code
+// (if code isn't NULL). Returns -1 if tid isn't another thread in the caller's group, or someone
+// is already waiting for it.
+int thread_join(int tid, int *code) {
+    process_t *thread = process_by_pid(tid);
+    if (thread == NULL || thread == current_process || !(thread->flags & PROCESS_FLAG_THREAD)) {
+        return -1;
+    }
+    if (thread->tgid != current_process->tgid || (thread->flags & PROCESS_FLAG_JOINING)) {
+        return -1;
+    }
+    thread->flags |= PROCESS_FLAG_JOINING;
+
+    wait_event(&thread->exit_queue, thread->status == TASK_STATUS_FINISHED);
+    if (code != NULL) {
+        *code = thread->entry_or_return;
+    }
+    process_release(thread);
+    return 0;
+}
+
+process_t *process_load_elf(char *path) {
+    process_t *new_process = process_spawn(path, test_argv, NULL, NULL);
+    if (new_process == NULL) {
+        terminal_printf("Could not load %s!\n", path);
+        while (true);
+    }
     return new_process;
-}
\ No newline at end of file
+}
@@ -1,55 +1,82 @@
 .section .text
 
-.extern timer_interrupt_handler
-.globl irq0
-
-# Not the same file, but the same definition as in tables_asm.s
-irq0:
-    cli
-    pusha
-    pushl %esp
-    pushl %ebp
-    call timer_interrupt_handler
-
-.globl jump_to_program
-jump_to_program:
-    movl 8(%esp), %ebx
+# switch_context(prev_esp, next_esp, next_cr3): saves the callee-saved registers on the current
+# stack and its esp into *prev_esp, then loads next_cr3 (unless it's 0) and next_esp and pops
+# next's registers. Nothing touches the old stack after cr3 changes, so the two stacks can live
+# in different address spaces. Returns 0, which is what save_context callers see when resumed.
+.globl switch_context
+switch_context:
     movl 4(%esp), %eax
+    movl 8(%esp), %edx
+    movl 12(%esp), %ecx
 
-    movl %ebx, %ebp
-    movl %eax, %esp
-
-    popa # This is the important bit, we restore whatever was on the stack
+    pushl %ebp
+    pushl %ebx
+    pushl %esi
+    pushl %edi
+    movl %esp, (%eax)
 
-    sti
-    iret
+    testl %ecx, %ecx
+    jz 1f
+    movl %ecx, %cr3
+1:
+    movl %edx, %esp
+    popl %edi
+    popl %esi
+    popl %ebx
+    popl %ebp
 
-.globl read_eip
-read_eip:
-    movl (%esp), %eax
+    xorl %eax, %eax
     ret
 
-.global init_program
-init_program:
-    push %ebp
-    mov %esp, %ebp
-
-    # The parameters are on the stack, above the saved EBP
-    # argc is at 8(%ebp), argv is at 12(%ebp), envp is at 16(%ebp), and entry_point is at 20(%ebp)
-
-    # Push the parameters for the entry_point function onto the stack
-    mov 16(%ebp), %eax
-    push %eax
-    mov 12(%ebp), %eax
-    push %eax
-    mov 8(%ebp), %eax
-    push %eax
+# Where a new task's first switch_context returns to, see task_setup_frame.
+# ebx holds the entry function and esi its argument (the task itself).
+.globl task_trampoline
+task_trampoline:
+    call schedule_tail
+    sti
+    pushl %esi
+    call *%ebx
+1:
+    jmp 1b
 
-    # Call the entry_point function
-    call *20(%ebp)
+# save_context(context): like setjmp. Returns 1 now, and 0 when resume_context is called on it.
+.globl save_context
+save_context:
+    movl 4(%esp), %eax
+    movl %edi, 0(%eax)
+    movl %esi, 4(%eax)
+    movl %ebx, 8(%eax)
+    movl %ebp, 12(%eax)
+    leal 4(%esp), %ecx # the caller's esp once we've returned
+    movl %ecx, 16(%eax)
+    movl (%esp), %ecx
+    movl %ecx, 20(%eax)
+    movl $1, %eax
+    ret
 
-    # Clean up the stack
-    add $8, %esp
+# resume_context(context): like longjmp, never returns
+.globl resume_context
+resume_context:
+    movl 4(%esp), %eax
+    movl 0(%eax), %edi
+    movl 4(%eax), %esi
+    movl 8(%eax), %ebx
+    movl 12(%eax), %ebp
+    movl 16(%eax), %esp
+    movl 20(%eax), %ecx
+    xorl %eax, %eax
+    jmp *%ecx
 
-    pop %ebp
-    ret
\ No newline at end of file
+# call_on_stack(stack, fn, arg): switches to stack and calls fn(arg), which never returns
+.globl call_on_stack
+call_on_stack:
+    movl 4(%esp), %eax
+    movl 8(%esp), %ecx
+    movl 12(%esp), %edx
+    movl %eax, %esp
+    xorl %ebp, %ebp
+    pushl %edx
+    call *%ecx
+1:
+    jmp 1b
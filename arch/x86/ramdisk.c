@@ -177,13 +177,56 @@ int rread(void *ptr, size_t size, size_t nmemb, ramdisk_file_t *file) {
     if (file->seek_pos + bytes_to_read > file->length) {
         bytes_to_read = file->length - file->seek_pos;
     }
-    for (uint32_t i = 0; i < bytes_to_read; i++) {
-        ((char*)ptr)[i] = *(char*)(file->addr + file->seek_pos + i);
-    }
+    memcpy(ptr, (void *)(file->addr + file->seek_pos), bytes_to_read);
     file->seek_pos += bytes_to_read;
     return bytes_to_read;
 }
 
+// Like rread, but at offset and without moving seek_pos
+int rpread(void *ptr, size_t count, size_t offset, ramdisk_file_t *file) {
+    if (!(file->flags & FILE_ISOPEN_FLAG)) {
+        return -1;
+    }
+    if (!(file->flags & FILE_MODE_READ)) {
+        return -1;
+    }
+    if (offset >= file->length) {
+        return 0;
+    }
+    if (count > file->length - offset) {
+        count = file->length - offset;
+    }
+    memcpy(ptr, (void *)(file->addr + offset), count);
+    return count;
+}
+
+// The ramdisk stays where the bootloader put it, so there's no need to copy a file to hand it on
+int rpeek(char **buf, size_t count, size_t offset, ramdisk_file_t *file) {
+    if (!(file->flags & FILE_ISOPEN_FLAG) || !(file->flags & FILE_MODE_READ)) {
+        return -1;
+    }
+    if (offset >= file->length) {
+        return 0;
+    }
+    if (count > file->length - offset) {
+        count = file->length - offset;
+    }
+    *buf = (char *)(file->addr + offset);
+    return count;
+}
+
+// For the same reason a page of a file can be mapped straight from there. Only whole pages,
+// though: the bytes after a file's last one belong to whatever's next.
+uint32_t rmap_page(ramdisk_file_t *file, size_t offset) {
+    if (!(file->flags & FILE_ISOPEN_FLAG) || !(file->flags & FILE_ISFILE_FLAG)) {
+        return 0;
+    }
+    if (offset >= file->length || file->length - offset < 0x1000 || ((file->addr + offset) & 0xFFF) != 0) {
+        return 0;
+    }
+    return file->addr + offset - 0xC0000000;
+}
+
 dirent_t rreaddir(ramdisk_dir_t *dir) {
 
     if (!(dir->flags & FILE_ISOPENDIR_FLAG)) {
@@ -212,6 +255,34 @@ dirent_t rreaddir(ramdisk_dir_t *dir) {
     return ret;
 }
 
+// The header after this one in the same directory, skipping everything inside a directory
+static ramdisk_file_header_t *ramdisk_next_header(ramdisk_file_header_t *header) {
+    if (header->magic == DIR_ENTRY_MAGIC) {
+        return (ramdisk_file_header_t*)((uint32_t)header + sizeof(ramdisk_dir_header_t) * (((ramdisk_dir_header_t*)header)->num_blocks + 1));
+    }
+    return (ramdisk_file_header_t*)((uint32_t)header + sizeof(ramdisk_file_header_t));
+}
+
+// Walks the headers up to the cursor once, then one header per entry, unlike rgetdent
+int riterate(ramdisk_dir_t *dir, dir_context_t *ctx) {
+    if (!(dir->flags & FILE_ISOPENDIR_FLAG)) {
+        return -1;
+    }
+    ramdisk_file_header_t *header = (ramdisk_file_header_t*)dir->files;
+    for (uint32_t i = 0; i < dir->idx && i < dir->num_files; i++) {
+        header = ramdisk_next_header(header);
+    }
+    while (dir->idx < dir->num_files) {
+        uint8_t type = header->magic == DIR_ENTRY_MAGIC ? DT_DIR : DT_REG;
+        if (!ctx->emit(ctx, header->name, 1, type, dir->idx + 1)) {
+            break;
+        }
+        dir->idx++;
+        header = ramdisk_next_header(header);
+    }
+    return 0;
+}
+
 int rseek(ramdisk_file_t *file, size_t offset, int whence) {
     if (file->flags & FILE_ISOPEN_FLAG) {
         switch (whence) {
@@ -387,6 +458,13 @@ void ramdisk_initialize(multiboot_info_t *mboot_info) {
     ramdisk_fs.stat = rstat;
     ramdisk_fs.copy = rcopy;
     ramdisk_fs.getdent = rgetdent;
+    ramdisk_fs.readv = NULL;
+    ramdisk_fs.writev = NULL;
+    ramdisk_fs.pread = (int(*)(char*, size_t, size_t, void*))rpread;
+    ramdisk_fs.pwrite = NULL;
+    ramdisk_fs.map_page = (uint32_t(*)(void*, size_t))rmap_page;
+    ramdisk_fs.peek = (int(*)(char**, size_t, size_t, void*))rpeek;
+    ramdisk_fs.iterate = (int(*)(void*, dir_context_t*))riterate;
     ramdisk_fs_registered = register_filesystem(&ramdisk_fs);
     if (!ramdisk_fs_registered) {
         kpanic("Failed to register ramdisk filesystem!\n");
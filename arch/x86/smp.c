@@ -0,0 +1,284 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "inc_c/smp.h"
+#include "inc_c/apic.h"
+#include "inc_c/acpi.h"
+#include "inc_c/clock.h"
+#include "inc_c/fpu.h"
+#include "inc_c/hardware.h"
+#include "inc_c/memory.h"
+#include "inc_c/process.h"
+#include "inc_c/serial.h"
+#include "inc_c/string.h"
+#include "inc_c/tables.h"
+#include "inc_c/user.h"
+#include "../../kernel/include/errors.h"
+
+// Symmetric multiprocessing: the CPUs are found in the ACPI MADT, and each AP is started with
+// INIT + startup IPIs into smp_trampoline.s, which brings it up to ap_main on its idle thread.
+// Kernel code is still serialized by the big kernel lock; the run queues, and the lists that
+// interrupt handlers and the scheduler touch with it dropped, have their own spinlocks.
+
+#define AP_TRAMPOLINE_PHYS 0x8000
+#define AP_STARTUP_TIMEOUT_US 1000000
+
+extern page_directory_t kernel_pd;
+
+cpu_t cpus[MAX_CPUS] = { [0] = { .self = &cpus[0], .pd = &kernel_pd, .online = true, .rq_lock = SPINLOCK_INIT(LOCK_LEVEL_RUNQUEUE) } };
+uint32_t num_cpus = 1;
+bool smp_active = false; //set once the APs may be started
+uint8_t apic_to_cpu[256];
+
+spinlock_t kernel_lock = SPINLOCK_INIT(LOCK_LEVEL_NONE);
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint32_t ap_trampoline_cr3;
+extern uint32_t ap_trampoline_stack;
+extern uint32_t ap_trampoline_entry;
+
+// Trampoline slots are written in the copy, not the original
+#define TRAMPOLINE_SLOT(slot) (*(uint32_t *)((uint32_t)&(slot) - (uint32_t)ap_trampoline_start + AP_TRAMPOLINE_PHYS + 0xC0000000))
+
+// First C code on an AP, on its idle thread's stack
+static void ap_main() {
+    //%gs isn't ours until our GDT is loaded, so ask the LAPIC this once
+    cpu_t *cpu = &cpus[apic_to_cpu[lapic_id()]];
+
+    gdt_install_cpu(cpu->gdt, &cpu->gdt_ptr, &cpu->tss, cpu, sizeof(cpu_t));
+    idt_install_cpu();
+    lapic_enable();
+    lapic_timer_start();
+    fpu_cpu_initialize();
+    user_cpu_initialize(cpu);
+
+    cpu->current = cpu->idle;
+    cpu->idle->status = TASK_STATUS_RUNNING;
+    cpu->idle->on_cpu = true;
+    cpu->online = true;
+
+    idle_task(NULL);
+}
+
+static bool smp_start_ap(cpu_t *cpu) {
+    TRAMPOLINE_SLOT(ap_trampoline_stack) = (uint32_t)cpu->idle->kstack + KSTACK_SIZE;
+
+    lapic_send_ipi(cpu->apic_id, ICR_INIT | ICR_ASSERT | ICR_LEVEL);
+    clock_udelay(10000);
+    //the startup vector is the page number of the trampoline; real CPUs want it sent twice
+    for (int i = 0; i < 2 && !cpu->online; i++) {
+        lapic_send_ipi(cpu->apic_id, ICR_STARTUP | (AP_TRAMPOLINE_PHYS >> 12));
+        clock_udelay(200);
+    }
+
+    for (uint32_t waited = 0; !cpu->online && waited < AP_STARTUP_TIMEOUT_US; waited += 100) {
+        clock_udelay(100);
+    }
+    return cpu->online;
+}
+
+// Called on the BSP once memory and the process list are up, with interrupts disabled
+void smp_initialize() {
+    cpu_t *bsp = &cpus[0];
+    bsp->index = 0;
+    gdt_install_cpu(bsp->gdt, &bsp->gdt_ptr, &bsp->tss, bsp, sizeof(cpu_t));
+
+    acpi_madt_t *madt = (acpi_madt_t *)acpi_find_table("APIC");
+    if (madt == NULL) {
+        serial_printf("SMP: no MADT, running on one CPU\n");
+        return;
+    }
+
+    lapic_initialize(madt->lapic_addr);
+    lapic_enable();
+    lapic_timer_initialize();
+    bsp->apic_id = lapic_id();
+    memset(apic_to_cpu, 0, sizeof(apic_to_cpu));
+
+    uint32_t found = 1;
+    uint8_t *entry = (uint8_t *)(madt + 1);
+    while (entry < (uint8_t *)madt + madt->header.length) {
+        madt_lapic_t *processor = (madt_lapic_t *)entry;
+        if (processor->entry.type == MADT_TYPE_LAPIC && (processor->flags & MADT_LAPIC_ENABLED) && processor->apic_id != bsp->apic_id) {
+            found++;
+            if (num_cpus < MAX_CPUS) {
+                cpu_t *cpu = &cpus[num_cpus];
+                cpu->self = cpu;
+                cpu->index = num_cpus;
+                cpu->apic_id = processor->apic_id;
+                cpu->pd = &kernel_pd;
+                spin_lock_init(&cpu->rq_lock, LOCK_LEVEL_RUNQUEUE);
+                cpu->idle = idle_create(cpu);
+                apic_to_cpu[cpu->apic_id] = num_cpus;
+                num_cpus++;
+            }
+        }
+        entry += processor->entry.length;
+    }
+
+    if (num_cpus == 1) {
+        serial_printf("SMP: 1 CPU\n");
+        return;
+    }
+
+    memcpy((void *)(AP_TRAMPOLINE_PHYS + 0xC0000000), ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+    TRAMPOLINE_SLOT(ap_trampoline_cr3) = kernel_pd.phys_addr;
+    TRAMPOLINE_SLOT(ap_trampoline_entry) = (uint32_t)ap_main;
+
+    //the trampoline turns paging on while running from low memory, so identity map it for now
+    kernel_pd.entries[0] = kernel_pd.entries[0x300];
+    asm volatile ("mov %0, %%cr3" : : "r"(kernel_pd.phys_addr) : "memory");
+
+    smp_active = true;
+
+    uint32_t online = 1;
+    for (uint32_t i = 1; i < num_cpus; i++) {
+        if (smp_start_ap(&cpus[i])) {
+            online++;
+            serial_printf("SMP: CPU %d online (APIC %d)\n", i, cpus[i].apic_id);
+        } else {
+            serial_printf("SMP: CPU %d (APIC %d) didn't start\n", i, cpus[i].apic_id);
+        }
+    }
+
+    kernel_pd.entries[0] = 0;
+    asm volatile ("mov %0, %%cr3" : : "r"(kernel_pd.phys_addr) : "memory");
+
+    serial_printf("SMP: %d of %d CPUs online\n", online, found);
+}
+
+void smp_send_reschedule(cpu_t *cpu) {
+    if (cpu != this_cpu()) {
+        lapic_send_ipi(cpu->apic_id, IPI_RESCHEDULE_VECTOR);
+    }
+}
+
+// From the BSP's PIT tick, for CPUs without a local APIC timer of their own
+void smp_send_reschedule_all() {
+    lapic_send_ipi(0, ICR_ALL_BUT_SELF | IPI_RESCHEDULE_VECTOR);
+}
+
+void smp_reschedule_interrupt() {
+    lapic_eoi();
+    cpu_t *cpu = this_cpu();
+    if (cpu->current != NULL) {
+        schedule();
+    }
+}
+
+static inline void tlb_flush_local() {
+    uint32_t cr3;
+    asm volatile ("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+}
+
+// Makes every CPU drop what it has cached of pd's mappings, after some were taken away or
+// changed, and waits until they have. Call with the kernel lock held. A CPU spinning for that
+// lock has interrupts off and can't take the IPI, so it isn't waited for: it checks tlb_flush
+// as soon as it gets the lock, before it can touch user memory.
+void smp_flush_tlb(page_directory_t *pd) {
+    uint32_t flags = irq_save();
+    cpu_t *self = this_cpu();
+    if (self->pd == pd) {
+        tlb_flush_local();
+    }
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        cpu_t *cpu = &cpus[i];
+        if (cpu != self && cpu->online && cpu->pd == pd) {
+            cpu->tlb_flush = true;
+            lapic_send_ipi(cpu->apic_id, IPI_TLB_FLUSH_VECTOR);
+        }
+    }
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        cpu_t *cpu = &cpus[i];
+        while (cpu != self && cpu->tlb_flush && !cpu->lock_wait) {
+            asm volatile ("pause");
+        }
+    }
+    irq_restore(flags);
+}
+
+void smp_tlb_flush_interrupt() {
+    cpu_t *cpu = this_cpu();
+    tlb_flush_local();
+    cpu->tlb_flush = false;
+    lapic_eoi();
+}
+
+// The big kernel lock: one CPU at a time in the kernel proper. It's recursive, and the scheduler
+// drops it while a task is switched out and takes it back when the task resumes.
+void lock_kernel() {
+    uint32_t flags = irq_save();
+    cpu_t *cpu = this_cpu();
+    if (cpu->lock_depth++ == 0) {
+        cpu->lock_wait = true;
+        spin_lock(&kernel_lock);
+        cpu->lock_wait = false;
+        if (cpu->tlb_flush) {
+            tlb_flush_local();
+            cpu->tlb_flush = false;
+        }
+    }
+    irq_restore(flags);
+}
+
+void unlock_kernel() {
+    uint32_t flags = irq_save();
+    cpu_t *cpu = this_cpu();
+    if (--cpu->lock_depth == 0) {
+        spin_unlock(&kernel_lock);
+    }
+    irq_restore(flags);
+}
+
+// For the scheduler: drops the lock however deep it's held, and returns the depth to restore
+int32_t release_kernel_lock() {
+    cpu_t *cpu = this_cpu();
+    int32_t depth = cpu->lock_depth;
+    if (depth > 0) {
+        cpu->lock_depth = 0;
+        spin_unlock(&kernel_lock);
+    }
+    return depth;
+}
+
+void reacquire_kernel_lock(int32_t depth) {
+    uint32_t flags = irq_save();
+    cpu_t *cpu = this_cpu();
+    cpu->lock_wait = true;
+    spin_lock(&kernel_lock);
+    cpu->lock_wait = false;
+    if (cpu->tlb_flush) {
+        tlb_flush_local();
+        cpu->tlb_flush = false;
+    }
+    cpu->lock_depth = depth;
+    irq_restore(flags);
+}
+
+#ifdef LOCK_DEBUG
+// Lock order checking: each CPU keeps a bit per level it holds a lock of, and taking a lock at or
+// below the highest of them is a bug, even if it happened not to deadlock this time
+void lock_order_acquire(spinlock_t *lock) {
+    if (lock->level == LOCK_LEVEL_NONE) {
+        return;
+    }
+    uint32_t flags = irq_save();
+    cpu_t *cpu = this_cpu();
+    if ((cpu->locks_held >> lock->level) != 0) {
+        kpanic("Lock order violation: level %d taken while holding 0x%x", lock->level, cpu->locks_held);
+    }
+    cpu->locks_held |= 1 << lock->level;
+    irq_restore(flags);
+}
+
+void lock_order_release(spinlock_t *lock) {
+    if (lock->level == LOCK_LEVEL_NONE) {
+        return;
+    }
+    uint32_t flags = irq_save();
+    this_cpu()->locks_held &= ~(1 << lock->level);
+    irq_restore(flags);
+}
+#endif
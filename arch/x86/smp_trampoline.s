@@ -0,0 +1,73 @@
+# Application processor startup code. smp_initialize copies everything from ap_trampoline_start
+# to ap_trampoline_end to physical 0x8000, fills in the cr3/stack/entry slots, and points the
+# startup IPI at it. APs wake up in real mode at 0x0800:0000, so this code addresses itself
+# relative to where it's copied, not where it was linked.
+.equ TRAMPOLINE_BASE, 0x8000
+.equ PE_BIT, 0x1
+.equ PG_BIT, 0x80000000
+.equ WP_BIT, 0x10000
+
+.section .text
+.align 16
+.code16
+.global ap_trampoline_start
+ap_trampoline_start:
+    cli
+    cld
+    xorw %ax, %ax
+    movw %ax, %ds
+    lgdtl ap_gdt_ptr - ap_trampoline_start + TRAMPOLINE_BASE
+
+    movl %cr0, %eax
+    orl $PE_BIT, %eax
+    movl %eax, %cr0
+    ljmpl $0x08, $(ap_protected - ap_trampoline_start + TRAMPOLINE_BASE)
+
+.code32
+ap_protected:
+    movw $0x10, %ax
+    movw %ax, %ds
+    movw %ax, %es
+    movw %ax, %fs
+    movw %ax, %gs
+    movw %ax, %ss
+
+    # kernel_pd, with the first 4MB identity mapped until every AP is past this point
+    movl ap_trampoline_cr3 - ap_trampoline_start + TRAMPOLINE_BASE, %eax
+    movl %eax, %cr3
+    movl %cr0, %eax
+    orl $(PG_BIT | WP_BIT), %eax
+    movl %eax, %cr0
+
+    # the AP's idle thread stack, then off to ap_main in the higher half
+    movl ap_trampoline_stack - ap_trampoline_start + TRAMPOLINE_BASE, %esp
+    xorl %ebp, %ebp
+    movl ap_trampoline_entry - ap_trampoline_start + TRAMPOLINE_BASE, %eax
+    call *%eax
+1:
+    cli
+    hlt
+    jmp 1b
+
+# flat code and data segments, same selectors as the kernel's GDT
+.align 8
+ap_gdt:
+    .quad 0
+    .quad 0x00CF9A000000FFFF
+    .quad 0x00CF92000000FFFF
+ap_gdt_ptr:
+    .word ap_gdt_ptr - ap_gdt - 1
+    .long ap_gdt - ap_trampoline_start + TRAMPOLINE_BASE
+
+.global ap_trampoline_cr3
+ap_trampoline_cr3:
+    .long 0
+.global ap_trampoline_stack
+ap_trampoline_stack:
+    .long 0
+.global ap_trampoline_entry
+ap_trampoline_entry:
+    .long 0
+
+.global ap_trampoline_end
+ap_trampoline_end:
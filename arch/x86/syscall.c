@@ -9,30 +9,67 @@
 #include "inc_c/process.h"
 #include "inc_c/string.h"
 #include "../../kernel/include/errors.h"
+#include "../../kernel/include/timer.h"
+#include "inc_c/clock.h"
+#include "../../kernel/include/trace.h"
+#include "../../kernel/include/futex.h"
+#include "inc_c/devices.h"
+#include "inc_c/uring.h"
+#include "inc_c/mmap.h"
+#include "inc_c/user.h"
 
 
-
-typedef void (*syscall_handler_t)(regs_t *regs);
-
 //table of syscall handlers
 syscall_handler_t syscall_handlers[256];
 
+//per-syscall call counts and latencies, updated under the big kernel lock
+syscall_stat_t syscall_stats[256];
+
+// Which power of two bucket a latency falls in
+static uint32_t syscall_hist_bucket(uint64_t cycles) {
+    if (cycles >> 32) {
+        return SYSCALL_HIST_BUCKETS - 1;
+    }
+    if (cycles == 0) {
+        return 0;
+    }
+    return 31 - __builtin_clz((uint32_t)cycles);
+}
+
 void syscall_handler(regs_t *regs) {
-    serial_printf("Syscall: 0x%x\n", regs->eax);
+    uint32_t num = regs->eax;
+    trace(TRACE_SYSCALL_ENTER, num, regs->ebx);
 
-    syscall_handler_t handler = syscall_handlers[regs->eax];
-    if (regs->eax < 256 && handler != NULL) {
-        handler(regs);
-    } else {
-        serial_printf("Invalid syscall: 0x%x\n", regs->eax);
+    if (num >= 256 || syscall_handlers[num] == NULL) {
+        trace(TRACE_SYSCALL_INVALID, num, 0);
         regs->eax = -1;
-    }   
+        return;
+    }
+
+    syscall_stat_t *stat = &syscall_stats[num];
+    stat->calls++; //counted up front, since exit and exec don't come back
+    uint64_t start = clock_cycles();
+    syscall_handlers[num](regs);
+    uint64_t cycles = clock_cycles() - start;
 
-    return;
+    //-1 is how every syscall fails; anything else may be an address above 2GB, like mmap's
+    if (regs->eax == (uint32_t)-1) {
+        stat->errors++;
+    }
+    stat->cycles += cycles;
+    stat->histogram[syscall_hist_bucket(cycles)]++;
+    trace(TRACE_SYSCALL_EXIT, num, regs->eax);
 }
 
+// Every pointer a program passes in goes through access_ok (or access_ok_string) before the kernel
+// touches it, and every fd is checked against the size of the table.
+
 void syscall_read(regs_t *regs) {
-    file_descriptor_t *fd = current_process->fds[regs->ebx];
+    if (regs->ebx >= 256 || !access_ok((void *)regs->ecx, regs->edx, true)) {
+        regs->eax = -1;
+        return;
+    }
+    file_descriptor_t *fd = current_process->files->fds[regs->ebx];
     if (fd != NULL) {
         int read = fread((char *)regs->ecx, 1, regs->edx, fd);
         regs->eax = read;
@@ -42,7 +79,11 @@ void syscall_read(regs_t *regs) {
 }
 
 void syscall_write(regs_t *regs) {
-    file_descriptor_t *fd = current_process->fds[regs->ebx];
+    if (regs->ebx >= 256 || !access_ok((void *)regs->ecx, regs->edx, false)) {
+        regs->eax = -1;
+        return;
+    }
+    file_descriptor_t *fd = current_process->files->fds[regs->ebx];
     if (fd != NULL) {
         fd->flags |= FILE_WRITTEN_FLAG;
         int written = fwrite((char *)regs->ecx, 1, regs->edx, fd);
@@ -52,12 +93,102 @@ void syscall_write(regs_t *regs) {
     }
 }
 
+// ebx = fd, ecx = offset, edx = whence. Returns the new offset.
+void syscall_lseek(regs_t *regs) {
+    if (regs->ebx >= 256) {
+        regs->eax = -1;
+        return;
+    }
+    file_descriptor_t *fd = current_process->files->fds[regs->ebx];
+    if (fd != NULL && fseek(fd, regs->ecx, regs->edx) == 0) {
+        regs->eax = ftell(fd);
+    } else {
+        regs->eax = -1;
+    }
+}
+
+// ebx = fd, ecx = buffer, edx = count, esi = offset. The fd's own offset doesn't move.
+void syscall_pread(regs_t *regs) {
+    if (regs->ebx >= 256 || !access_ok((void *)regs->ecx, regs->edx, true)) {
+        regs->eax = -1;
+        return;
+    }
+    file_descriptor_t *fd = current_process->files->fds[regs->ebx];
+    if (fd != NULL) {
+        regs->eax = fpread((char *)regs->ecx, regs->edx, regs->esi, fd);
+    } else {
+        regs->eax = -1;
+    }
+}
+
+void syscall_pwrite(regs_t *regs) {
+    if (regs->ebx >= 256 || !access_ok((void *)regs->ecx, regs->edx, false)) {
+        regs->eax = -1;
+        return;
+    }
+    file_descriptor_t *fd = current_process->files->fds[regs->ebx];
+    if (fd != NULL) {
+        regs->eax = fpwrite((char *)regs->ecx, regs->edx, regs->esi, fd);
+    } else {
+        regs->eax = -1;
+    }
+}
+
+// Copies a program's iovec_t array into iov, checking every buffer in it
+static bool syscall_iovecs(iovec_t *iov, uint32_t user_iov, uint32_t count, bool write) {
+    if (count > IOV_MAX || !access_ok((void *)user_iov, count * sizeof(iovec_t), false)) {
+        return false;
+    }
+    memcpy(iov, (void *)user_iov, count * sizeof(iovec_t));
+    for (uint32_t i = 0; i < count; i++) {
+        if (!access_ok(iov[i].iov_base, iov[i].iov_len, write)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ebx = fd, ecx = iovec_t array, edx = how many
+void syscall_readv(regs_t *regs) {
+    iovec_t iov[IOV_MAX];
+    if (regs->ebx >= 256 || !syscall_iovecs(iov, regs->ecx, regs->edx, true)) {
+        regs->eax = -1;
+        return;
+    }
+    file_descriptor_t *fd = current_process->files->fds[regs->ebx];
+    if (fd != NULL) {
+        regs->eax = freadv(iov, regs->edx, fd);
+    } else {
+        regs->eax = -1;
+    }
+}
+
+void syscall_writev(regs_t *regs) {
+    iovec_t iov[IOV_MAX];
+    if (regs->ebx >= 256 || !syscall_iovecs(iov, regs->ecx, regs->edx, false)) {
+        regs->eax = -1;
+        return;
+    }
+    file_descriptor_t *fd = current_process->files->fds[regs->ebx];
+    if (fd != NULL) {
+        regs->eax = fwritev(iov, regs->edx, fd);
+    } else {
+        regs->eax = -1;
+    }
+}
+
 void syscall_open(regs_t *regs) {
+    if (!access_ok_string((char *)regs->ebx) || !access_ok_string((char *)regs->ecx)) {
+        regs->eax = -1;
+        return;
+    }
     file_descriptor_t *fd = fopen((char *)regs->ebx, (char*)regs->ecx);
-    if (fd->flags & FILE_ISDIR_FLAG) {
+    if (fd == NULL) {
+        regs->eax = -1;
+    } else if (fd->flags & FILE_ISDIR_FLAG) {
         fclose(fd);
         fd = (file_descriptor_t *)fopendir((char *)regs->ebx);
-        regs->eax = fd->id;
+        regs->eax = fd != NULL ? fd->id : (uint32_t)-1;
     } else if (fd->flags & FILE_NOTFOUND_FLAG) {
         fclose(fd);
         regs->eax = -1;
@@ -67,7 +198,11 @@ void syscall_open(regs_t *regs) {
 }
 
 void syscall_close(regs_t *regs) {
-    file_descriptor_t *fd = current_process->fds[regs->ebx];
+    if (regs->ebx >= 256) {
+        regs->eax = -1;
+        return;
+    }
+    file_descriptor_t *fd = current_process->files->fds[regs->ebx];
     if (fd != NULL) {
         fclose(fd);
         regs->eax = 0;
@@ -77,7 +212,11 @@ void syscall_close(regs_t *regs) {
 }
 
 void syscall_fstat(regs_t *regs) {
-    file_descriptor_t *fd = current_process->fds[regs->ebx];
+    if (regs->ebx >= 256 || !access_ok((void *)regs->ecx, sizeof(stat_t), true)) {
+        regs->eax = -1;
+        return;
+    }
+    file_descriptor_t *fd = current_process->files->fds[regs->ebx];
     if (fd != NULL) {
         regs->eax = fd->fs->stat(fd->fs_data, (stat_t *)regs->ecx);
     } else {
@@ -85,13 +224,60 @@ void syscall_fstat(regs_t *regs) {
     }
 }
 
+// The process' id, shared by all its threads. Does nothing else, so it's what the syscall
+// benchmarks call.
+void syscall_getpid(regs_t *regs) {
+    regs->eax = current_process->tgid;
+}
+
+// ebx = out fd, ecx = in fd, edx = where to read from in (a size_t, updated; NULL for in's own
+// offset), esi = count. Returns how many bytes were written.
+void syscall_sendfile(regs_t *regs) {
+    if (regs->ebx >= 256 || regs->ecx >= 256 || !access_ok((void *)regs->edx, sizeof(size_t), true)) {
+        regs->eax = -1;
+        return;
+    }
+    file_descriptor_t *out = current_process->files->fds[regs->ebx];
+    file_descriptor_t *in = current_process->files->fds[regs->ecx];
+    if (out != NULL && in != NULL) {
+        regs->eax = fsendfile(out, in, (size_t *)regs->edx, regs->esi);
+    } else {
+        regs->eax = -1;
+    }
+}
+
+// Ends the calling thread only; the process goes with its last thread
 void syscall_exit(regs_t *regs) {
-    current_process->entry_or_return = regs->ebx;
-    free_process(current_process);
+    thread_exit(regs->ebx);
+}
+
+// ebx = entry point, ecx = argument. Returns the new thread's id.
+void syscall_clone(regs_t *regs) {
+    process_t *thread = thread_create((void *)regs->ebx, (void *)regs->ecx);
+    if (thread != NULL) {
+        regs->eax = thread->pid;
+    } else {
+        regs->eax = -1;
+    }
+}
+
+// ebx = thread id, ecx = where to put its exit code (may be NULL)
+void syscall_thread_join(regs_t *regs) {
+    //joined into a copy, since the program's pages can change while we wait
+    int code;
+    regs->eax = thread_join(regs->ebx, &code);
+    int *user_code = (int *)regs->ecx;
+    if (regs->eax != (uint32_t)-1 && user_code != NULL && access_ok(user_code, sizeof(int), true)) {
+        *user_code = code;
+    }
 }
 
 void syscall_getdent(regs_t *regs) {
-    file_descriptor_t *fd = current_process->fds[regs->ebx];
+    if (regs->ebx >= 256 || !access_ok((void *)regs->ecx, sizeof(dirent_t), true)) {
+        regs->eax = -1;
+        return;
+    }
+    file_descriptor_t *fd = current_process->files->fds[regs->ebx];
     if (fd != NULL) {
         uint32_t ret = (uint32_t)fd->fs->getdent((dirent_t *)regs->ecx, regs->edx, fd->fs_data);
         regs->eax = ret;
@@ -100,6 +286,265 @@ void syscall_getdent(regs_t *regs) {
     }
 }
 
+// ebx = fd, ecx = buffer, edx = its size. Fills it with dirent64_t from the fd's cursor on.
+void syscall_getdents64(regs_t *regs) {
+    if (regs->ebx >= 256 || !access_ok((void *)regs->ecx, regs->edx, true)) {
+        regs->eax = -1;
+        return;
+    }
+    dir_descriptor_t *fd = (dir_descriptor_t *)current_process->files->fds[regs->ebx];
+    if (fd != NULL) {
+        regs->eax = fgetdents(fd, (void *)regs->ecx, regs->edx);
+    } else {
+        regs->eax = -1;
+    }
+}
+
+void syscall_nanosleep(regs_t *regs) {
+    timespec_t *user_req = (timespec_t *)regs->ebx;
+    timespec_t *user_rem = (timespec_t *)regs->ecx;
+    if (user_req == NULL || !access_ok(user_req, sizeof(timespec_t), false)) {
+        regs->eax = -1;
+        return;
+    }
+    timespec_t req = *user_req;
+    if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+        regs->eax = -1;
+        return;
+    }
+
+    uint32_t left = sleep_ticks(timespec_to_jiffies(&req));
+    //checked after the sleep, the pages could have gone in the meantime
+    if (user_rem != NULL && access_ok(user_rem, sizeof(timespec_t), true)) {
+        jiffies_to_timespec(left, user_rem);
+    }
+    regs->eax = 0;
+}
+
+void syscall_clock_gettime(regs_t *regs) {
+    timespec_t *ts = (timespec_t *)regs->ecx;
+    if (ts == NULL || !access_ok(ts, sizeof(timespec_t), true)) {
+        regs->eax = -1;
+        return;
+    }
+    regs->eax = clock_gettime(regs->ebx, ts);
+}
+
+// Whether every part of a program's spawn_file_actions_t is there to read
+static bool syscall_spawn_actions_ok(spawn_file_actions_t *actions) {
+    if (actions == NULL) {
+        return true;
+    }
+    if (!access_ok(actions, sizeof(spawn_file_actions_t), false)) {
+        return false;
+    }
+    uint32_t count = actions->count;
+    if (count > USER_SHARED_BASE / sizeof(spawn_file_action_t) || !access_ok(actions->actions, count * sizeof(spawn_file_action_t), false)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        spawn_file_action_t *action = &actions->actions[i];
+        if (action->action == SPAWN_ACTION_OPEN && (!access_ok_string(action->path) || !access_ok_string(action->mode))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ebx = path, ecx = argv, edx = envp, esi = spawn_file_actions_t * (or NULL to inherit every fd)
+void syscall_spawn(regs_t *regs) {
+    if (!access_ok_string((char *)regs->ebx) || !access_ok_strings((char **)regs->ecx) || !access_ok_strings((char **)regs->edx) || !syscall_spawn_actions_ok((spawn_file_actions_t *)regs->esi)) {
+        regs->eax = -1;
+        return;
+    }
+    regs->eax = process_spawn_detached((char *)regs->ebx, (char **)regs->ecx, (char **)regs->edx, (spawn_file_actions_t *)regs->esi);
+}
+
+// Only returns (with -1) if the program couldn't be loaded
+void syscall_exec(regs_t *regs) {
+    if (!access_ok_string((char *)regs->ebx) || !access_ok_strings((char **)regs->ecx) || !access_ok_strings((char **)regs->edx)) {
+        regs->eax = -1;
+        return;
+    }
+    regs->eax = process_exec((char *)regs->ebx, (char **)regs->ecx, (char **)regs->edx);
+}
+
+// ebx = address, ecx = FUTEX_WAIT or FUTEX_WAKE, edx = value or count, esi = timeout (may be NULL)
+void syscall_futex(regs_t *regs) {
+    uint32_t *addr = (uint32_t *)regs->ebx;
+    if (!access_ok(addr, sizeof(uint32_t), false)) {
+        regs->eax = FUTEX_ERR_FAULT;
+        return;
+    }
+    if (regs->ecx == FUTEX_WAIT) {
+        //a copy, so another thread can't change it between the checks and the wait
+        timespec_t *user_timeout = (timespec_t *)regs->esi;
+        timespec_t timeout;
+        if (user_timeout != NULL) {
+            if (!access_ok(user_timeout, sizeof(timespec_t), false)) {
+                regs->eax = FUTEX_ERR_FAULT;
+                return;
+            }
+            timeout = *user_timeout;
+        }
+        regs->eax = futex_wait(addr, regs->edx, user_timeout != NULL ? &timeout : NULL);
+    } else if (regs->ecx == FUTEX_WAKE) {
+        regs->eax = futex_wake(addr, regs->edx);
+    } else {
+        regs->eax = FUTEX_ERR_FAULT;
+    }
+}
+
+// ebx = mmap_args_t, see mmap.h. Returns the address, or -1.
+void syscall_mmap(regs_t *regs) {
+    if (!access_ok((void *)regs->ebx, sizeof(mmap_args_t), false)) {
+        regs->eax = -1;
+        return;
+    }
+    //a copy, so the program can't change the arguments between the checks and the mapping
+    mmap_args_t args = *(mmap_args_t *)regs->ebx;
+    file_descriptor_t *fd = NULL;
+    if (!(args.flags & MAP_ANONYMOUS)) {
+        if (args.fd < 0 || args.fd >= 256) {
+            regs->eax = -1;
+            return;
+        }
+        fd = current_process->files->fds[args.fd];
+    }
+    regs->eax = (uint32_t)mmap((void *)args.addr, args.length, args.prot, args.flags, fd, args.offset);
+}
+
+// ebx = address, ecx = length
+void syscall_munmap(regs_t *regs) {
+    regs->eax = munmap((void *)regs->ebx, regs->ecx);
+}
+
+// ebx = the new program break, or 0 to ask where it is. Returns the break, see mmap.h
+void syscall_brk(regs_t *regs) {
+    regs->eax = brk(regs->ebx);
+}
+
+// ebx = address, ecx = entries, see uring.h
+void syscall_uring_setup(regs_t *regs) {
+    regs->eax = uring_setup(regs->ebx, regs->ecx);
+}
+
+// ebx = how many queued entries to run
+void syscall_uring_enter(regs_t *regs) {
+    regs->eax = uring_enter(regs->ebx);
+}
+
+// /dev/syscallstat: reading gives one line per syscall that has been called since boot (or the
+// last reset), as of the first read:
+//   <number> calls <n> errors <n> cycles <total> hist <bucket>:<count> ...
+// where bucket b counts calls that took [2^b, 2^(b+1)) cycles. Reads continue where the last one
+// stopped, so readers should take turns; after the end has been read, the next read starts over
+// with fresh numbers. Writing "reset" zeroes everything.
+char *syscallstat_text = NULL;
+uint32_t syscallstat_length = 0;
+uint32_t syscallstat_pos = 0;
+
+static uint32_t syscallstat_putu(char *buf, uint32_t pos, uint64_t value) {
+    char digits[20];
+    uint32_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (count > 0) {
+        buf[pos++] = digits[--count];
+    }
+    return pos;
+}
+
+static uint32_t syscallstat_puts(char *buf, uint32_t pos, const char *s) {
+    while (*s != '\0') {
+        buf[pos++] = *s++;
+    }
+    return pos;
+}
+
+static void syscallstat_generate() {
+    uint32_t lines = 0;
+    for (uint32_t i = 0; i < 256; i++) {
+        if (syscall_stats[i].calls != 0) {
+            lines++;
+        }
+    }
+    //the longest a line can get, with every counter at its widest and every bucket in use
+    uint32_t line_max = 80 + SYSCALL_HIST_BUCKETS * 14;
+    syscallstat_text = kmalloc(lines * line_max + 1);
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < 256; i++) {
+        syscall_stat_t *stat = &syscall_stats[i];
+        if (stat->calls == 0) {
+            continue;
+        }
+        pos = syscallstat_putu(syscallstat_text, pos, i);
+        pos = syscallstat_puts(syscallstat_text, pos, " calls ");
+        pos = syscallstat_putu(syscallstat_text, pos, stat->calls);
+        pos = syscallstat_puts(syscallstat_text, pos, " errors ");
+        pos = syscallstat_putu(syscallstat_text, pos, stat->errors);
+        pos = syscallstat_puts(syscallstat_text, pos, " cycles ");
+        pos = syscallstat_putu(syscallstat_text, pos, stat->cycles);
+        pos = syscallstat_puts(syscallstat_text, pos, " hist");
+        for (uint32_t b = 0; b < SYSCALL_HIST_BUCKETS; b++) {
+            if (stat->histogram[b] == 0) {
+                continue;
+            }
+            syscallstat_text[pos++] = ' ';
+            pos = syscallstat_putu(syscallstat_text, pos, b);
+            syscallstat_text[pos++] = ':';
+            pos = syscallstat_putu(syscallstat_text, pos, stat->histogram[b]);
+        }
+        syscallstat_text[pos++] = '\n';
+    }
+    syscallstat_length = pos;
+    syscallstat_pos = 0;
+}
+
+int syscallstat_read(void *ptr, size_t size) {
+    if (syscallstat_text == NULL) {
+        syscallstat_generate();
+    }
+    uint32_t count = syscallstat_length - syscallstat_pos;
+    if (count > size) {
+        count = size;
+    }
+    memcpy(ptr, syscallstat_text + syscallstat_pos, count);
+    syscallstat_pos += count;
+    if (count == 0) {
+        //end of the table: the next read takes a new snapshot
+        kfree(syscallstat_text);
+        syscallstat_text = NULL;
+    }
+    return count;
+}
+
+int syscallstat_write(void *ptr, size_t size) {
+    char *buf = (char *)ptr;
+    if (size >= 5 && strncmp(buf, "reset", 5) == 0) {
+        memset(syscall_stats, 0, sizeof(syscall_stats));
+    }
+    return size;
+}
+
+device_t syscallstat_device = {
+    .name = "syscallstat",
+    .flags = 0,
+    .read = syscallstat_read,
+    .write = syscallstat_write,
+    .seek = device_seek_empty,
+    .tell = device_tell_empty,
+    .read_queue = NULL,
+    .next = NULL,
+};
+
+void syscall_stats_initialize() {
+    memset(syscall_stats, 0, sizeof(syscall_stats));
+    register_device(&syscallstat_device);
+}
+
 void syscall_initialize() {
     memset(syscall_handlers, 0, sizeof(syscall_handlers));
     syscall_handlers[SYSCALL_READ] = syscall_read;
@@ -107,6 +552,26 @@ void syscall_initialize() {
     syscall_handlers[SYSCALL_OPEN] = syscall_open;
     syscall_handlers[SYSCALL_CLOSE] = syscall_close;
     syscall_handlers[SYSCALL_FSTAT] = syscall_fstat;
+    syscall_handlers[SYSCALL_LSEEK] = syscall_lseek;
+    syscall_handlers[SYSCALL_MMAP] = syscall_mmap;
+    syscall_handlers[SYSCALL_MUNMAP] = syscall_munmap;
+    syscall_handlers[SYSCALL_BRK] = syscall_brk;
+    syscall_handlers[SYSCALL_PREAD] = syscall_pread;
+    syscall_handlers[SYSCALL_PWRITE] = syscall_pwrite;
+    syscall_handlers[SYSCALL_READV] = syscall_readv;
+    syscall_handlers[SYSCALL_WRITEV] = syscall_writev;
+    syscall_handlers[SYSCALL_NANOSLEEP] = syscall_nanosleep;
+    syscall_handlers[SYSCALL_GETPID] = syscall_getpid;
+    syscall_handlers[SYSCALL_SENDFILE] = syscall_sendfile;
+    syscall_handlers[SYSCALL_CLONE] = syscall_clone;
+    syscall_handlers[SYSCALL_SPAWN] = syscall_spawn;
+    syscall_handlers[SYSCALL_EXEC] = syscall_exec;
     syscall_handlers[SYSCALL_EXIT] = syscall_exit;
+    syscall_handlers[SYSCALL_THREAD_JOIN] = syscall_thread_join;
     syscall_handlers[SYSCALL_GETDENT] = syscall_getdent;
+    syscall_handlers[SYSCALL_FUTEX] = syscall_futex;
+    syscall_handlers[SYSCALL_GETDENTS64] = syscall_getdents64;
+    syscall_handlers[SYSCALL_URING_SETUP] = syscall_uring_setup;
+    syscall_handlers[SYSCALL_URING_ENTER] = syscall_uring_enter;
+    syscall_handlers[SYSCALL_CLOCK_GETTIME] = syscall_clock_gettime;
 }
\ No newline at end of file
@@ -12,8 +12,11 @@
 #include "inc_c/syscall.h"
 #include "inc_c/process.h"
 #include "inc_c/serial.h"
+#include "inc_c/fpu.h"
+#include "inc_c/smp.h"
+#include "../../kernel/include/trace.h"
 
-gdt_entry_t gdt[5];
+gdt_entry_t gdt[GDT_ENTRIES];
 gdt_ptr_t   gdt_ptr;
 
 idt_entry_t idt[256];
@@ -55,6 +58,10 @@ extern void isr29();
 extern void isr30();
 extern void isr31();
 extern void isr128();
+extern void isr239();
+extern void isr240();
+extern void isr241();
+extern void isr255();
 
 extern void irq0();
 extern void irq1();
@@ -83,20 +90,45 @@ void irq_uninstall_handler(int irq) {
     irq_routines[irq] = 0;
 }
 
+static void gdt_set_entry(gdt_entry_t *entry, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
+    entry->base_low    = (base & 0xFFFF);
+    entry->base_middle = (base >> 16) & 0xFF;
+    entry->base_high = (base >> 24) & 0xFF;
+
+    entry->limit_low = (limit & 0xFFFF);
+    entry->granularity = ((limit >> 16) & 0x0F);
+
+    entry->granularity |= (gran & 0xF0);
+    entry->access = access;
+}
+
 void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
-    gdt[num].base_low    = (base & 0xFFFF);
-    gdt[num].base_middle = (base >> 16) & 0xFF;
-    gdt[num].base_high = (base >> 24) & 0xFF;
+    gdt_set_entry(&gdt[num], base, limit, access, gran);
+}
 
-    gdt[num].limit_low = (limit & 0xFFFF);
-    gdt[num].granularity = ((limit >> 16) & 0x0F);
+// A data segment over just cpu, so %gs:offset is a field of the CPU we're running on
+static void gdt_set_cpu_entry(gdt_entry_t *entry, void *cpu, uint32_t cpu_size) {
+    gdt_set_entry(entry, (uint32_t)cpu, cpu_size - 1, 0x92, 0x40);
+}
+
+// Gives a CPU its own copy of the GDT with a TSS and per-CPU segment of its own, and loads them
+void gdt_install_cpu(gdt_entry_t *cpu_gdt, gdt_ptr_t *cpu_gdt_ptr, tss_t *tss, void *cpu, uint32_t cpu_size) {
+    memcpy(cpu_gdt, gdt, sizeof(gdt));
+    gdt_set_cpu_entry(&cpu_gdt[GDT_CPU_SELECTOR / 8], cpu, cpu_size);
 
-    gdt[num].granularity |= (gran & 0xF0);
-    gdt[num].access = access;
+    memset(tss, 0, sizeof(tss_t));
+    tss->ss0 = 0x10;
+    tss->iomap_base = sizeof(tss_t); //no I/O permission bitmap
+    gdt_set_entry(&cpu_gdt[GDT_TSS_SELECTOR / 8], (uint32_t)tss, sizeof(tss_t) - 1, 0x89, 0x00);
+
+    cpu_gdt_ptr->limit = (sizeof(gdt_entry_t) * GDT_ENTRIES) - 1;
+    cpu_gdt_ptr->base = (uint32_t)cpu_gdt;
+    gdt_flush((uint32_t)cpu_gdt_ptr);
+    asm volatile ("ltr %w0" : : "r"(GDT_TSS_SELECTOR));
 }
 
 void gdt_initialize() {
-    gdt_ptr.limit = (sizeof(gdt_entry_t) * 5) - 1;
+    gdt_ptr.limit = (sizeof(gdt_entry_t) * GDT_ENTRIES) - 1;
     gdt_ptr.base  = (uint32_t)&gdt;
 
     // NULL descriptor
@@ -109,6 +141,10 @@ void gdt_initialize() {
     gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xCF); /* DPL ring 3 */
     // User data segment
     gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
+    // No TSS until gdt_install_cpu
+    gdt_set_gate(5, 0, 0, 0, 0);
+    // Per-CPU data: only the BSP runs before gdt_install_cpu
+    gdt_set_cpu_entry(&gdt[GDT_CPU_SELECTOR / 8], &cpus[0], sizeof(cpu_t));
 
     gdt_flush((uint32_t)&gdt_ptr);
 }
@@ -157,8 +193,14 @@ void isrs_install() {
     idt_set_gate(30, (uint32_t)isr30, 0x8, 0x8E);
     idt_set_gate(31, (uint32_t)isr31, 0x8, 0x8E);
 
-    //syscall IDT entry
-    idt_set_gate(128, (uint32_t)isr128, 0x08, 0x8E);
+    //syscall IDT entry, DPL 3 so ring 3 can use int 0x80
+    idt_set_gate(128, (uint32_t)isr128, 0x08, 0xEE);
+
+    //local APIC vectors
+    idt_set_gate(LAPIC_TIMER_VECTOR, (uint32_t)isr239, 0x08, 0x8E);
+    idt_set_gate(IPI_RESCHEDULE_VECTOR, (uint32_t)isr240, 0x08, 0x8E);
+    idt_set_gate(IPI_TLB_FLUSH_VECTOR, (uint32_t)isr241, 0x08, 0x8E);
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, (uint32_t)isr255, 0x08, 0x8E);
 }
 
 char *exception_messages[] = {
@@ -196,43 +238,88 @@ char *exception_messages[] = {
     "Reserved"
 };
 
-extern process_t *current_process;
+// Faults that aren't errors: the first touch of a lazily reserved page, or the first write to a
+// copy-on-write one, from the program or from the kernel on its behalf. Returns whether the
+// access can just be retried.
+static bool page_fault_resolve(regs_t *r) {
+    uint32_t faulting_address;
+    asm volatile("mov %%cr2, %0" : "=r" (faulting_address));
+    if (faulting_address >= 0xC0000000 || current_process == NULL) {
+        return false;
+    }
+    bool resolved = false;
+    lock_kernel();
+    if (!(r->err_code & 0x1)) {
+        resolved = lazy_page_fault(faulting_address, current_pd);
+    } else if (r->err_code & 0x2) {
+        resolved = cow_page_fault(faulting_address, current_pd); //only writes to present pages can be copy-on-write
+    }
+    unlock_kernel();
+    return resolved;
+}
+
 void page_fault_error(regs_t *r) {
-    //later on we will do some code elsewhere to see if this is actually an error (swapping pages, copy on write etc)
-    //but for now, we will just print out information about the page fault
+    //anything page_fault_resolve can't fix is an error, so print out information about it
     uint32_t faulting_address;
     asm volatile("mov %%cr2, %0" : "=r" (faulting_address));
     uint32_t flags = r->err_code;
 
-    // if (current_process->pid == 0) {
-    //     kpanic("Page fault! (%s%s%s%s%s) at 0x%x\n", (flags & 0x1) ? "Present |" : "Not present |", (flags & 0x2) ? "Write |" : "Read |", (flags & 0x4) ? "User |" : "Supervisor |", (flags & 0x8) ? "Reserved bit set |" : "", (flags & 0x10) ? "Instruction fetch" : "", faulting_address);
-    // } else {
-    //     serial_printf("Process %d page fault! (%s%s%s%s%s) at 0x%x\n", current_process->pid, (flags & 0x1) ? "Present |" : "Not present |", (flags & 0x2) ? "Write |" : "Read |", (flags & 0x4) ? "User |" : "Supervisor |", (flags & 0x8) ? "Reserved bit set |" : "", (flags & 0x10) ? "Instruction fetch" : "", faulting_address);
-    // }
+    if ((r->cs & 3) == 3) {
+        //a program's fault only takes the program down, see isr_handler
+        serial_printf("Process %d page fault! (%s%s%s%s%s) at 0x%x\n", current_process->pid, (flags & 0x1) ? "Present |" : "Not present |", (flags & 0x2) ? "Write |" : "Read |", (flags & 0x4) ? "User |" : "Supervisor |", (flags & 0x8) ? "Reserved bit set |" : "", (flags & 0x10) ? "Instruction fetch" : "", faulting_address);
+        return;
+    }
     kpanic("Page fault! (%s%s%s%s%s) at 0x%x\n", (flags & 0x1) ? "Present |" : "Not present |", (flags & 0x2) ? "Write |" : "Read |", (flags & 0x4) ? "User |" : "Supervisor |", (flags & 0x8) ? "Reserved bit set |" : "", (flags & 0x10) ? "Instruction fetch" : "", faulting_address);
-    
-    asm volatile (
-        "movl $60, %%eax \n\t"
-        "movl $1, %%ebx \n\t"
-        "int $0x80 \n\t"
-        :
-        :
-        : "%eax", "%ebx"
-    );
 }
 
 void isr_handler(regs_t *r) {
     if (r->int_no < 32) {
+        if (r->int_no == 7) {
+            //device not available: lazy FPU switch, not an error
+            fpu_trap();
+            return;
+        }
         if (r->int_no == 14) {
+            if (current_process != NULL) {
+                current_process->stats.page_faults++;
+            }
+            if (page_fault_resolve(r)) {
+                return;
+            }
             page_fault_error(r);
         }
+        if ((r->cs & 3) == 3) {
+            //faulted in ring 3: end the thread that did it, the kernel is fine
+            serial_printf("Process %d: %s Exception at 0x%x\n", current_process->pid, exception_messages[r->int_no], r->eip);
+            lock_kernel();
+            thread_exit(-1);
+        }
 
         kpanic("%s Exception. System Halted!\n", exception_messages[r->int_no]);
     }
 
+    if (r->int_no != 128) {
+        this_cpu()->irq_counts[r->int_no - 32]++;
+    }
+
     if (r->int_no == 128) {
+        lock_kernel();
         syscall_handler(r);
+        unlock_kernel();
+    }
+
+    if (r->int_no == LAPIC_TIMER_VECTOR) {
+        lapic_timer_interrupt(r);
+    }
+
+    if (r->int_no == IPI_RESCHEDULE_VECTOR) {
+        smp_reschedule_interrupt();
+    }
+
+    if (r->int_no == IPI_TLB_FLUSH_VECTOR) {
+        smp_tlb_flush_interrupt();
     }
+    //LAPIC_SPURIOUS_VECTOR needs no EOI, and there's nothing to do for it
 }
 
 void irq_remap() {
@@ -278,9 +365,26 @@ void irq_handler(regs_t *r) {
     
     outb(0x20, 0x20);
 
+    this_cpu()->irq_counts[r->int_no - 32]++;
+    trace(TRACE_IRQ_ENTER, r->int_no - 32, 0);
+
+    //without local APIC timers the other CPUs' time slices run off this tick too. Tell them before
+    //waiting on the kernel lock, since whoever holds it may only let go when it's preempted.
+    if (r->int_no == 32 && smp_active && lapic_timer_mode == LAPIC_TIMER_OFF) {
+        smp_send_reschedule_all();
+    }
+
     handler = irq_routines[r->int_no - 32];
     if (handler) {
+        lock_kernel();
         handler(r);
+        unlock_kernel();
+    }
+
+    //the handler woke something up, or the time slice ran out. The interrupt frame stays on this
+    //task's stack, and we return through it whenever the task is scheduled again.
+    if (need_resched && current_process != NULL) {
+        schedule();
     }
 }
 
@@ -296,6 +400,11 @@ void idt_initialize() {
     irq_install();
 }
 
+// The IDT is shared, APs just need to load it
+void idt_install_cpu() {
+    idt_load((uint32_t)&idt_ptr);
+}
+
 void tables_initialize() {
     gdt_initialize();
     idt_initialize();
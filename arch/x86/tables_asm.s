@@ -8,8 +8,9 @@ gdt_flush:
     mov %ax, %ds
     mov %ax, %es
     mov %ax, %fs
-    mov %ax, %gs
     mov %ax, %ss
+    mov $0x30, %ax /* GDT_CPU_SELECTOR, the per-CPU segment */
+    mov %ax, %gs
     ljmp $0x08, $gdt_flush_2 /* jump to kernel code segment */
 gdt_flush_2:
     ret
@@ -80,6 +81,10 @@ ISR_NOERCODE 30
 ISR_NOERCODE 31
 
 ISR_NOERCODE 128
+ISR_NOERCODE 239
+ISR_NOERCODE 240
+ISR_NOERCODE 241
+ISR_NOERCODE 255
 
 /* ISR common stub */
 .extern isr_handler
@@ -93,6 +98,7 @@ isr_common_stub:
     mov %ax, %ds
     mov %ax, %es
     mov %ax, %fs
+    mov $0x30, %ax /* GDT_CPU_SELECTOR, the per-CPU segment */
     mov %ax, %gs
 
     /* Push the stack pointer */
@@ -122,6 +128,7 @@ isr_common_stub:
         push $\num+32
         jmp irq_common_stub
 .endm
+IRQ 0
 IRQ 1
 IRQ 2
 IRQ 3
@@ -150,6 +157,7 @@ irq_common_stub:
     mov %ax, %ds
     mov %ax, %es
     mov %ax, %fs
+    mov $0x30, %ax /* GDT_CPU_SELECTOR, the per-CPU segment */
     mov %ax, %gs
 
     /* Push the stack pointer */
@@ -0,0 +1,158 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "inc_c/uring.h"
+#include "inc_c/user.h"
+#include "inc_c/memory.h"
+#include "inc_c/process.h"
+#include "inc_c/syscall.h"
+#include "inc_c/string.h"
+
+extern page_directory_t kernel_pd;
+
+// Only calls that act on files; everything else completes with -1. A read can still sleep, on a
+// tty say, see uring.h.
+static bool uring_op_allowed(uint32_t opcode) {
+    switch (opcode) {
+        case SYSCALL_READ:
+        case SYSCALL_WRITE:
+        case SYSCALL_READV:
+        case SYSCALL_WRITEV:
+        case SYSCALL_PREAD:
+        case SYSCALL_PWRITE:
+        case SYSCALL_LSEEK:
+        case SYSCALL_SENDFILE:
+        case SYSCALL_OPEN:
+        case SYSCALL_CLOSE:
+        case SYSCALL_FSTAT:
+        case SYSCALL_GETDENT:
+        case SYSCALL_GETDENTS64:
+            return true;
+        default:
+            return false;
+    }
+}
+
+int uring_setup(uint32_t addr, uint32_t entries) {
+    process_t *self = current_process;
+    if (self->uring != NULL || (self->flags & PROCESS_FLAG_KTHREAD) || self->pd == &kernel_pd) {
+        return -1;
+    }
+    if (entries == 0 || entries > URING_MAX_ENTRIES || (entries & (entries - 1)) != 0) {
+        return -1;
+    }
+    uint32_t sq_offset = sizeof(uring_header_t);
+    uint32_t cq_offset = sq_offset + entries * sizeof(uring_sqe_t);
+    uint32_t size = (cq_offset + entries * 2 * sizeof(uring_cqe_t) + 0xFFF) & ~0xFFF;
+    if (addr == 0 || (addr & 0xFFF) != 0 || addr >= USER_SHARED_BASE || size > USER_SHARED_BASE - addr) {
+        return -1;
+    }
+    for (uint32_t page = addr; page < addr + size; page += 0x1000) {
+        if (page_is_used(page, self->pd)) {
+            return -1;
+        }
+    }
+
+    //freed with the address space, like any other page of the program's
+    uint32_t flags = irq_save();
+    for (uint32_t page = addr; page < addr + size; page += 0x1000) {
+        page_table_entry_t first;
+        if (!find_free_page(&first)) {
+            //out of memory: give back what we've mapped so far
+            for (uint32_t mapped = addr; mapped < page; mapped += 0x1000) {
+                free_page(mapped, self->pd);
+            }
+            irq_restore(flags);
+            return -1;
+        }
+        uint32_t phys = first.pd_entry * 0x400000 + first.pt_entry * 0x1000;
+        alloc_page_kmalloc(page, phys, true, false, true, self->pd);
+        phys_fill(phys, 0, NULL, 0x1000);
+    }
+    irq_restore(flags);
+
+    uring_t *uring = (uring_t *)kmalloc(sizeof(uring_t));
+    uring->size = size;
+    uring->header = (uring_header_t *)addr;
+    uring->sqes = (uring_sqe_t *)(addr + sq_offset);
+    uring->cqes = (uring_cqe_t *)(addr + cq_offset);
+    uring->entries = entries;
+    uring->header->entries = entries;
+    uring->header->sq_offset = sq_offset;
+    uring->header->cq_offset = cq_offset;
+    self->uring = uring;
+    return 0;
+}
+
+// Whether the rings are still there for us to write to. munmap and MAP_FIXED take any user
+// address, and a write to a page that's gone would be a kernel page fault.
+static bool uring_mapped(uring_t *uring, page_directory_t *pd) {
+    uint32_t addr = (uint32_t)uring->header;
+    for (uint32_t page = addr; page < addr + uring->size; page += 0x1000) {
+        if (!page_is_writable(page, pd)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int uring_enter(uint32_t count) {
+    uring_t *uring = current_process->uring;
+    if (uring == NULL) {
+        return -1;
+    }
+    uring_header_t *header = uring->header;
+    uint32_t cq_size = uring->entries * 2;
+
+    uint32_t done = 0;
+    while (done < count) {
+        //checked before every entry, since another thread can unmap them while one sleeps
+        if (!uring_mapped(uring, current_pd)) {
+            return -1;
+        }
+        uint32_t head = header->sq_head;
+        if (head == header->sq_tail) {
+            break;
+        }
+        if (header->cq_tail - header->cq_head >= cq_size) {
+            break; //no room for the result, leave the rest queued
+        }
+        //copy it out first, the program could change it under us
+        uring_sqe_t sqe = uring->sqes[head & (uring->entries - 1)];
+        header->sq_head = head + 1;
+
+        int32_t result = -1;
+        if (uring_op_allowed(sqe.opcode)) {
+            regs_t regs;
+            memset(&regs, 0, sizeof(regs));
+            regs.eax = sqe.opcode;
+            regs.ebx = sqe.args[0];
+            regs.ecx = sqe.args[1];
+            regs.edx = sqe.args[2];
+            regs.esi = sqe.args[3];
+            //straight to the handler: syscallstat already counts this as part of URING_ENTER
+            syscall_handlers[sqe.opcode](&regs);
+            result = (int32_t)regs.eax;
+        }
+
+        if (!uring_mapped(uring, current_pd)) {
+            return -1; //it ran, but there's nowhere left to post the result
+        }
+
+        uring_cqe_t *cqe = &uring->cqes[header->cq_tail & (cq_size - 1)];
+        cqe->user_data = sqe.user_data;
+        cqe->result = result;
+        header->cq_tail++;
+        done++;
+    }
+    return done;
+}
+
+// The ring memory goes with the address space; this is just the kernel's bookkeeping
+void uring_release(process_t *process) {
+    if (process->uring != NULL) {
+        kfree(process->uring);
+        process->uring = NULL;
+    }
+}
@@ -0,0 +1,246 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "inc_c/user.h"
+#include "inc_c/memory.h"
+#include "inc_c/smp.h"
+#include "inc_c/string.h"
+#include "inc_c/serial.h"
+#include "inc_c/syscall.h"
+#include "inc_c/clock.h"
+#include "../../kernel/include/timer.h"
+#include "../../kernel/include/errors.h"
+
+bool sysenter_supported = false;
+uint32_t user_sysexit_eip = 0; //user_sysenter_return in the user code page, see sysenter_entry
+
+//kernel copies of the pages every program gets at USER_SHARED_BASE
+uint8_t *user_page = NULL;
+uint32_t user_page_phys = 0;
+user_data_t *user_data = NULL;
+uint32_t user_data_phys = 0;
+
+extern void sysenter_entry();
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// Where a symbol in the user code (.user_entry and .user_text) is in a program
+uint32_t user_address(void *symbol) {
+    return USER_CODE_BASE + ((uint32_t)symbol - (uint32_t)user_code_start);
+}
+
+// Per-CPU part: SYSENTER takes its stack from an MSR, so each CPU points it at its own TSS,
+// whose esp0 the scheduler keeps up to date
+void user_cpu_initialize(cpu_t *cpu) {
+    if (!sysenter_supported) {
+        return;
+    }
+    wrmsr(MSR_SYSENTER_CS, 0x08);
+    wrmsr(MSR_SYSENTER_ESP, (uint32_t)&cpu->tss.esp0);
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+}
+
+void user_initialize() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    sysenter_supported = edx & (1 << 11);
+    //the Pentium Pro reports SEP without actually having it
+    uint32_t family = (eax >> 8) & 0xF;
+    uint32_t model = (eax >> 4) & 0xF;
+    uint32_t stepping = eax & 0xF;
+    if (family == 6 && model < 3 && stepping < 3) {
+        sysenter_supported = false;
+    }
+
+    uint32_t size = (uint32_t)user_code_end - (uint32_t)user_code_start;
+    kassert(size <= 0x1000);
+    user_page = (uint8_t *)kmalloc_ap(0x1000, &user_page_phys);
+    memset(user_page, 0, 0x1000);
+    memcpy(user_page, user_code_start, size);
+    if (!sysenter_supported) {
+        //retarget the entry's jmp at user_int80
+        uint32_t from = (uint32_t)user_syscall - (uint32_t)user_code_start;
+        uint32_t to = (uint32_t)user_int80 - (uint32_t)user_code_start;
+        user_page[from] = 0xE9;
+        *(uint32_t *)&user_page[from + 1] = to - (from + 5);
+    }
+    user_sysexit_eip = user_address(user_sysenter_return);
+
+    user_data = (user_data_t *)kmalloc_ap(0x1000, &user_data_phys);
+    memset(user_data, 0, 0x1000);
+    user_data->clocksource = clocksource;
+    user_data->hz = HZ;
+    user_data->tsc_khz = tsc_khz;
+    user_data->clock_mult = clock_mult;
+    user_data->boot_epoch = boot_epoch;
+    user_data->tsc_at_boot = tsc_at_boot;
+    user_data_update();
+
+    serial_printf("Syscalls: %s\n", sysenter_supported ? "SYSENTER" : "int 0x80");
+    user_cpu_initialize(&cpus[0]);
+}
+
+// Gives a new address space the shared pages, with a fresh per-process page
+void user_map_shared(page_directory_t *pd) {
+    map_shared_page(USER_CODE_BASE, user_page_phys, false, pd);
+    map_shared_page(USER_DATA_BASE, user_data_phys, false, pd);
+
+    //the physical page bitmaps have no lock of their own yet
+    uint32_t flags = irq_save();
+    page_table_entry_t page = first_free_page();
+    uint32_t phys = page.pd_entry * 0x400000 + page.pt_entry * 0x1000;
+    alloc_page_kmalloc(USER_PROCESS_DATA_BASE, phys, true, false, false, pd);
+    irq_restore(flags);
+    phys_fill(phys, 0, NULL, 0x1000);
+}
+
+void user_set_pid(page_directory_t *pd, int pid) {
+    int32_t value = pid;
+    phys_fill(virt_to_phys(USER_PROCESS_DATA_BASE, pd), offsetof(user_process_data_t, pid), &value, sizeof(value));
+}
+
+void user_set_brk(page_directory_t *pd, uint32_t brk) {
+    phys_fill(virt_to_phys(USER_PROCESS_DATA_BASE, pd), offsetof(user_process_data_t, brk), &brk, sizeof(brk));
+}
+
+// Called on the BSP every tick, with the kernel lock held, so there's only ever one writer
+void user_data_update() {
+    if (user_data == NULL) {
+        return;
+    }
+    user_data->seq++;
+    asm volatile ("" ::: "memory");
+    user_data->jiffies = get_jiffies_64();
+    user_data->tick_ns = user_data->jiffies * (NSEC_PER_SEC / HZ);
+    asm volatile ("" ::: "memory");
+    user_data->seq++;
+}
+
+// Whether a syscall can read (or, with write, write) len bytes at addr for the current program:
+// the whole range is below the shared pages and every page of it is taken, so a bad pointer gets
+// -1 instead of a page fault in ring 0. Only holds while the kernel lock is, since another thread
+// can unmap the pages once it's dropped.
+bool access_ok(const void *addr, uint32_t len, bool write) {
+    uint32_t start = (uint32_t)addr;
+    if (len == 0) {
+        return true;
+    }
+    if (start >= USER_SHARED_BASE || len > USER_SHARED_BASE - start) {
+        return false;
+    }
+    page_directory_t *pd = current_pd;
+    for (uint32_t page = start & ~0xFFF; page < start + len; page += 0x1000) {
+        if (write ? !page_is_writable(page, pd) : !page_is_used(page, pd)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// access_ok for a NUL-terminated string, checked a page at a time up to its end
+bool access_ok_string(const char *str) {
+    uint32_t addr = (uint32_t)str;
+    page_directory_t *pd = current_pd;
+    while (addr < USER_SHARED_BASE && page_is_used(addr, pd)) {
+        uint32_t end = (addr | 0xFFF) + 1;
+        for (; addr < end; addr++) {
+            if (*(const char *)addr == '\0') {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// access_ok for a NULL-terminated array of strings like argv, which may itself be NULL
+bool access_ok_strings(char *const *array) {
+    if (array == NULL) {
+        return true;
+    }
+    for (uint32_t i = 0; ; i++) {
+        if (!access_ok(&array[i], sizeof(char *), false)) {
+            return false;
+        }
+        if (array[i] == NULL) {
+            return true;
+        }
+        if (!access_ok_string(array[i])) {
+            return false;
+        }
+    }
+}
+
+void sysenter_handler(regs_t *r) {
+    lock_kernel();
+    syscall_handler(r);
+    unlock_kernel();
+}
+
+USER_TEXT int user_getpid() {
+    return ((volatile user_process_data_t *)USER_PROCESS_DATA_BASE)->pid;
+}
+
+// sbrk(increment): grows (or shrinks) the heap and returns where it used to end, or (void *)-1 if
+// it can't. Only sbrk(0) stays out of the kernel: shrinking does too, since the pages past the new
+// break have to be unmapped. Threads of a program that call it at once need a lock of their own
+// around it, as with any sbrk.
+USER_TEXT void *user_sbrk(int32_t increment) {
+    uint32_t old = ((volatile user_process_data_t *)USER_PROCESS_DATA_BASE)->brk;
+    if (increment == 0) {
+        return (void *)old;
+    }
+    uint32_t want = old + increment;
+    uint32_t got;
+    //through the syscall entry, so it gets SYSENTER when there is one
+    asm volatile ("call *%1" : "=a"(got) : "r"(USER_ENTRY_SYSCALL), "a"(SYSCALL_BRK), "b"(want) : "memory", "cc");
+    if (got != want) {
+        return (void *)-1;
+    }
+    return (void *)old;
+}
+
+// clock_cycles_to_ns, for user code
+static inline __attribute__((always_inline)) uint64_t user_cycles_to_ns(uint64_t cycles, uint32_t mult) {
+    uint64_t high = (cycles >> 32) * mult;
+    uint64_t low = (cycles & 0xFFFFFFFF) * mult;
+    return (high << (32 - CLOCK_SHIFT)) + (low >> CLOCK_SHIFT);
+}
+
+// clock_gettime without entering the kernel. Gives the same answers as the syscall on a TSC
+// clocksource, and tick resolution on the PIT, which ring 3 can't read.
+USER_TEXT int user_clock_gettime(uint32_t clock_id, timespec_t *ts) {
+    volatile user_data_t *data = (volatile user_data_t *)USER_DATA_BASE;
+    if (clock_id != CLOCK_REALTIME && clock_id != CLOCK_MONOTONIC && clock_id != CLOCK_MONOTONIC_RAW && clock_id != CLOCK_BOOTTIME) {
+        return -1;
+    }
+
+    uint32_t seq;
+    uint64_t ns;
+    uint32_t epoch;
+    do {
+        seq = data->seq;
+        asm volatile ("" ::: "memory");
+        if (data->clocksource == CLOCKSOURCE_TSC) {
+            uint32_t low, high;
+            asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+            ns = user_cycles_to_ns((((uint64_t)high << 32) | low) - data->tsc_at_boot, data->clock_mult);
+        } else {
+            ns = data->tick_ns;
+        }
+        epoch = data->boot_epoch;
+        asm volatile ("" ::: "memory");
+    } while ((seq & 1) || seq != data->seq);
+
+    //one divl is enough: the quotient only overflows after 136 years of uptime
+    uint32_t sec, nsec;
+    asm ("divl %4" : "=a"(sec), "=d"(nsec) : "a"((uint32_t)ns), "d"((uint32_t)(ns >> 32)), "r"((uint32_t)NSEC_PER_SEC));
+    if (clock_id == CLOCK_REALTIME) {
+        sec += epoch;
+    }
+    ts->tv_sec = (int32_t)sec;
+    ts->tv_nsec = (int32_t)nsec;
+    return 0;
+}
@@ -0,0 +1,135 @@
+.section .text
+
+.equ USER_CS, 0x1B
+.equ USER_DS, 0x23
+
+# enter_user_mode(eip, esp): drops to ring 3 at eip on the stack at esp, with interrupts enabled.
+# The general registers are cleared so nothing of the kernel's leaks out. Never returns.
+.globl enter_user_mode
+enter_user_mode:
+    movl 4(%esp), %ecx
+    movl 8(%esp), %edx
+
+    movl $USER_DS, %eax
+    movw %ax, %ds
+    movw %ax, %es
+    movw %ax, %fs
+    movw %ax, %gs
+
+    pushl $USER_DS # ss
+    pushl %edx # esp
+    pushl $0x202 # eflags, with IF set
+    pushl $USER_CS # cs
+    pushl %ecx # eip
+
+    xorl %eax, %eax
+    xorl %ebx, %ebx
+    xorl %ecx, %ecx
+    xorl %edx, %edx
+    xorl %esi, %esi
+    xorl %edi, %edi
+    xorl %ebp, %ebp
+    iret
+
+# SYSENTER lands here with interrupts off, on the stack in the SYSENTER_ESP MSR, which is this
+# CPU's tss.esp0 field. That holds the top of the current task's kernel stack, so one load gets
+# us onto it. Then this builds the same frame isr_common_stub does, so syscall_handler can't
+# tell the two ways in apart. The arguments are still in the registers the program put them in;
+# user_sysenter saved ecx and edx, which SYSEXIT needs, and left its esp in ebp.
+.globl sysenter_entry
+sysenter_entry:
+    movl (%esp), %esp
+
+    pushl $USER_DS # ss
+    pushl %ebp # useresp
+    pushfl # eflags, as they'll be after sysexit
+    orl $0x200, (%esp)
+    pushl $USER_CS # cs
+    pushl user_sysexit_eip # eip
+    pushl $0 # err_code
+    pushl $128 # int_no
+    pusha
+    push %ds
+    push %es
+    push %fs
+    push %gs
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov $0x30, %ax # GDT_CPU_SELECTOR, the per-CPU segment
+    mov %ax, %gs
+
+    mov %esp, %eax
+    push %eax
+    call sysenter_handler
+    pop %eax
+
+    pop %gs
+    pop %fs
+    pop %es
+    pop %ds
+    popa
+    add $8, %esp
+
+    # SYSEXIT goes to edx with esp = ecx. sti only takes effect after the next instruction, so
+    # no interrupt can arrive on the kernel stack in between.
+    movl (%esp), %edx
+    movl 12(%esp), %ecx
+    sti
+    sysexit
+
+# The user code page starts with the entry points programs call, one every 8 bytes, see user.h.
+# Everything in .user_entry and .user_text is copied into the page and runs in ring 3 at
+# USER_SHARED_BASE + its offset from user_code_start, so it must be position independent.
+.section .user_entry, "ax"
+
+# The syscall entry. user_initialize points the jump at user_int80 if there's no SYSENTER.
+.globl user_syscall
+user_syscall:
+    jmp user_sysenter
+.balign 8
+
+.globl user_entry_getpid
+user_entry_getpid:
+    jmp user_getpid
+.balign 8
+
+.globl user_entry_clock_gettime
+user_entry_clock_gettime:
+    jmp user_clock_gettime
+.balign 8
+
+.globl user_entry_sbrk
+user_entry_sbrk:
+    jmp user_sbrk
+.balign 8
+
+.section .user_text, "ax"
+
+.globl user_sysenter
+user_sysenter:
+    pushl %ecx
+    pushl %edx
+    pushl %ebp
+    movl %esp, %ebp
+    sysenter
+.globl user_sysenter_return
+user_sysenter_return:
+    popl %ebp
+    popl %edx
+    popl %ecx
+    ret
+
+.globl user_int80
+user_int80:
+    int $0x80
+    ret
+
+# Where entry points return to: exits with the return value
+.globl user_exit
+user_exit:
+    movl %eax, %ebx
+    movl $60, %eax
+    int $0x80
+    jmp user_exit
@@ -41,6 +41,10 @@ import struct
 
 # Each header is 80 bytes long for future expansion.
 
+# File data starts on a page boundary of the image, so the kernel can map it straight into a
+# program with mmap. The gaps are zero filled.
+PAGE_SIZE = 4096
+
 def main(argv):
     if len(argv) < 2:
         print("Usage: ramdisk.py [output] [dir]")
@@ -118,7 +122,8 @@ def main(argv):
     # Write the number of files
     ramdisk.extend(struct.pack("<I", num_files))
     # Write the size of the headers
-    ramdisk.extend(struct.pack("<I", (headers_num * 80) + 16))
+    headers_sz = (headers_num * 80) + 16
+    ramdisk.extend(struct.pack("<I", headers_sz))
     # Number of files/directories in the root directory
     ramdisk.extend(struct.pack("<I", len(tree)))
 
@@ -126,6 +131,7 @@ def main(argv):
     # FILE_ENTRY = 0xBAE7
     # DIR_ENTRY = 0x7EAB
     file_bytepos = 0
+    file_offsets = {}
     for i in range(len(order)):
         if order[i][-1] == "/":
             print("Directory: {}".format(order[i]))
@@ -155,7 +161,9 @@ def main(argv):
             ramdisk_pre_len = len(ramdisk)
             # This is a file
             ramdisk.extend(struct.pack("<H", 0xBAE7)) # 2 bytes
-            # File offset
+            # File offset, from the end of the headers, such that the data is page aligned
+            file_bytepos = -(-(headers_sz + file_bytepos) // PAGE_SIZE) * PAGE_SIZE - headers_sz
+            file_offsets[order[i]] = file_bytepos
             ramdisk.extend(struct.pack("<I", file_bytepos)) # 4 bytes
             file_bytepos += os.path.getsize(os.path.join(directory, order[i]))
             # 64-byte name (including null terminator)
@@ -182,6 +190,7 @@ def main(argv):
     for i in range(len(order)):
         if order[i][-1] == "/":
             continue
+        ramdisk.extend(b"\x00" * (headers_sz + file_offsets[order[i]] - len(ramdisk)))
         with open(os.path.join(directory, order[i]), "rb") as f:
             ramdisk.extend(f.read())
 
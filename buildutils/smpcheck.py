@@ -0,0 +1,60 @@
+# SMP boot check.
+# Boots an iso in qemu with the given number of CPUs and watches the serial port for
+# smp_initialize's summary ("SMP: <online> of <found> CPUs online"). Passes only if every
+# CPU qemu emulates was found in the MADT and came online.
+
+import subprocess
+import sys
+import threading
+
+TIMEOUT = 60 # seconds to wait for the summary line
+
+def main(argv):
+    if len(argv) < 2:
+        print("Usage: smpcheck.py [iso] [cpus]")
+        return 1
+    iso = argv[1]
+    cpus = int(argv[2]) if len(argv) > 2 else 4
+
+    qemu = subprocess.Popen(
+        ["qemu-system-i386", "-cdrom", iso, "-smp", str(cpus), "-serial", "stdio",
+         "-display", "none", "-no-reboot"],
+        stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    # a kernel that hangs prints nothing more, so qemu is killed to end the read
+    timer = threading.Timer(TIMEOUT, qemu.kill)
+    timer.start()
+    result = None
+    try:
+        for raw in qemu.stdout:
+            line = raw.decode("ascii", errors="replace").strip()
+            if line.startswith("SMP:"):
+                print(line)
+            # kpanic prints to the screen, but dumps the trace buffer to serial
+            if line.startswith("trace: dump"):
+                print("FAIL: kernel panicked during boot")
+                result = 1
+                break
+            # SMP: <online> of <found> CPUs online
+            fields = line.split()
+            if len(fields) == 6 and fields[0] == "SMP:" and fields[2] == "of" and fields[4] == "CPUs":
+                online, found = int(fields[1]), int(fields[3])
+                if online == cpus and found == cpus:
+                    print("PASS: {} of {} CPUs online".format(online, cpus))
+                    result = 0
+                else:
+                    print("FAIL: expected {} CPUs online".format(cpus))
+                    result = 1
+                break
+    finally:
+        timer.cancel()
+        qemu.kill()
+        qemu.wait()
+
+    if result is None:
+        # a single-CPU boot ("SMP: 1 CPU", "no MADT") never prints the summary
+        print("FAIL: no SMP summary within {} seconds".format(TIMEOUT))
+        return 1
+    return result
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,109 @@
+# Kernel trace decoder.
+# Reads either a binary capture of /dev/trace, or a serial log containing a panic dump
+# ("trace: ..." lines), and prints the events as text.
+
+import sys
+import struct
+
+# Event record, see trace_event_t in kernel/include/trace.h:
+# - uint64_t timestamp
+# - uint32_t id (high byte is the category)
+# - int32_t  pid
+# - uint32_t arg0
+# - uint32_t arg1
+EVENT_FORMAT = "<QIiII"
+EVENT_SIZE = struct.calcsize(EVENT_FORMAT)
+
+CATEGORIES = ["sched", "syscall", "irq", "timer"]
+
+# id -> (name, arg0 name, arg1 name), keep in sync with kernel/include/trace.h
+EVENTS = {
+    0x000: ("sched_switch", "prev", "next"),
+    0x001: ("sched_wake", "pid", None),
+    0x100: ("syscall_enter", "nr", "ebx"),
+    0x101: ("syscall_exit", "nr", "ret"),
+    0x102: ("syscall_invalid", "nr", None),
+    0x200: ("irq_enter", "irq", None),
+    0x300: ("timer_fire", "callback", "expires"),
+}
+
+def parse_binary(data):
+    events = []
+    for pos in range(0, len(data) - EVENT_SIZE + 1, EVENT_SIZE):
+        events.append(struct.unpack_from(EVENT_FORMAT, data, pos))
+    return events, None
+
+def parse_serial(text):
+    events = []
+    khz = None
+    for line in text.splitlines():
+        if "trace:" not in line:
+            continue
+        fields = line.split("trace:", 1)[1].split()
+        if len(fields) == 0 or fields[0] == "end":
+            continue
+        if fields[0] == "dump":
+            # trace: dump <n> events, <n> dropped, <khz> kHz
+            khz = int(fields[5])
+            if int(fields[3]) != 0:
+                print("warning: {} events were dropped before the dump".format(fields[3]))
+            continue
+        values = [int(field, 16) for field in fields]
+        timestamp = (values[0] << 32) | values[1]
+        pid = struct.unpack("<i", struct.pack("<I", values[3]))[0]
+        events.append((timestamp, values[2], pid, values[4], values[5]))
+    return events, khz
+
+def format_arg(name, value):
+    if name == "callback":
+        return "{}=0x{:08x}".format(name, value)
+    if name == "ret":
+        return "{}={}".format(name, struct.unpack("<i", struct.pack("<I", value))[0])
+    return "{}={}".format(name, value)
+
+def main(argv):
+    if len(argv) < 2:
+        print("Usage: tracedump.py [trace capture or serial log] [tsc kHz]")
+        return 1
+
+    with open(argv[1], "rb") as f:
+        data = f.read()
+
+    # A serial log is plain text with "trace:" lines; anything else is a raw /dev/trace capture
+    if b"trace: dump" in data:
+        events, khz = parse_serial(data.decode("ascii", errors="replace"))
+    else:
+        events, khz = parse_binary(data)
+    if len(argv) > 2:
+        khz = int(argv[2])
+
+    if len(events) == 0:
+        print("No events.")
+        return 0
+
+    start = events[0][0]
+    for timestamp, event_id, pid, arg0, arg1 in events:
+        delta = timestamp - start
+        if khz:
+            # cycles -> microseconds
+            when = "{:14.3f}us".format(delta * 1000.0 / khz)
+        else:
+            when = "{:14d}cy".format(delta)
+
+        category = event_id >> 8
+        if event_id in EVENTS:
+            name, arg0_name, arg1_name = EVENTS[event_id]
+        else:
+            category_name = CATEGORIES[category] if category < len(CATEGORIES) else "cat{}".format(category)
+            name, arg0_name, arg1_name = ("{}_{}".format(category_name, event_id & 0xFF), "arg0", "arg1")
+
+        args = format_arg(arg0_name, arg0)
+        if arg1_name is not None:
+            args += " " + format_arg(arg1_name, arg1)
+        print("{} pid={:<4} {:<16} {}".format(when, pid, name, args))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,264 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "include/bench.h"
+#include "include/waitqueue.h"
+#include "inc_c/process.h"
+#include "inc_c/clock.h"
+#include "inc_c/memory.h"
+#include "inc_c/serial.h"
+#include "inc_c/user.h"
+#include "inc_c/uring.h"
+#include "inc_c/mmap.h"
+#include "inc_c/syscall.h"
+#include "include/filesystem.h"
+
+#ifdef KERNEL_BENCH
+
+uint64_t bench_switch_start = 0;
+uint64_t bench_switch_end = 0;
+
+// Two of these yield back and forth, so every yield is exactly one switch
+static int bench_switch_thread(void *arg) {
+    bool first = arg != NULL;
+    if (first) {
+        bench_switch_start = clock_cycles();
+    }
+    for (uint32_t i = 0; i < BENCH_SWITCH_ITERATIONS; i++) {
+        process_yield();
+    }
+    if (first) {
+        bench_switch_end = clock_cycles();
+    }
+    return 0;
+}
+
+static void bench_context_switch() {
+    //the caller sleeps on the threads' exit queues, so only the two of them are runnable
+    process_t *a = kthread_create(bench_switch_thread, (void *)1, "bench-a");
+    process_t *b = kthread_create(bench_switch_thread, NULL, "bench-b");
+
+    wait_event(&a->exit_queue, a->status == TASK_STATUS_FINISHED);
+    wait_event(&b->exit_queue, b->status == TASK_STATUS_FINISHED);
+
+    uint32_t switches = BENCH_SWITCH_ITERATIONS * 2;
+    uint32_t per_switch = (uint32_t)((bench_switch_end - bench_switch_start) / switches);
+    serial_printf("bench: context switch %d cycles (target %d) %s\n", per_switch, BENCH_SWITCH_TARGET_CYCLES,
+        per_switch <= BENCH_SWITCH_TARGET_CYCLES ? "ok" : "SLOW");
+
+    process_release(a);
+    process_release(b);
+}
+
+// Ring 3 side of the syscall benchmark, copied to BENCH_USER_CODE. The first word is the syscall
+// routine to time, filled in by the kernel; the entry point is right after it. Takes the
+// iteration count as argc and returns the average cycles per getpid round trip.
+asm (
+    ".section .text\n"
+    ".globl bench_user_start\n"
+    "bench_user_start:\n"
+    "    .long 0\n"
+    ".globl bench_user_entry\n"
+    "bench_user_entry:\n"
+    "    pushl %ebx\n"
+    "    pushl %esi\n"
+    "    pushl %edi\n"
+    "    pushl %ebp\n"
+    "    movl 20(%esp), %esi\n"
+    "    call 1f\n"
+    "1:  popl %edi\n"
+    "    movl (bench_user_start - 1b)(%edi), %edi\n"
+    "    movl %esi, %ebx\n"
+    "    rdtsc\n"
+    "    movl %eax, %ebp\n"
+    "2:  movl $39, %eax\n" //SYSCALL_GETPID
+    "    call *%edi\n"
+    "    decl %ebx\n"
+    "    jnz 2b\n"
+    "    rdtsc\n"
+    "    subl %ebp, %eax\n"
+    "    xorl %edx, %edx\n"
+    "    divl %esi\n"
+    "    popl %ebp\n"
+    "    popl %edi\n"
+    "    popl %esi\n"
+    "    popl %ebx\n"
+    "    ret\n"
+    ".globl bench_user_end\n"
+    "bench_user_end:\n"
+);
+
+extern uint8_t bench_user_start[];
+extern uint8_t bench_user_entry[];
+extern uint8_t bench_user_end[];
+extern page_directory_t kernel_pd;
+
+// Runs the loop above as a program of its own, calling routine from the user code page
+static uint32_t bench_syscall_path(uint8_t *routine) {
+    page_directory_t *pd = clone_page_directory(&kernel_pd);
+
+    uint32_t flags = irq_save();
+    page_table_entry_t page = first_free_page();
+    uint32_t phys = page.pd_entry * 0x400000 + page.pt_entry * 0x1000;
+    alloc_page_kmalloc(BENCH_USER_CODE, phys, true, false, false, pd);
+    irq_restore(flags);
+
+    uint32_t target = user_address(routine);
+    phys_fill(phys, 0, bench_user_start, bench_user_end - bench_user_start);
+    phys_fill(phys, 0, &target, sizeof(target));
+
+    void *entry = (void *)(BENCH_USER_CODE + (bench_user_entry - bench_user_start));
+    process_t *task = create_task(entry, PROCESS_STACK_SIZE, pd, BENCH_SYSCALL_ITERATIONS, NULL, NULL);
+    wait_event(&task->exit_queue, task->status == TASK_STATUS_FINISHED);
+    uint32_t cycles = task->entry_or_return;
+    process_release(task);
+    return cycles;
+}
+
+static void bench_syscall() {
+    uint32_t int80 = bench_syscall_path(user_int80);
+    if (!sysenter_supported) {
+        serial_printf("bench: null syscall int 0x80 %d cycles, no SYSENTER\n", int80);
+        return;
+    }
+    uint32_t sysenter = bench_syscall_path(user_sysenter);
+    serial_printf("bench: null syscall int 0x80 %d cycles, SYSENTER %d cycles\n", int80, sysenter);
+}
+
+// Ring 3 side of the uring benchmark. Lives in the user code page, which every program has, so
+// it's only built in with KERNEL_BENCH. See USER_TEXT for what it can't do.
+static inline __attribute__((always_inline)) int32_t bench_user_syscall(uint32_t num, uint32_t a, uint32_t b, uint32_t c) {
+    int32_t ret;
+    asm volatile ("call *%1" : "=a"(ret) : "r"(USER_ENTRY_SYSCALL), "a"(num), "b"(a), "c"(b), "d"(c) : "memory");
+    return ret;
+}
+
+static inline __attribute__((always_inline)) uint32_t bench_user_rdtsc() {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return low;
+}
+
+// argc is the fd to write to. Returns the cycles per write.
+USER_TEXT int bench_user_writes(int fd) {
+    char byte = 'x';
+    uint32_t start = bench_user_rdtsc();
+    for (uint32_t i = 0; i < BENCH_URING_WRITES; i++) {
+        bench_user_syscall(SYSCALL_WRITE, fd, (uint32_t)&byte, 1);
+    }
+    return (bench_user_rdtsc() - start) / BENCH_URING_WRITES;
+}
+
+// The same writes, a ring's worth per uring_enter
+USER_TEXT int bench_user_uring(int fd) {
+    char byte = 'x';
+    if (bench_user_syscall(SYSCALL_URING_SETUP, BENCH_URING_ADDR, BENCH_URING_ENTRIES, 0) != 0) {
+        return -1;
+    }
+    uring_header_t *header = (uring_header_t *)BENCH_URING_ADDR;
+    uring_sqe_t *sqes = (uring_sqe_t *)(BENCH_URING_ADDR + header->sq_offset);
+
+    uint32_t start = bench_user_rdtsc();
+    for (uint32_t i = 0; i < BENCH_URING_WRITES; i += BENCH_URING_ENTRIES) {
+        uint32_t tail = header->sq_tail;
+        for (uint32_t j = 0; j < BENCH_URING_ENTRIES; j++) {
+            uring_sqe_t *sqe = &sqes[tail & (BENCH_URING_ENTRIES - 1)];
+            sqe->opcode = SYSCALL_WRITE;
+            sqe->args[0] = fd;
+            sqe->args[1] = (uint32_t)&byte;
+            sqe->args[2] = 1;
+            sqe->user_data = i + j;
+            tail++;
+        }
+        header->sq_tail = tail;
+        bench_user_syscall(SYSCALL_URING_ENTER, BENCH_URING_ENTRIES, 0, 0);
+        header->cq_head = header->cq_tail;
+    }
+    return (bench_user_rdtsc() - start) / BENCH_URING_WRITES;
+}
+
+// Reads all of fd, a page per read. Returns the cycles it took.
+USER_TEXT int bench_user_read(int fd) {
+    char buf[0x1000];
+    stat_t stat;
+    if (bench_user_syscall(SYSCALL_FSTAT, fd, (uint32_t)&stat, 0) != 0) {
+        return -1;
+    }
+    uint32_t start = bench_user_rdtsc();
+    for (uint32_t done = 0; done < stat.st_size; done += sizeof(buf)) {
+        bench_user_syscall(SYSCALL_READ, fd, (uint32_t)buf, sizeof(buf));
+    }
+    return bench_user_rdtsc() - start;
+}
+
+// Maps all of fd and touches every page of it, then unmaps it again
+USER_TEXT int bench_user_mmap(int fd) {
+    stat_t stat;
+    if (bench_user_syscall(SYSCALL_FSTAT, fd, (uint32_t)&stat, 0) != 0) {
+        return -1;
+    }
+    volatile uint8_t sum = 0;
+    uint32_t start = bench_user_rdtsc();
+    mmap_args_t args;
+    args.addr = 0;
+    args.length = stat.st_size;
+    args.prot = PROT_READ;
+    args.flags = MAP_PRIVATE;
+    args.fd = fd;
+    args.offset = 0;
+    int32_t file = bench_user_syscall(SYSCALL_MMAP, (uint32_t)&args, 0, 0);
+    if (file == -1) {
+        return -1;
+    }
+    for (uint32_t done = 0; done < stat.st_size; done += 0x1000) {
+        sum += ((uint8_t *)file)[done];
+    }
+    bench_user_syscall(SYSCALL_MUNMAP, file, stat.st_size, 0);
+    return bench_user_rdtsc() - start;
+}
+
+// Runs fn(fd) as a program, with the same fds as us, and returns what it returned
+static uint32_t bench_user_program(void *fn, int fd) {
+    page_directory_t *pd = clone_page_directory(&kernel_pd);
+    process_t *task = create_task((void *)user_address(fn), PROCESS_STACK_SIZE, pd, fd, NULL, NULL);
+    wait_event(&task->exit_queue, task->status == TASK_STATUS_FINISHED);
+    uint32_t cycles = task->entry_or_return;
+    process_release(task);
+    return cycles;
+}
+
+static void bench_uring() {
+    file_descriptor_t *null = fopen("/dev/null", "w");
+    uint32_t single = bench_user_program(bench_user_writes, null->id);
+    uint32_t batched = bench_user_program(bench_user_uring, null->id);
+    fclose(null);
+    serial_printf("bench: write to /dev/null %d cycles per syscall, %d per uring entry (batches of %d)\n",
+        single, batched, BENCH_URING_ENTRIES);
+}
+
+static void bench_mmap() {
+    file_descriptor_t *file = fopen(BENCH_MMAP_FILE, "r");
+    if (file->flags & FILE_NOTFOUND_FLAG) {
+        fclose(file);
+        serial_printf("bench: no %s to map\n", BENCH_MMAP_FILE);
+        return;
+    }
+    stat_t stat;
+    fstat(file, &stat);
+    uint32_t read = bench_user_program(bench_user_read, file->id);
+    uint32_t mapped = bench_user_program(bench_user_mmap, file->id);
+    fclose(file);
+    serial_printf("bench: %d byte ramdisk file %d cycles with read, %d with mmap\n", stat.st_size, read, mapped);
+}
+
+void bench_run() {
+    serial_printf("bench: starting\n");
+    bench_context_switch();
+    bench_syscall();
+    bench_uring();
+    bench_mmap();
+    serial_printf("bench: done\n");
+}
+
+#endif
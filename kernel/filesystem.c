@@ -6,9 +6,11 @@
 #include "include/filesystem.h"
 #include "inc_c/memory.h"
 #include "inc_c/process.h"
+#include "include/spinlock.h"
 
 fs_node_t head_node = {NULL, NULL};
 mount_point_t head_mount_point = {NULL, NULL, NULL};
+spinlock_t mount_lock = SPINLOCK_INIT(LOCK_LEVEL_MOUNT); //the filesystem and mount point lists
 uint32_t fs_id = 0;
 uint32_t file_id = 0;
 
@@ -65,13 +67,13 @@ uint32_t next_id() {
 
 uint32_t next_file_id() {
     //if we've used all the ids, panic
-    if (current_process->num_fds >= current_process->max_fds) {
+    if (current_process->files->num_fds >= current_process->files->max_fds) {
         kpanic("Process %d out of file descriptors!\n", current_process->pid);
     }
     //find the first NULL file descriptor
-    for (uint32_t i = 0; i < current_process->max_fds; i++) {
-        if (current_process->fds[i] == NULL) {
-            current_process->num_fds++;
+    for (uint32_t i = 0; i < current_process->files->max_fds; i++) {
+        if (current_process->files->fds[i] == NULL) {
+            current_process->files->num_fds++;
             return i;
         }
     }
@@ -80,24 +82,29 @@ uint32_t next_file_id() {
 }
 
 int register_filesystem(filesystem_t *to_register) {
+    fs_node_t *new_node = (fs_node_t*)kmalloc(sizeof(fs_node_t));
+    uint32_t flags = spin_lock_irqsave(&mount_lock);
     to_register->identifier = next_id();
     if (head_node.fs == NULL) {
         head_node.fs = to_register;
         head_node.next = NULL;
-        return (int)to_register->identifier;
+        spin_unlock_irqrestore(&mount_lock, flags);
+        kfree(new_node);
     } else {
         fs_node_t *cur_node = &head_node;
         while (cur_node->next != NULL) {
             cur_node = cur_node->next;
         }
-        cur_node->next = (fs_node_t*)kmalloc(sizeof(fs_node_t));
+        cur_node->next = new_node;
         cur_node->next->fs = to_register;
         cur_node->next->next = NULL;
-        return (int)to_register->identifier;
+        spin_unlock_irqrestore(&mount_lock, flags);
     }
+    return (int)to_register->identifier;
 }
 
 int unregister_filesystem(uint32_t filesystem_id) {
+    uint32_t flags = spin_lock_irqsave(&mount_lock);
     fs_node_t *cur_node = &head_node;
     fs_node_t *prev_node = NULL;
     while (cur_node != NULL) {
@@ -108,6 +115,7 @@ int unregister_filesystem(uint32_t filesystem_id) {
         cur_node = cur_node->next;
     }
     if (cur_node == NULL) {
+        spin_unlock_irqrestore(&mount_lock, flags);
         return -1;
     }
     if (prev_node == NULL) {
@@ -115,11 +123,14 @@ int unregister_filesystem(uint32_t filesystem_id) {
     } else {
         prev_node->next = cur_node->next;
     }
+    spin_unlock_irqrestore(&mount_lock, flags);
     kfree(cur_node);
     return 0;
 }
 
 int mount_filesystem(uint32_t filesystem_id, char *path) {
+    mount_point_t *new_mount_point = (mount_point_t*)kmalloc(sizeof(mount_point_t));
+    uint32_t flags = spin_lock_irqsave(&mount_lock);
     fs_node_t *cur_node = &head_node;
     while (cur_node != NULL) {
         if (cur_node->fs->identifier == filesystem_id) {
@@ -128,6 +139,8 @@ int mount_filesystem(uint32_t filesystem_id, char *path) {
         cur_node = cur_node->next;
     }
     if (cur_node == NULL) {
+        spin_unlock_irqrestore(&mount_lock, flags);
+        kfree(new_mount_point);
         return -1;
     }
     while (path[0] == '/') {
@@ -137,21 +150,24 @@ int mount_filesystem(uint32_t filesystem_id, char *path) {
         head_mount_point.path = path;
         head_mount_point.fs = cur_node->fs;
         head_mount_point.next = NULL;
-        return 0;
+        spin_unlock_irqrestore(&mount_lock, flags);
+        kfree(new_mount_point);
     } else {
         mount_point_t *cur_mount_point = &head_mount_point;
         while (cur_mount_point->next != NULL) {
             cur_mount_point = cur_mount_point->next;
         }
-        cur_mount_point->next = (mount_point_t*)kmalloc(sizeof(mount_point_t));
+        cur_mount_point->next = new_mount_point;
         cur_mount_point->next->path = path;
         cur_mount_point->next->fs = cur_node->fs;
         cur_mount_point->next->next = NULL;
-        return 0;
+        spin_unlock_irqrestore(&mount_lock, flags);
     }
+    return 0;
 }
 
 int unmount_filesystem_by_id(uint32_t filesystem_id) {
+    uint32_t flags = spin_lock_irqsave(&mount_lock);
     mount_point_t *cur_mount_point = &head_mount_point;
     mount_point_t *prev_mount_point = NULL;
     while (cur_mount_point != NULL) {
@@ -162,6 +178,7 @@ int unmount_filesystem_by_id(uint32_t filesystem_id) {
         cur_mount_point = cur_mount_point->next;
     }
     if (cur_mount_point == NULL) {
+        spin_unlock_irqrestore(&mount_lock, flags);
         return -1;
     }
     if (prev_mount_point == NULL) {
@@ -169,11 +186,13 @@ int unmount_filesystem_by_id(uint32_t filesystem_id) {
     } else {
         prev_mount_point->next = cur_mount_point->next;
     }
+    spin_unlock_irqrestore(&mount_lock, flags);
     kfree(cur_mount_point);
     return 0;
 }
 
 int unmount_filesystem_by_path(char *path) {
+    uint32_t flags = spin_lock_irqsave(&mount_lock);
     mount_point_t *cur_mount_point = &head_mount_point;
     mount_point_t *prev_mount_point = NULL;
     while (cur_mount_point != NULL) {
@@ -184,6 +203,7 @@ int unmount_filesystem_by_path(char *path) {
         cur_mount_point = cur_mount_point->next;
     }
     if (cur_mount_point == NULL) {
+        spin_unlock_irqrestore(&mount_lock, flags);
         return -1;
     }
     if (prev_mount_point == NULL) {
@@ -191,35 +211,47 @@ int unmount_filesystem_by_path(char *path) {
     } else {
         prev_mount_point->next = cur_mount_point->next;
     }
+    spin_unlock_irqrestore(&mount_lock, flags);
     kfree(cur_mount_point);
     return 0;
 }
 
-file_descriptor_t *fopen(char *path, char *flags) {
-    //later on we will check for the PWD, but for now only accept absolute paths
-    if (path[0] != '/') {
-        file_descriptor_t *ret = (file_descriptor_t*)kmalloc(sizeof(file_descriptor_t));
-        ret->flags = FILE_NOTFOUND_FLAG;
-        ret->fs = NULL;
-        return ret;
+// Finds the filesystem mounted over an absolute path, and advances *path past the mount point.
+// The filesystem's own open/opendir can sleep, so they're called after mount_lock is dropped.
+static filesystem_t *mount_lookup(char **path) {
+    while ((*path)[0] == '/') {
+        (*path)++;
     }
 
-    // Check whether this path matches a mount point
+    uint32_t flags = spin_lock_irqsave(&mount_lock);
     mount_point_t *cur_mount_point = &head_mount_point;
-    while (path[0] == '/') {
-        path++;
-    }
-    
+    filesystem_t *fs = NULL;
     int len;
     while (cur_mount_point != NULL) {
         len = strlen(cur_mount_point->path);
-        if (!strncmp(path, cur_mount_point->path, len - 1)) { //len by itself causes a #GP for... some reason. (check on this if it becomes a problem)
-            path += len;
+        if (!strncmp(*path, cur_mount_point->path, len - 1)) { //len by itself causes a #GP for... some reason. (check on this if it becomes a problem)
+            *path += len;
+            fs = cur_mount_point->fs;
             break;
         }
         cur_mount_point = cur_mount_point->next;
     }
-    if (cur_mount_point == NULL) {
+    spin_unlock_irqrestore(&mount_lock, flags);
+    return fs;
+}
+
+file_descriptor_t *fopen(char *path, char *flags) {
+    //later on we will check for the PWD, but for now only accept absolute paths
+    if (path[0] != '/') {
+        file_descriptor_t *ret = (file_descriptor_t*)kmalloc(sizeof(file_descriptor_t));
+        ret->flags = FILE_NOTFOUND_FLAG;
+        ret->fs = NULL;
+        return ret;
+    }
+
+    // Check whether this path matches a mount point
+    filesystem_t *fs = mount_lookup(&path);
+    if (fs == NULL) {
         //TODO: allow setting up default filesystem for non-mounted paths
         file_descriptor_t *ret = (file_descriptor_t*)kmalloc(sizeof(file_descriptor_t));
         ret->flags = FILE_NOTFOUND_FLAG;
@@ -228,12 +260,11 @@ file_descriptor_t *fopen(char *path, char *flags) {
     }
 
     file_descriptor_t *ret = (file_descriptor_t*)kmalloc(sizeof(file_descriptor_t));
-    filesystem_t *fs = cur_mount_point->fs;
     ret->fs = fs;
     ret->fs_data = fs->open(path, flags);
     ret->flags = *(uint32_t*)ret->fs_data;
     ret->id = next_file_id();
-    current_process->fds[ret->id] = ret;
+    current_process->files->fds[ret->id] = ret;
 
     return ret;
 }
@@ -252,12 +283,214 @@ file_descriptor_t *copy_descriptor(file_descriptor_t *fd, uint32_t id) {
 }
 
 int fread(char *buf, size_t size, size_t count, file_descriptor_t *fd) {
-    return fd->fs->read(buf, size, count, fd->fs_data);
+    int read = fd->fs->read(buf, size, count, fd->fs_data);
+    if (read > 0) {
+        current_process->stats.read_bytes += read;
+    }
+    return read;
 }
 
 int fwrite(char *buf, size_t size, size_t count, file_descriptor_t *fd) {
     fd->flags |= FILE_WRITTEN_FLAG;
-    return fd->fs->write(buf, size, count, fd->fs_data);
+    int written = fd->fs->write(buf, size, count, fd->fs_data);
+    if (written > 0) {
+        current_process->stats.write_bytes += written;
+    }
+    return written;
+}
+
+// Reads into each buffer in turn, like readv. Without a readv of the filesystem's own it's one
+// read per buffer, stopping at the first one that isn't filled.
+int freadv(iovec_t *iov, int iovcnt, file_descriptor_t *fd) {
+    int total = 0;
+    if (fd->fs->readv != NULL) {
+        total = fd->fs->readv(iov, iovcnt, fd->fs_data);
+    } else {
+        for (int i = 0; i < iovcnt; i++) {
+            if (iov[i].iov_len == 0) {
+                continue;
+            }
+            int read = fd->fs->read(iov[i].iov_base, 1, iov[i].iov_len, fd->fs_data);
+            if (read < 0) {
+                if (total == 0) {
+                    total = read;
+                }
+                break;
+            }
+            total += read;
+            if ((size_t)read < iov[i].iov_len) {
+                break;
+            }
+        }
+    }
+    if (total > 0) {
+        current_process->stats.read_bytes += total;
+    }
+    return total;
+}
+
+// Writes each buffer in turn, like writev; the fallback is the same as freadv's
+int fwritev(iovec_t *iov, int iovcnt, file_descriptor_t *fd) {
+    fd->flags |= FILE_WRITTEN_FLAG;
+    int total = 0;
+    if (fd->fs->writev != NULL) {
+        total = fd->fs->writev(iov, iovcnt, fd->fs_data);
+    } else if (fd->fs->write == NULL) {
+        return -1;
+    } else {
+        for (int i = 0; i < iovcnt; i++) {
+            if (iov[i].iov_len == 0) {
+                continue;
+            }
+            int written = fd->fs->write(iov[i].iov_base, 1, iov[i].iov_len, fd->fs_data);
+            if (written < 0) {
+                if (total == 0) {
+                    total = written;
+                }
+                break;
+            }
+            total += written;
+            if ((size_t)written < iov[i].iov_len) {
+                break;
+            }
+        }
+    }
+    if (total > 0) {
+        current_process->stats.write_bytes += total;
+    }
+    return total;
+}
+
+// Reads count bytes starting at offset, leaving the file's own offset where it was
+int fpread(char *buf, size_t count, size_t offset, file_descriptor_t *fd) {
+    int read;
+    if (fd->fs->pread != NULL) {
+        read = fd->fs->pread(buf, count, offset, fd->fs_data);
+    } else {
+        size_t pos = fd->fs->tell(fd->fs_data);
+        if (fd->fs->seek(fd->fs_data, offset, SEEK_SET) < 0) {
+            return -1;
+        }
+        read = fd->fs->read(buf, 1, count, fd->fs_data);
+        fd->fs->seek(fd->fs_data, pos, SEEK_SET);
+    }
+    if (read > 0) {
+        current_process->stats.read_bytes += read;
+    }
+    return read;
+}
+
+// Writes count bytes starting at offset, like fpread
+int fpwrite(char *buf, size_t count, size_t offset, file_descriptor_t *fd) {
+    fd->flags |= FILE_WRITTEN_FLAG;
+    int written;
+    if (fd->fs->pwrite != NULL) {
+        written = fd->fs->pwrite(buf, count, offset, fd->fs_data);
+    } else if (fd->fs->write == NULL) {
+        return -1;
+    } else {
+        size_t pos = fd->fs->tell(fd->fs_data);
+        if (fd->fs->seek(fd->fs_data, offset, SEEK_SET) < 0) {
+            return -1;
+        }
+        written = fd->fs->write(buf, 1, count, fd->fs_data);
+        fd->fs->seek(fd->fs_data, pos, SEEK_SET);
+    }
+    if (written > 0) {
+        current_process->stats.write_bytes += written;
+    }
+    return written;
+}
+
+// Where the page of the file at offset already sits in physical memory, if the filesystem keeps
+// it there for good (like the ramdisk), so it can be mapped instead of copied. 0 if it doesn't.
+uint32_t fmap_page(file_descriptor_t *fd, size_t offset) {
+    if (fd->fs->map_page == NULL) {
+        return 0;
+    }
+    return fd->fs->map_page(fd->fs_data, offset);
+}
+
+// Writes count bytes of in to out without them going through a buffer of the caller's, like
+// sendfile. They're read from *offset, which is moved past them, leaving in's own offset alone;
+// or with offset NULL, from in's offset, which is. If in keeps its data in memory (see
+// filesystem_t.peek) out is handed pointers straight into it, otherwise it goes through a
+// SENDFILE_CHUNK buffer. Stops at the end of in, or at the first short write. Only bytes out
+// took count as read.
+//
+// Without peek, an offset needs in to have a pread of its own: faking it with a seek there and
+// back would move the offset every thread sharing in sees, for as long as the read sleeps.
+int fsendfile(file_descriptor_t *out, file_descriptor_t *in, size_t *offset, size_t count) {
+    if (out->fs->write == NULL) {
+        return -1;
+    }
+    if (offset != NULL && in->fs->peek == NULL && in->fs->pread == NULL) {
+        return -1;
+    }
+    out->flags |= FILE_WRITTEN_FLAG;
+    size_t pos = offset != NULL ? *offset : in->fs->tell(in->fs_data);
+    size_t in_pos = pos; //where reading has left in's own offset
+
+    char *chunk = NULL;
+    int total = 0;
+    while ((size_t)total < count) {
+        char *data = NULL;
+        int got = -1;
+        if (in->fs->peek != NULL) {
+            got = in->fs->peek(&data, count - total, pos, in->fs_data);
+        }
+        if (got < 0) {
+            if (chunk == NULL) {
+                chunk = (char *)kmalloc(SENDFILE_CHUNK);
+            }
+            data = chunk;
+            size_t want = count - total < SENDFILE_CHUNK ? count - total : SENDFILE_CHUNK;
+            if (offset == NULL) {
+                got = in->fs->read(chunk, 1, want, in->fs_data);
+                if (got > 0) {
+                    in_pos += got;
+                }
+            } else if (in->fs->pread != NULL) {
+                got = in->fs->pread(chunk, want, pos, in->fs_data);
+            }
+        }
+        if (got <= 0) {
+            if (got < 0 && total == 0) {
+                total = got;
+            }
+            break;
+        }
+
+        int written = out->fs->write(data, 1, got, out->fs_data);
+        if (written <= 0) {
+            if (written < 0 && total == 0) {
+                total = written;
+            }
+            break;
+        }
+        current_process->stats.read_bytes += written;
+        total += written;
+        pos += written;
+        if (written < got) {
+            break;
+        }
+    }
+    if (chunk != NULL) {
+        kfree(chunk);
+    }
+
+    if (total > 0) {
+        current_process->stats.write_bytes += total;
+    }
+    if (offset != NULL) {
+        if (total > 0) {
+            *offset = pos;
+        }
+    } else if (in_pos != pos) {
+        //peeked past it, or read more than out took
+        in->fs->seek(in->fs_data, pos, SEEK_SET);
+    }
+    return total;
 }
 
 int fclose(file_descriptor_t *fd) {
@@ -282,12 +515,64 @@ int fclose(file_descriptor_t *fd) {
     }
 
     // Clear the file descriptor
-    current_process->fds[fd->id] = NULL;
-    current_process->num_fds--;
+    current_process->files->fds[fd->id] = NULL;
+    current_process->files->num_fds--;
 
     return fd->fs->close(fd->fs_data);
 }
 
+// Closes a descriptor that isn't in current_process' fd table, like a copy made for a process
+// that never got it. Unlike fclose, the descriptor itself is freed too.
+int fclose_detached(file_descriptor_t *fd) {
+    int ret = 0;
+    if (fd->fs != NULL) {
+        if (fd->flags & FILE_ISOPENDIR_FLAG) {
+            ret = fd->fs->closedir(fd->fs_data);
+        } else if (fd->fs->close != NULL && (fd->flags & FILE_ISOPEN_FLAG)) {
+            ret = fd->fs->close(fd->fs_data);
+        }
+    }
+    kfree(fd);
+    return ret;
+}
+
+fd_table_t *fd_table_create() {
+    fd_table_t *table = (fd_table_t *)kmalloc(sizeof(fd_table_t));
+    memset(table, 0, sizeof(fd_table_t));
+    table->refcount = 1;
+    table->max_fds = 256;
+    return table;
+}
+
+// A new table with a copy of each of from's open fds, in the same slots
+fd_table_t *fd_table_copy(fd_table_t *from) {
+    fd_table_t *table = fd_table_create();
+    for (int i = 0; i < 256; i++) {
+        if (from->fds[i] != NULL) {
+            table->fds[i] = copy_descriptor(from->fds[i], i);
+            table->num_fds++;
+        }
+    }
+    return table;
+}
+
+void fd_table_get(fd_table_t *table) {
+    __sync_add_and_fetch(&table->refcount, 1);
+}
+
+// Drops a reference; the last one closes everything still open and frees the table
+void fd_table_put(fd_table_t *table) {
+    if (__sync_sub_and_fetch(&table->refcount, 1) != 0) {
+        return;
+    }
+    for (int i = 0; i < 256; i++) {
+        if (table->fds[i] != NULL) {
+            fclose_detached(table->fds[i]);
+        }
+    }
+    kfree(table);
+}
+
 dir_descriptor_t *fopendir(char *path) {
     //later on we will check for the PWD, but for now only accept absolute paths
     if (path[0] != '/') {
@@ -298,20 +583,8 @@ dir_descriptor_t *fopendir(char *path) {
     }
 
     //get the mount point
-    mount_point_t *cur_mount_point = &head_mount_point;
-    while (path[0] == '/') {
-        path++;
-    }
-    int len;
-    while (cur_mount_point != NULL) {
-        len = strlen(cur_mount_point->path);
-        if (!strncmp(path, cur_mount_point->path, len - 1)) { //len-1 to prevent #GP
-            path += len;
-            break;
-        }
-        cur_mount_point = cur_mount_point->next;
-    }
-    if (cur_mount_point == NULL) {
+    filesystem_t *fs = mount_lookup(&path);
+    if (fs == NULL) {
         //TODO: allow setting up default filesystem for non-mounted paths
         dir_descriptor_t *ret = (dir_descriptor_t*)kmalloc(sizeof(dir_descriptor_t));
         ret->flags = FILE_NOTFOUND_FLAG;
@@ -320,12 +593,11 @@ dir_descriptor_t *fopendir(char *path) {
     }
 
     dir_descriptor_t *ret = (dir_descriptor_t*)kmalloc(sizeof(dir_descriptor_t));
-    filesystem_t *fs = cur_mount_point->fs;
     ret->fs = fs;
     ret->id = next_file_id();
     ret->fs_data = fs->opendir(path);
     ret->flags = *(uint32_t*)ret->fs_data;
-    current_process->fds[ret->id] = (file_descriptor_t *)ret;
+    current_process->files->fds[ret->id] = (file_descriptor_t *)ret;
     return ret;
 }
 
@@ -347,4 +619,53 @@ int fstat(file_descriptor_t *fd, stat_t *statbuf) {
 
 dirent_t *fgetdent(dirent_t *buf, uint32_t entry_num, dir_descriptor_t *fd) {
     return fd->fs->getdent(buf, entry_num, fd->fs_data);
+}
+
+typedef struct {
+    dir_context_t ctx; //must be first, emit gets a pointer to it
+    char *buf;
+    size_t size;
+    size_t used;
+    bool full; //an entry didn't fit
+} getdents_context_t;
+
+static bool getdents_emit(dir_context_t *ctx, const char *name, uint32_t inode, uint8_t type, uint32_t next) {
+    getdents_context_t *getdents = (getdents_context_t *)ctx;
+    size_t name_len = 0;
+    while (name_len < 255 && name[name_len] != '\0') {
+        name_len++;
+    }
+    size_t reclen = (sizeof(dirent64_t) + name_len + 1 + 7) & ~7;
+    if (reclen > getdents->size - getdents->used) {
+        getdents->full = true;
+        return false;
+    }
+
+    dirent64_t *entry = (dirent64_t *)(getdents->buf + getdents->used);
+    entry->inode = inode;
+    entry->offset = next;
+    entry->reclen = reclen;
+    entry->type = type;
+    memcpy(entry->name, name, name_len);
+    memset(entry->name + name_len, 0, reclen - sizeof(dirent64_t) - name_len);
+    getdents->used += reclen;
+    return true;
+}
+
+// Fills buf with as many dirent64_t as fit, from the directory's cursor on, and moves the cursor
+// past them, like getdents64. One pass over the directory, however many entries it has. Returns
+// the bytes used, 0 at the end of the directory, or -1 if not even the next entry fits.
+int fgetdents(dir_descriptor_t *fd, void *buf, size_t size) {
+    if (!(fd->flags & FILE_ISOPENDIR_FLAG) || fd->fs->iterate == NULL) {
+        return -1;
+    }
+    getdents_context_t getdents = {{getdents_emit}, (char *)buf, size, 0, false};
+    int ret = fd->fs->iterate(fd->fs_data, &getdents.ctx);
+    if (ret < 0) {
+        return ret;
+    }
+    if (getdents.used == 0 && getdents.full) {
+        return -1;
+    }
+    return getdents.used;
 }
\ No newline at end of file
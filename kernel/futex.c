@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "include/futex.h"
+#include "include/spinlock.h"
+#include "include/waitqueue.h"
+#include "include/timer.h"
+#include "inc_c/memory.h"
+#include "inc_c/process.h"
+#include "inc_c/string.h"
+
+// Everyone waiting on one futex word. Created by its first waiter and freed by its last.
+typedef struct futex_queue {
+    uint32_t phys; //physical address of the word
+    uint32_t waiters; //in futex_wait on it, asleep or not
+    wait_queue_t queue;
+    struct futex_queue *next; //next in the same hash bucket
+} futex_queue_t;
+
+futex_queue_t *futex_hash[FUTEX_HASH_SIZE];
+
+//the hash table and each queue's waiter count
+spinlock_t futex_lock = SPINLOCK_INIT(LOCK_LEVEL_FUTEX);
+
+//words are 4 byte aligned, and locks often sit at the same offset in different pages
+#define FUTEX_HASH(phys) ((((phys) >> 2) ^ ((phys) >> 12)) & (FUTEX_HASH_SIZE - 1))
+
+void futex_initialize() {
+    memset(futex_hash, 0, sizeof(futex_hash));
+}
+
+// Finds the physical address of a user word in the current address space. Called with the kernel
+// lock held, like cow_page_fault.
+static bool futex_phys(uint32_t *addr, uint32_t *phys) {
+    uint32_t virt = (uint32_t)addr;
+    if ((virt & 0x3) != 0 || virt >= 0xC0000000) {
+        return false;
+    }
+    //a lazily reserved page has no frame to key on until it's touched, so touch it
+    if (!page_is_mapped(virt, current_pd) && !lazy_page_fault(virt, current_pd)) {
+        return false;
+    }
+    //a private copy-on-write page gets a frame of its own on its first write, which would move
+    //the key out from under anyone waiting on it, so break it now the way that write would
+    cow_page_fault(virt, current_pd);
+    *phys = virt_to_phys(virt, current_pd) | (virt & 0xFFF);
+    return true;
+}
+
+// Called with futex_lock held
+static futex_queue_t *futex_lookup(uint32_t phys) {
+    futex_queue_t *futex = futex_hash[FUTEX_HASH(phys)];
+    while (futex != NULL && futex->phys != phys) {
+        futex = futex->next;
+    }
+    return futex;
+}
+
+// Called with futex_lock held. Takes a waiter's reference on the word's queue, creating it if
+// this is the first.
+static futex_queue_t *futex_get(uint32_t phys) {
+    futex_queue_t *futex = futex_lookup(phys);
+    if (futex == NULL) {
+        futex = (futex_queue_t *)kmalloc(sizeof(futex_queue_t));
+        futex->phys = phys;
+        futex->waiters = 0;
+        wait_queue_init(&futex->queue);
+        futex->next = futex_hash[FUTEX_HASH(phys)];
+        futex_hash[FUTEX_HASH(phys)] = futex;
+    }
+    futex->waiters++;
+    return futex;
+}
+
+// Called with futex_lock held
+static void futex_put(futex_queue_t *futex) {
+    if (--futex->waiters != 0) {
+        return;
+    }
+    futex_queue_t **link = &futex_hash[FUTEX_HASH(futex->phys)];
+    while (*link != futex) {
+        link = &(*link)->next;
+    }
+    *link = futex->next;
+    kfree(futex);
+}
+
+// Sleeps until futex_wake is called on addr, as long as *addr still holds val by the time we're
+// queued. A timeout of NULL waits forever. Returns 0 when woken, which may be spuriously.
+int futex_wait(uint32_t *addr, uint32_t val, timespec_t *timeout) {
+    uint32_t phys;
+    if (!futex_phys(addr, &phys)) {
+        return FUTEX_ERR_FAULT;
+    }
+    uint32_t ticks = 0;
+    if (timeout != NULL) {
+        if (timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000) {
+            return FUTEX_ERR_FAULT;
+        }
+        ticks = timespec_to_jiffies(timeout) + 1; //the current tick is already partly over
+    }
+
+    //futex_wake bumps seq under the same lock, so a wake that comes after we read *addr, but
+    //before we're asleep, keeps us from going to sleep at all
+    uint32_t flags = spin_lock_irqsave(&futex_lock);
+    futex_queue_t *futex = futex_get(phys);
+    uint32_t seq = futex->queue.seq;
+    bool changed = *(volatile uint32_t *)addr != val;
+    spin_unlock_irqrestore(&futex_lock, flags);
+
+    int ret = 0;
+    if (changed) {
+        ret = FUTEX_ERR_AGAIN;
+    } else if (timeout == NULL) {
+        sleep_on_since(&futex->queue, seq);
+    } else if (sleep_on_since_timeout(&futex->queue, seq, ticks) == 0) {
+        ret = FUTEX_ERR_TIMEDOUT;
+    }
+
+    flags = spin_lock_irqsave(&futex_lock);
+    futex_put(futex);
+    spin_unlock_irqrestore(&futex_lock, flags);
+    return ret;
+}
+
+// Wakes up to count of the processes waiting on addr, oldest first. Returns how many there were.
+int futex_wake(uint32_t *addr, uint32_t count) {
+    uint32_t phys;
+    if (!futex_phys(addr, &phys)) {
+        return FUTEX_ERR_FAULT;
+    }
+
+    int woken = 0;
+    uint32_t flags = spin_lock_irqsave(&futex_lock);
+    futex_queue_t *futex = futex_lookup(phys);
+    if (futex != NULL && count > 0) {
+        if (futex->queue.head == NULL) {
+            //nobody's asleep yet, but someone may be between checking the value and sleeping
+            wake_up(&futex->queue);
+        }
+        while ((uint32_t)woken < count && futex->queue.head != NULL) {
+            wake_up_one(&futex->queue);
+            woken++;
+        }
+    }
+    spin_unlock_irqrestore(&futex_lock, flags);
+    return woken;
+}
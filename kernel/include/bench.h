@@ -0,0 +1,22 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stdint.h>
+
+// Microbenchmarks, only built with `make BENCH=1`. Results go to the serial port.
+
+#define BENCH_SWITCH_ITERATIONS 10000
+#define BENCH_SWITCH_TARGET_CYCLES 1000 //per switch, between two kernel threads (no cr3 reload)
+
+#define BENCH_SYSCALL_ITERATIONS 10000 //null syscalls (getpid) timed from ring 3, per entry path
+#define BENCH_USER_CODE 0x08048000 //where the ring 3 loop is mapped in its address space
+
+#define BENCH_URING_WRITES 4096 //one byte writes to /dev/null, made one syscall at a time or through a ring
+#define BENCH_URING_ENTRIES 32 //ring size, and how many writes go in per uring_enter
+#define BENCH_URING_ADDR 0x10000000
+
+#define BENCH_MMAP_FILE "/mnt/ramdisk/bin/xansh.elf" //read through, then mapped, from ring 3
+
+void bench_run();
+
+#endif
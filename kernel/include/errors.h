@@ -5,6 +5,7 @@
 #include <stdarg.h>
 
 #include "inc_c/display.h"
+#include "trace.h"
 
 // Essentially a nonreturning printf - prints the message and halts the system
 #define kpanic(msg, ...) do { \
@@ -14,6 +15,7 @@
     terminal_printf("%s:%d: \n", __FILE__, __LINE__); \
     terminal_printf(msg, ##__VA_ARGS__); \
     terminal_printf(" System halted.\n"); \
+    trace_dump(); \
     asm volatile("hlt"); \
     while (1); \
 } while (0)
@@ -2,10 +2,12 @@
 #define _FILESYSTEM_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "inc_c/ramdisk.h"
 
 #define FILESYSTEM_TYPE_RAMDISK 0x1
 #define FILESYSTEM_TYPE_DEVICES 0x2
+#define FILESYSTEM_TYPE_PROC 0x3
 
 #define FILE_ISOPEN_FLAG 0x1
 #define FILE_ISOPENDIR_FLAG 0x2
@@ -21,15 +23,47 @@
 #define SEEK_CUR 1
 #define SEEK_END 2
 
-#define stdin current_process->fds[0]
-#define stdout current_process->fds[1]
-#define stderr current_process->fds[2]
+#define stdin current_process->files->fds[0]
+#define stdout current_process->files->fds[1]
+#define stderr current_process->files->fds[2]
 
 typedef struct {
     size_t inode;
     char name[256];
 } dirent_t;
 
+// One entry of a getdents buffer, like struct linux_dirent64. Entries are packed one after the
+// other, each reclen bytes (a multiple of 8) with as much of name as it needs, NUL included.
+typedef struct {
+    uint64_t inode;
+    int64_t offset; //the directory's cursor after this entry, so fseek to it resumes from the next
+    uint16_t reclen;
+    uint8_t type; //DT_*
+    char name[];
+} __attribute__((packed)) dirent64_t;
+
+#define DT_UNKNOWN 0
+#define DT_CHR 2
+#define DT_DIR 4
+#define DT_REG 8
+
+// A filesystem's iterate calls emit for each entry from the directory's cursor on, moving the
+// cursor past every entry emit takes, until it runs out of entries or emit returns false
+// because there's no more room.
+typedef struct dir_context {
+    bool (*emit)(struct dir_context *ctx, const char *name, uint32_t inode, uint8_t type, uint32_t next);
+} dir_context_t;
+
+// One buffer of a vectored read or write, like struct iovec
+typedef struct {
+    void *iov_base;
+    size_t iov_len;
+} iovec_t;
+
+#define IOV_MAX 64 //most buffers one readv or writev takes
+
+#define SENDFILE_CHUNK 0x1000 //fsendfile's buffer, for sources it can't write out straight from memory
+
 #if defined(__ARCH_x86__)
 
 typedef struct {
@@ -71,6 +105,15 @@ typedef struct {
     int (*closedir)(void *dir);
     void *(*copy)(void *fd); //both should be file_descriptor_t*, but we can't include that here
     dirent_t *(*getdent)(dirent_t *buf, uint32_t entry_num, void *dir);
+    int (*readv)(iovec_t *iov, int iovcnt, void *file); //optional: freadv and fwritev fall back to
+    int (*writev)(iovec_t *iov, int iovcnt, void *file); //one read or write per buffer without them
+    int (*pread)(char *buf, size_t count, size_t offset, void *file); //optional: fpread and fpwrite seek
+    int (*pwrite)(char *buf, size_t count, size_t offset, void *file); //there and back without them
+    uint32_t (*map_page)(void *file, size_t offset); //optional: physical address of the whole page of the file
+                                                     //at offset, for mmap to map in place, or 0 to copy it
+    int (*peek)(char **buf, size_t count, size_t offset, void *file); //optional: points *buf at up to count bytes
+                                                     //of the file at offset that stay in memory, returning how many
+    int (*iterate)(void *dir, dir_context_t *ctx); //optional: fgetdents fails without it
 } filesystem_t;
 
 //file descriptor
@@ -89,6 +132,14 @@ typedef struct {
     void *fs_data;
 } dir_descriptor_t;
 
+// A process' open files. Threads share their creator's; every other new task gets its own.
+typedef struct {
+    uint32_t refcount;
+    file_descriptor_t *fds[256];
+    uint32_t num_fds;
+    uint32_t max_fds;
+} fd_table_t;
+
 typedef struct fs_node {
     filesystem_t *fs;
     struct fs_node *next;
@@ -107,7 +158,18 @@ int mount_filesystem(uint32_t filesystem_id, char *path);
 file_descriptor_t *fopen(char *path, char *flags);
 int fread(char *buf, size_t size, size_t count, file_descriptor_t *fd);
 int fwrite(char *buf, size_t size, size_t count, file_descriptor_t *fd);
+int freadv(iovec_t *iov, int iovcnt, file_descriptor_t *fd);
+int fwritev(iovec_t *iov, int iovcnt, file_descriptor_t *fd);
+int fpread(char *buf, size_t count, size_t offset, file_descriptor_t *fd);
+int fpwrite(char *buf, size_t count, size_t offset, file_descriptor_t *fd);
+uint32_t fmap_page(file_descriptor_t *fd, size_t offset);
+int fsendfile(file_descriptor_t *out, file_descriptor_t *in, size_t *offset, size_t count);
 int fclose(file_descriptor_t *fd);
+int fclose_detached(file_descriptor_t *fd);
+fd_table_t *fd_table_create();
+fd_table_t *fd_table_copy(fd_table_t *from);
+void fd_table_get(fd_table_t *table);
+void fd_table_put(fd_table_t *table);
 dir_descriptor_t *fopendir(char *path);
 int fclosedir(dir_descriptor_t *dd);
 int fseek(file_descriptor_t *fd, size_t offset, int whence);
@@ -115,5 +177,6 @@ size_t ftell(file_descriptor_t *fd);
 int fstat(file_descriptor_t *fd, stat_t *statbuf);
 file_descriptor_t *copy_descriptor(file_descriptor_t *fd, uint32_t id);
 dirent_t *fgetdent(dirent_t *buf, uint32_t entry_num, dir_descriptor_t *fd);
+int fgetdents(dir_descriptor_t *fd, void *buf, size_t size);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,30 @@
+#ifndef _FUTEX_H
+#define _FUTEX_H
+
+#include <stdint.h>
+
+#include "timer.h"
+
+// Futexes: sleeping and waking on a 32-bit word in user memory. The kernel keeps no state for a
+// word nobody is waiting on, so a lock built on one only makes a syscall when it's contended.
+// The usual mutex: 0 unlocked, 1 locked, 2 locked with waiters. Lock with cmpxchg 0 -> 1, and
+// if that fails, set it to 2 and FUTEX_WAIT on 2 until a cmpxchg 0 -> 2 succeeds. Unlock by
+// swapping in 0, and only FUTEX_WAKE one waiter if the old value was 2.
+//
+// Waiters are keyed by the physical address of the word, so processes sharing the memory at
+// different virtual addresses still find each other.
+
+#define FUTEX_WAIT 0 //sleep until woken, unless *addr != val
+#define FUTEX_WAKE 1 //wake up to val waiters, returns how many were woken
+
+#define FUTEX_ERR_FAULT -1 //addr isn't a mapped, aligned user address, or op is unknown
+#define FUTEX_ERR_AGAIN -2 //*addr didn't hold val
+#define FUTEX_ERR_TIMEDOUT -3
+
+#define FUTEX_HASH_SIZE 64 //must be a power of two
+
+void futex_initialize();
+int futex_wait(uint32_t *addr, uint32_t val, timespec_t *timeout);
+int futex_wake(uint32_t *addr, uint32_t count);
+
+#endif
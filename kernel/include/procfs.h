@@ -0,0 +1,34 @@
+#ifndef _PROCFS_H
+#define _PROCFS_H
+
+#include <stdint.h>
+
+// /proc: text files generated from kernel state when they're opened.
+//   /proc/uptime      seconds since boot, and seconds the CPUs spent idle (summed over CPUs)
+//   /proc/loadavg     1, 5 and 15 minute load averages, running/total processes, last pid
+//   /proc/interrupts  interrupts taken per CPU, by irq (vector - 32)
+//   /proc/<pid>/stat  one line: pid (name) state utime stime nvcsw nivcsw resident_pages
+//                     page_faults fds read_bytes write_bytes start_jiffies cpu lazy_pages
+//                     heap_bytes
+//   /proc/<pid>/status the same, one "Name:\tvalue" per line
+//   /proc/self        the process doing the opening
+// Times are in ticks of 1/HZ seconds.
+
+#define PROC_BUFFER_SIZE 4096 //longest a generated file can be; anything past it is cut off
+
+typedef struct {
+    uint32_t flags; //must be first, see file_descriptor_t
+    char *data; //the text, generated at open
+    uint32_t length;
+    uint32_t seek_pos;
+} proc_file_t;
+
+typedef struct {
+    uint32_t flags;
+    int pid; //-1 for /proc itself
+    uint32_t idx;
+} proc_dir_t;
+
+void procfs_initialize();
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef _SPINLOCK_H
+#define _SPINLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "inc_c/hardware.h"
+
+// Busy-waiting lock for data shared between CPUs. Holders mustn't sleep.
+// Ticket lock: lockers take a ticket from next and wait until owner reaches it, so CPUs get the
+// lock in the order they asked for it instead of whoever's cache line wins.
+typedef struct {
+    union {
+        volatile uint32_t value; //both halves at once, for spin_trylock
+        struct {
+            volatile uint16_t owner; //ticket being served
+            volatile uint16_t next; //ticket the next locker gets
+        };
+    };
+    uint32_t level; //LOCK_LEVEL_*, see below
+} spinlock_t;
+
+// Lock ordering: a CPU may only take a lock with a higher level than every lock it already
+// holds. Building with LOCK_DEBUG checks this on every acquire.
+#define LOCK_LEVEL_NONE 0 //not checked (the big kernel lock, which is dropped in odd places)
+#define LOCK_LEVEL_MOUNT 1 //filesystems and mount points
+#define LOCK_LEVEL_DEVICE 2 //device list
+#define LOCK_LEVEL_PROCESS_LIST 3 //all-tasks list and pid hash
+#define LOCK_LEVEL_DRIVER 4 //a driver's own buffers
+#define LOCK_LEVEL_FUTEX 5 //futex hash table
+#define LOCK_LEVEL_RUNQUEUE 6
+#define LOCK_LEVEL_HEAP 7
+#define LOCK_LEVEL_TRACE 8 //trace events can be recorded under anything else
+
+#define SPINLOCK_INIT(lock_level) {{0}, lock_level}
+
+#ifdef LOCK_DEBUG
+void lock_order_acquire(spinlock_t *lock);
+void lock_order_release(spinlock_t *lock);
+#else
+#define lock_order_acquire(lock) do { } while (0)
+#define lock_order_release(lock) do { } while (0)
+#endif
+
+static inline void cpu_relax() {
+    asm volatile ("pause" : : : "memory");
+}
+
+static inline void spin_lock_init(spinlock_t *lock, uint32_t level) {
+    lock->value = 0;
+    lock->level = level;
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+    uint16_t ticket = __sync_fetch_and_add(&lock->next, 1);
+    while (lock->owner != ticket) {
+        cpu_relax();
+    }
+    __sync_synchronize();
+    lock_order_acquire(lock);
+}
+
+static inline bool spin_trylock(spinlock_t *lock) {
+    uint32_t value = lock->value;
+    if ((value & 0xFFFF) != (value >> 16)) {
+        return false;
+    }
+    //take the next ticket only if nobody else has in the meantime
+    if (!__sync_bool_compare_and_swap(&lock->value, value, value + 0x10000)) {
+        return false;
+    }
+    lock_order_acquire(lock);
+    return true;
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    lock_order_release(lock);
+    __sync_synchronize();
+    //only the holder writes owner, so this doesn't need to be atomic
+    lock->owner = lock->owner + 1;
+}
+
+// For data also touched by interrupt handlers: interrupts stay off while it's held, or a handler
+// on the same CPU could spin on it forever. Nests, since the caller's EFLAGS come back exactly.
+static inline uint32_t spin_lock_irqsave(spinlock_t *lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "waitqueue.h"
+
+#define HZ 100 //scheduler/timer ticks per second
+
+// Wrap-safe jiffies comparisons
+#define time_after(a, b) ((int32_t)((b) - (a)) < 0)
+#define time_before(a, b) time_after(b, a)
+#define time_after_eq(a, b) ((int32_t)((a) - (b)) >= 0)
+
+#define ms_to_jiffies(ms) (((ms) * HZ + 999) / 1000)
+#define jiffies_to_ms(j) ((j) * (1000 / HZ))
+
+// A one-shot kernel timer. The callback runs in interrupt context on the tick it expires.
+typedef struct timer {
+    uint32_t expires; //absolute time, in jiffies
+    void (*callback)(void *data);
+    void *data;
+    struct timer *next;
+    struct timer **pprev; //NULL when the timer isn't pending
+} timer_t;
+
+typedef struct {
+    int32_t tv_sec;
+    int32_t tv_nsec;
+} timespec_t;
+
+extern volatile uint32_t jiffies;
+
+void timer_initialize();
+void timer_tick();
+void timer_init(timer_t *timer, void (*callback)(void *data), void *data);
+void timer_add(timer_t *timer, uint32_t expires);
+bool timer_cancel(timer_t *timer);
+bool timer_pending(timer_t *timer);
+uint64_t get_jiffies_64();
+
+uint32_t sleep_on_timeout(wait_queue_t *queue, uint32_t ticks);
+uint32_t sleep_on_since_timeout(wait_queue_t *queue, uint32_t seq, uint32_t ticks);
+uint32_t sleep_ticks(uint32_t ticks);
+
+uint32_t timespec_to_jiffies(timespec_t *ts);
+void jiffies_to_timespec(uint32_t ticks, timespec_t *ts);
+
+#endif
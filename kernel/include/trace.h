@@ -0,0 +1,54 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Static tracepoints. Each event is a fixed-size binary record in a ring buffer, so a tracepoint
+// costs a timestamp read and a few stores instead of a trip through the UART.
+// The high byte of an event id is its category, which can be switched on and off at runtime.
+
+#define TRACE_CAT_SCHED 0
+#define TRACE_CAT_SYSCALL 1
+#define TRACE_CAT_IRQ 2
+#define TRACE_CAT_TIMER 3
+#define TRACE_NUM_CATS 4
+
+#define TRACE_EVENT(cat, num) (((cat) << 8) | (num))
+#define TRACE_CATEGORY(id) ((id) >> 8)
+
+#define TRACE_SCHED_SWITCH TRACE_EVENT(TRACE_CAT_SCHED, 0) //prev pid, next pid
+#define TRACE_SCHED_WAKE TRACE_EVENT(TRACE_CAT_SCHED, 1) //woken pid, 0
+#define TRACE_SYSCALL_ENTER TRACE_EVENT(TRACE_CAT_SYSCALL, 0) //syscall number, ebx
+#define TRACE_SYSCALL_EXIT TRACE_EVENT(TRACE_CAT_SYSCALL, 1) //syscall number, return value
+#define TRACE_SYSCALL_INVALID TRACE_EVENT(TRACE_CAT_SYSCALL, 2) //syscall number, 0
+#define TRACE_IRQ_ENTER TRACE_EVENT(TRACE_CAT_IRQ, 0) //irq number, 0
+#define TRACE_TIMER_FIRE TRACE_EVENT(TRACE_CAT_TIMER, 0) //callback, expires
+
+#define TRACE_BUFFER_EVENTS 4096 //must be a power of two
+
+// Layout is shared with buildutils/tracedump.py, keep them in sync
+typedef struct {
+    uint64_t timestamp; //clock_cycles() when the event was recorded
+    uint32_t id;
+    int32_t pid;
+    uint32_t arg0;
+    uint32_t arg1;
+} __attribute__((packed)) trace_event_t;
+
+extern volatile uint32_t trace_mask;
+
+void trace_initialize();
+void trace_record(uint32_t id, uint32_t arg0, uint32_t arg1);
+void trace_enable(uint32_t category, bool enable);
+void trace_clear();
+void trace_dump();
+
+// Records an event if its category is enabled. Disabled tracepoints cost a load and a branch.
+#define trace(id, arg0, arg1) do { \
+    if (trace_mask & (1 << TRACE_CATEGORY(id))) { \
+        trace_record((id), (uint32_t)(arg0), (uint32_t)(arg1)); \
+    } \
+} while (0)
+
+#endif
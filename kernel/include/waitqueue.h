@@ -0,0 +1,40 @@
+#ifndef _WAITQUEUE_H
+#define _WAITQUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct process;
+
+// A FIFO of processes sleeping until some event happens.
+// seq is bumped on every wake_up, so a sleeper can tell whether a wakeup already
+// happened between checking its condition and going to sleep (see sleep_on_since).
+typedef struct wait_queue {
+    struct process *head;
+    struct process *tail;
+    volatile uint32_t seq;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT {NULL, NULL, 0}
+
+void wait_queue_init(wait_queue_t *queue);
+void sleep_on(wait_queue_t *queue);
+void sleep_on_since(wait_queue_t *queue, uint32_t seq);
+void wake_up(wait_queue_t *queue);
+void wake_up_one(wait_queue_t *queue);
+bool wait_queue_remove(wait_queue_t *queue, struct process *process);
+
+// Sleeps on queue until condition is true. The condition is re-checked after every wakeup,
+// and a wakeup racing with the check is never lost.
+#define wait_event(queue, condition) do { \
+    while (true) { \
+        uint32_t __wait_seq = (queue)->seq; \
+        if (condition) { \
+            break; \
+        } \
+        sleep_on_since((queue), __wait_seq); \
+    } \
+} while (0)
+
+#endif
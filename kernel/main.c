@@ -10,6 +10,7 @@
 #include "inc_c/process.h"
 #include "include/errors.h"
 #include "inc_c/serial.h"
+#include "include/bench.h"
 
 //temp
 #include "../arch/x86/drivers/keyboard.h"
@@ -37,6 +38,7 @@ void kernel_main() {
 	asm volatile ("cli");
 
 	boot_initialize();
+	lock_kernel(); //kernel_main is kernel code like any other, see smp.c
 
 	fopen("/dev/kbd0", "r"); // stdin
 	fopen("/dev/trm", "r+"); // stdout
@@ -44,10 +46,15 @@ void kernel_main() {
 
 	asm volatile ("sti");
 
+#ifdef KERNEL_BENCH
+	bench_run();
+#endif
+
 	uint32_t pid = fork();
 
 	if (pid == 0) {
 		terminal_printf("Hello from child!\n");
+		unlock_kernel(); //spinning doesn't need the kernel, let the other CPUs have it
 		while (true);
 	} else {
 		terminal_printf("Hello from parent!\n");
@@ -56,7 +63,7 @@ void kernel_main() {
 	process_t *new_process = process_load_elf("/mnt/ramdisk/bin/xansh.elf");
 	terminal_printf("Process loaded with PID %d\n", new_process->pid);
 
-	while (new_process->status != TASK_STATUS_FINISHED) {}
+	wait_event(&new_process->exit_queue, new_process->status == TASK_STATUS_FINISHED);
 	terminal_printf("\nProcess finished with code 0x%x\n", new_process->entry_or_return);
 
 	terminal_printf("Kernel is finished running. Press q to page fault!\n");
@@ -64,7 +71,7 @@ void kernel_main() {
     char buf;
 	file_descriptor_t *kbd = stdin;
 	while (true) {
-		int read = fread(&buf, 1, 1, kbd);
+		int read = fread(&buf, 1, 1, kbd); //sleeps until a key is pressed
 		if (read != 0) {
 			if (buf == 'q') {
 				terminal_printf("%c", *(char *)0xA0000000);
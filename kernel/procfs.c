@@ -0,0 +1,570 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "include/procfs.h"
+#include "include/filesystem.h"
+#include "include/errors.h"
+#include "include/timer.h"
+#include "include/unused.h"
+#include "inc_c/apic.h"
+#include "inc_c/memory.h"
+#include "inc_c/process.h"
+#include "inc_c/smp.h"
+#include "inc_c/string.h"
+
+filesystem_t proc_fs = {0};
+int proc_fs_registered = 0;
+
+// Files in /proc itself, before the pid directories
+static const char *proc_root_files[] = {"uptime", "loadavg", "interrupts", "self"};
+#define PROC_ROOT_FILES 4
+
+// Files in each /proc/<pid>
+static const char *proc_pid_files[] = {"stat", "status"};
+#define PROC_PID_FILES 2
+
+// Text being built for a file; output past size is dropped
+typedef struct {
+    char *data;
+    uint32_t length;
+    uint32_t size;
+} proc_buffer_t;
+
+static void proc_putc(proc_buffer_t *buf, char c) {
+    if (buf->length < buf->size) {
+        buf->data[buf->length++] = c;
+    }
+}
+
+static void proc_puts(proc_buffer_t *buf, const char *s) {
+    while (*s != '\0') {
+        proc_putc(buf, *s++);
+    }
+}
+
+// Decimal, right-aligned in width characters (0 for no padding)
+static void proc_putu(proc_buffer_t *buf, uint64_t value, uint32_t width) {
+    char digits[20];
+    uint32_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (width > count) {
+        proc_putc(buf, ' ');
+        width--;
+    }
+    while (count > 0) {
+        proc_putc(buf, digits[--count]);
+    }
+}
+
+// value / scale, with two decimal places
+static void proc_put_hundredths(proc_buffer_t *buf, uint64_t value, uint32_t scale) {
+    proc_putu(buf, value / scale, 0);
+    proc_putc(buf, '.');
+    uint32_t hundredths = (value % scale) * 100 / scale;
+    proc_putc(buf, '0' + hundredths / 10);
+    proc_putc(buf, '0' + hundredths % 10);
+}
+
+static void proc_put_field(proc_buffer_t *buf, const char *name, uint64_t value) {
+    proc_puts(buf, name);
+    proc_puts(buf, ":\t");
+    proc_putu(buf, value, 0);
+    proc_putc(buf, '\n');
+}
+
+static char proc_state_letter(uint32_t status) {
+    switch (status) {
+        case TASK_STATUS_RUNNING:
+            return 'R';
+        case TASK_STATUS_WAITING:
+            return 'S';
+        case TASK_STATUS_STOPPED:
+            return 'T';
+        case TASK_STATUS_FINISHED:
+            return 'Z';
+        case TASK_STATUS_EXITING:
+            return 'X';
+        default:
+            return 'N'; //not started yet
+    }
+}
+
+static const char *proc_state_name(uint32_t status) {
+    switch (status) {
+        case TASK_STATUS_RUNNING:
+            return "R (running)";
+        case TASK_STATUS_WAITING:
+            return "S (sleeping)";
+        case TASK_STATUS_STOPPED:
+            return "T (stopped)";
+        case TASK_STATUS_FINISHED:
+            return "Z (finished)";
+        case TASK_STATUS_EXITING:
+            return "X (exiting)";
+        default:
+            return "N (new)";
+    }
+}
+
+static void proc_gen_uptime(proc_buffer_t *buf) {
+    uint64_t idle = 0;
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        if (cpus[i].idle != NULL) {
+            idle += cpus[i].idle->stats.utime + cpus[i].idle->stats.stime;
+        }
+    }
+    proc_put_hundredths(buf, get_jiffies_64(), HZ);
+    proc_putc(buf, ' ');
+    proc_put_hundredths(buf, idle, HZ);
+    proc_putc(buf, '\n');
+}
+
+static void proc_gen_loadavg(proc_buffer_t *buf) {
+    for (uint32_t i = 0; i < 3; i++) {
+        //round to the nearest hundredth
+        proc_put_hundredths(buf, load_averages[i] + FIXED_1 / 200, FIXED_1);
+        proc_putc(buf, ' ');
+    }
+
+    uint32_t running = 0;
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        if (cpus[i].online) {
+            running += cpus[i].rq_length;
+            if (cpus[i].current != cpus[i].idle) {
+                running++;
+            }
+        }
+    }
+    proc_putu(buf, running, 0);
+    proc_putc(buf, '/');
+    proc_putu(buf, process_count(), 0);
+    proc_putc(buf, ' ');
+    proc_putu(buf, next_pid - 1, 0);
+    proc_putc(buf, '\n');
+}
+
+static const char *proc_irq_name(uint32_t vector) {
+    switch (vector) {
+        case 32:
+            return "PIT";
+        case 33:
+            return "keyboard";
+        case LAPIC_TIMER_VECTOR:
+            return "LAPIC timer";
+        case IPI_RESCHEDULE_VECTOR:
+            return "reschedule IPI";
+        case LAPIC_SPURIOUS_VECTOR:
+            return "spurious";
+        default:
+            return "";
+    }
+}
+
+// Only irqs that have fired somewhere get a row
+static void proc_gen_interrupts(proc_buffer_t *buf) {
+    proc_puts(buf, "    ");
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        proc_puts(buf, "        CPU");
+        proc_putu(buf, i, 0);
+    }
+    proc_putc(buf, '\n');
+
+    for (uint32_t irq = 0; irq < IRQ_COUNT_VECTORS; irq++) {
+        bool fired = false;
+        for (uint32_t i = 0; i < num_cpus; i++) {
+            if (cpus[i].irq_counts[irq] != 0) {
+                fired = true;
+            }
+        }
+        if (!fired) {
+            continue;
+        }
+
+        proc_putu(buf, irq, 3);
+        proc_putc(buf, ':');
+        for (uint32_t i = 0; i < num_cpus; i++) {
+            proc_putu(buf, cpus[i].irq_counts[irq], 12);
+        }
+        proc_puts(buf, "  ");
+        proc_puts(buf, proc_irq_name(irq + 32));
+        proc_putc(buf, '\n');
+    }
+}
+
+static void proc_gen_stat(proc_buffer_t *buf, process_info_t *info) {
+    proc_putu(buf, info->pid, 0);
+    proc_puts(buf, " (");
+    proc_puts(buf, info->name);
+    proc_puts(buf, ") ");
+    proc_putc(buf, proc_state_letter(info->status));
+    uint64_t fields[] = {
+        info->stats.utime, info->stats.stime, info->stats.nvcsw, info->stats.nivcsw,
+        info->resident_pages, info->stats.page_faults, info->num_fds,
+        info->stats.read_bytes, info->stats.write_bytes, info->stats.start_jiffies, info->cpu,
+        info->lazy_pages, info->heap_size,
+    };
+    for (uint32_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        proc_putc(buf, ' ');
+        proc_putu(buf, fields[i], 0);
+    }
+    proc_putc(buf, '\n');
+}
+
+static void proc_gen_status(proc_buffer_t *buf, process_info_t *info) {
+    proc_puts(buf, "Name:\t");
+    proc_puts(buf, info->name);
+    proc_puts(buf, "\nState:\t");
+    proc_puts(buf, proc_state_name(info->status));
+    proc_putc(buf, '\n');
+    proc_put_field(buf, "Pid", info->pid);
+    proc_put_field(buf, "Tgid", info->tgid);
+    proc_puts(buf, "Kthread:\t");
+    proc_puts(buf, (info->flags & PROCESS_FLAG_KTHREAD) ? "yes\n" : "no\n");
+    proc_put_field(buf, "Cpu", info->cpu);
+    proc_put_field(buf, "StartTicks", info->stats.start_jiffies);
+    proc_put_field(buf, "UserTicks", info->stats.utime);
+    proc_put_field(buf, "KernelTicks", info->stats.stime);
+    proc_put_field(buf, "VoluntarySwitches", info->stats.nvcsw);
+    proc_put_field(buf, "InvoluntarySwitches", info->stats.nivcsw);
+    proc_put_field(buf, "ResidentPages", info->resident_pages);
+    proc_put_field(buf, "LazyPages", info->lazy_pages);
+    proc_put_field(buf, "HeapBytes", info->heap_size);
+    proc_put_field(buf, "PageFaults", info->stats.page_faults);
+    proc_put_field(buf, "Fds", info->num_fds);
+    proc_put_field(buf, "ReadBytes", info->stats.read_bytes);
+    proc_put_field(buf, "WriteBytes", info->stats.write_bytes);
+}
+
+// Splits the next path component off *path. Returns its length, 0 at the end of the path.
+static uint32_t proc_next_component(char **path, char **component) {
+    while (**path == '/') {
+        (*path)++;
+    }
+    *component = *path;
+    uint32_t length = 0;
+    while ((*path)[length] != '\0' && (*path)[length] != '/') {
+        length++;
+    }
+    *path += length;
+    return length;
+}
+
+static bool proc_component_is(char *component, uint32_t length, const char *name) {
+    return strlen(name) == length && strncmp(component, name, length) == 0;
+}
+
+// "self" or a number; -1 for anything else
+static int proc_parse_pid(char *component, uint32_t length) {
+    if (proc_component_is(component, length, "self")) {
+        return current_process->pid;
+    }
+    int pid = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        if (component[i] < '0' || component[i] > '9' || pid > PID_MAX) {
+            return -1;
+        }
+        pid = pid * 10 + (component[i] - '0');
+    }
+    return pid;
+}
+
+static proc_file_t *proc_not_found(uint32_t flags) {
+    proc_file_t *file = (proc_file_t *)kmalloc(sizeof(proc_file_t));
+    file->flags = FILE_NOTFOUND_FLAG | flags;
+    file->data = NULL;
+    return file;
+}
+
+// The whole file is generated here, so a reader sees one consistent snapshot however it reads it
+proc_file_t *proc_open(char *path, char *flags) {
+    if (flags[0] != 'r' || flags[1] == '+') {
+        return proc_not_found(0); //nothing in /proc is writable
+    }
+
+    char *first, *second, *rest;
+    uint32_t first_length = proc_next_component(&path, &first);
+    uint32_t second_length = proc_next_component(&path, &second);
+    if (first_length == 0 || proc_next_component(&path, &rest) != 0) {
+        return proc_not_found(first_length == 0 ? FILE_ISDIR_FLAG : 0);
+    }
+
+    proc_buffer_t buf = {(char *)kmalloc(PROC_BUFFER_SIZE), 0, PROC_BUFFER_SIZE};
+    bool found = true;
+    if (second_length == 0 && proc_component_is(first, first_length, "uptime")) {
+        proc_gen_uptime(&buf);
+    } else if (second_length == 0 && proc_component_is(first, first_length, "loadavg")) {
+        proc_gen_loadavg(&buf);
+    } else if (second_length == 0 && proc_component_is(first, first_length, "interrupts")) {
+        proc_gen_interrupts(&buf);
+    } else {
+        process_info_t info;
+        int pid = proc_parse_pid(first, first_length);
+        if (pid < 0 || second_length == 0 || !process_get_info(pid, &info)) {
+            found = false;
+        } else if (proc_component_is(second, second_length, "stat")) {
+            proc_gen_stat(&buf, &info);
+        } else if (proc_component_is(second, second_length, "status")) {
+            proc_gen_status(&buf, &info);
+        } else {
+            found = false;
+        }
+    }
+
+    if (!found) {
+        kfree(buf.data);
+        return proc_not_found(0);
+    }
+
+    proc_file_t *file = (proc_file_t *)kmalloc(sizeof(proc_file_t));
+    file->flags = FILE_ISOPEN_FLAG | FILE_ISFILE_FLAG | FILE_MODE_READ;
+    file->data = buf.data;
+    file->length = buf.length;
+    file->seek_pos = 0;
+    return file;
+}
+
+proc_dir_t *proc_opendir(char *path) {
+    proc_dir_t *dir = (proc_dir_t *)kmalloc(sizeof(proc_dir_t));
+    dir->idx = 0;
+    dir->pid = -1;
+    dir->flags = FILE_ISOPENDIR_FLAG | FILE_ISDIR_FLAG;
+
+    char *first, *rest;
+    uint32_t first_length = proc_next_component(&path, &first);
+    if (first_length == 0) {
+        return dir;
+    }
+    process_info_t info;
+    dir->pid = proc_parse_pid(first, first_length);
+    if (dir->pid < 0 || proc_next_component(&path, &rest) != 0 || !process_get_info(dir->pid, &info)) {
+        dir->flags = FILE_NOTFOUND_FLAG;
+    }
+    return dir;
+}
+
+int proc_read(void *ptr, size_t size, size_t nmemb, proc_file_t *file) {
+    if (!(file->flags & FILE_ISOPEN_FLAG)) {
+        return -1;
+    }
+    if (file->seek_pos >= file->length) {
+        return 0;
+    }
+    uint32_t bytes_to_read = size * nmemb;
+    if (bytes_to_read > file->length - file->seek_pos) {
+        bytes_to_read = file->length - file->seek_pos;
+    }
+    memcpy(ptr, file->data + file->seek_pos, bytes_to_read);
+    file->seek_pos += bytes_to_read;
+    return bytes_to_read;
+}
+
+// Like proc_read, but at offset and without moving seek_pos
+int proc_pread(void *ptr, size_t count, size_t offset, proc_file_t *file) {
+    if (!(file->flags & FILE_ISOPEN_FLAG)) {
+        return -1;
+    }
+    if (offset >= file->length) {
+        return 0;
+    }
+    if (count > file->length - offset) {
+        count = file->length - offset;
+    }
+    memcpy(ptr, file->data + offset, count);
+    return count;
+}
+
+// The text was generated at open and stays until close
+int proc_peek(char **buf, size_t count, size_t offset, proc_file_t *file) {
+    if (!(file->flags & FILE_ISOPEN_FLAG)) {
+        return -1;
+    }
+    if (offset >= file->length) {
+        return 0;
+    }
+    if (count > file->length - offset) {
+        count = file->length - offset;
+    }
+    *buf = file->data + offset;
+    return count;
+}
+
+int proc_write(void *ptr, size_t size, size_t nmemb, proc_file_t *file) {
+    UNUSED(ptr);
+    UNUSED(size);
+    UNUSED(nmemb);
+    UNUSED(file);
+    return -1;
+}
+
+int proc_seek(proc_file_t *file, size_t offset, int whence) {
+    if (file->flags & FILE_ISOPEN_FLAG) {
+        switch (whence) {
+            case SEEK_SET:
+                file->seek_pos = offset;
+                break;
+            case SEEK_CUR:
+                file->seek_pos += offset;
+                break;
+            case SEEK_END:
+                file->seek_pos = file->length + offset;
+                break;
+            default:
+                return -1;
+        }
+        if (file->seek_pos > file->length) {
+            file->seek_pos = file->length;
+        }
+        return 0;
+    } else if (file->flags & FILE_ISOPENDIR_FLAG) {
+        proc_dir_t *dir = (proc_dir_t *)file;
+        if (whence == SEEK_SET) {
+            dir->idx = offset;
+        } else if (whence == SEEK_CUR) {
+            dir->idx += offset;
+        } else {
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+size_t proc_tell(proc_file_t *file) {
+    if (!(file->flags & FILE_ISOPEN_FLAG)) {
+        return -1;
+    }
+    return file->seek_pos;
+}
+
+int proc_close(proc_file_t *file) {
+    if (file->data != NULL) {
+        kfree(file->data);
+    }
+    kfree(file);
+    return 0;
+}
+
+int proc_closedir(proc_dir_t *dir) {
+    if (!(dir->flags & FILE_ISOPENDIR_FLAG)) {
+        return -1;
+    }
+    kfree(dir);
+    return 0;
+}
+
+dirent_t *proc_getdent(dirent_t *buf, uint32_t entry_num, void *dir_in) {
+    proc_dir_t *dir = (proc_dir_t *)dir_in;
+    if (!(dir->flags & FILE_ISOPENDIR_FLAG)) {
+        return NULL;
+    }
+
+    if (dir->pid >= 0) {
+        if (entry_num >= PROC_PID_FILES) {
+            return NULL;
+        }
+        buf->inode = 1;
+        strncpy(buf->name, proc_pid_files[entry_num], 256);
+        return buf;
+    }
+
+    if (entry_num < PROC_ROOT_FILES) {
+        buf->inode = 1;
+        strncpy(buf->name, proc_root_files[entry_num], 256);
+        return buf;
+    }
+    int pid = process_nth_pid(entry_num - PROC_ROOT_FILES);
+    if (pid < 0) {
+        return NULL;
+    }
+    proc_buffer_t name = {buf->name, 0, sizeof(buf->name) - 1};
+    proc_putu(&name, pid, 0);
+    buf->name[name.length] = '\0';
+    buf->inode = 1;
+    return buf;
+}
+
+int proc_iterate(proc_dir_t *dir, dir_context_t *ctx) {
+    if (!(dir->flags & FILE_ISOPENDIR_FLAG)) {
+        return -1;
+    }
+    dirent_t entry;
+    while (proc_getdent(&entry, dir->idx, dir) != NULL) {
+        //everything in /proc itself but self is a file, like everything in a pid directory
+        bool is_dir = dir->pid < 0 && (dir->idx >= PROC_ROOT_FILES || strncmp(entry.name, "self", 5) == 0);
+        if (!ctx->emit(ctx, entry.name, entry.inode, is_dir ? DT_DIR : DT_REG, dir->idx + 1)) {
+            break;
+        }
+        dir->idx++;
+    }
+    return 0;
+}
+
+dirent_t proc_readdir(proc_dir_t *dir) {
+    dirent_t ret = {0, {}};
+    if (proc_getdent(&ret, dir->idx, dir) == NULL) {
+        return (dirent_t){0, {}};
+    }
+    dir->idx++;
+    return ret;
+}
+
+void *proc_copy(void *file_in) {
+    proc_file_t *file = (proc_file_t *)file_in;
+    if (file->flags & FILE_ISOPENDIR_FLAG) {
+        proc_dir_t *ret = (proc_dir_t *)kmalloc(sizeof(proc_dir_t));
+        memcpy(ret, file, sizeof(proc_dir_t));
+        return ret;
+    }
+    proc_file_t *ret = (proc_file_t *)kmalloc(sizeof(proc_file_t));
+    memcpy(ret, file, sizeof(proc_file_t));
+    if (file->data != NULL) {
+        ret->data = (char *)kmalloc(PROC_BUFFER_SIZE);
+        memcpy(ret->data, file->data, file->length);
+    }
+    return ret;
+}
+
+int proc_stat(void *file_in, stat_t *statbuf) {
+    proc_file_t *file = (proc_file_t *)file_in;
+    if (!(file->flags & FILE_ISOPEN_FLAG || file->flags & FILE_ISOPENDIR_FLAG)) {
+        return -1;
+    }
+
+    memset(statbuf, 0, sizeof(stat_t));
+    statbuf->st_dev = proc_fs.identifier;
+    statbuf->st_mode = file->flags;
+    statbuf->st_size = (file->flags & FILE_ISOPEN_FLAG) ? file->length : 0;
+    return 0;
+}
+
+void procfs_initialize() {
+    proc_fs.identifier = FILESYSTEM_TYPE_PROC;
+    proc_fs.open = (void*(*)(char*, char*))proc_open;
+    proc_fs.read = (int(*)(char*, size_t, size_t, void*))proc_read;
+    proc_fs.write = (int(*)(char*, size_t, size_t, void*))proc_write;
+    proc_fs.seek = (int(*)(void*, size_t, int))proc_seek;
+    proc_fs.tell = (size_t(*)(void*))proc_tell;
+    proc_fs.close = (int(*)(void*))proc_close;
+    proc_fs.opendir = (void*(*)(char*))proc_opendir;
+    proc_fs.readdir = (dirent_t(*)(void*))proc_readdir;
+    proc_fs.closedir = (int(*)(void*))proc_closedir;
+    proc_fs.stat = proc_stat;
+    proc_fs.copy = proc_copy;
+    proc_fs.getdent = proc_getdent;
+    proc_fs.readv = NULL;
+    proc_fs.writev = NULL;
+    proc_fs.pread = (int(*)(char*, size_t, size_t, void*))proc_pread;
+    proc_fs.pwrite = NULL;
+    proc_fs.map_page = NULL;
+    proc_fs.peek = (int(*)(char**, size_t, size_t, void*))proc_peek;
+    proc_fs.iterate = (int(*)(void*, dir_context_t*))proc_iterate;
+    proc_fs_registered = register_filesystem(&proc_fs);
+    if (!proc_fs_registered) {
+        kpanic("Failed to register proc filesystem!\n");
+    }
+    mount_filesystem(proc_fs_registered, "/proc");
+}
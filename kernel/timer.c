@@ -0,0 +1,223 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "include/timer.h"
+#include "include/waitqueue.h"
+#include "include/errors.h"
+#include "include/trace.h"
+#include "inc_c/hardware.h"
+#include "inc_c/process.h"
+#include "inc_c/string.h"
+
+// Hierarchical timing wheel. Timers due within the next 256 ticks sit in tv1, indexed directly by
+// their expiry tick. Later timers live in one of the coarser levels, and get cascaded down a level
+// each time the level below wraps around. Inserting and cancelling are O(1), and each tick only
+// looks at a single tv1 slot.
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+
+#define TVN_INDEX(time, level) (((time) >> (TVR_BITS + (level) * TVN_BITS)) & TVN_MASK)
+
+timer_t *tv1[TVR_SIZE];
+timer_t *tvn[TVN_LEVELS][TVN_SIZE];
+
+volatile uint32_t jiffies = 0;
+volatile uint64_t jiffies_64 = 0;
+uint32_t timer_jiffies = 0; //the next tick the wheel hasn't processed yet
+
+void timer_initialize() {
+    memset(tv1, 0, sizeof(tv1));
+    memset(tvn, 0, sizeof(tvn));
+    jiffies = 0;
+    jiffies_64 = 0;
+    timer_jiffies = 0;
+}
+
+void timer_init(timer_t *timer, void (*callback)(void *data), void *data) {
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static void timer_link(timer_t **slot, timer_t *timer) {
+    timer->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->pprev = &timer->next;
+    }
+    *slot = timer;
+    timer->pprev = slot;
+}
+
+static void timer_unlink(timer_t *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static void timer_internal_add(timer_t *timer) {
+    uint32_t expires = timer->expires;
+    uint32_t idx = expires - timer_jiffies;
+    timer_t **slot;
+
+    if ((int32_t)idx < 0) {
+        //already expired, run it on the next tick
+        slot = &tv1[timer_jiffies & TVR_MASK];
+    } else if (idx < TVR_SIZE) {
+        slot = &tv1[expires & TVR_MASK];
+    } else {
+        uint32_t level = 0;
+        while (level < TVN_LEVELS - 1 && idx >= (1U << (TVR_BITS + (level + 1) * TVN_BITS))) {
+            level++;
+        }
+        slot = &tvn[level][TVN_INDEX(expires, level)];
+    }
+
+    timer_link(slot, timer);
+}
+
+// Re-sorts every timer in one coarse slot into the levels below it. Returns the slot index,
+// so the caller knows whether this level wrapped too.
+static uint32_t timer_cascade(uint32_t level, uint32_t index) {
+    timer_t *timer = tvn[level][index];
+    tvn[level][index] = NULL;
+
+    while (timer != NULL) {
+        timer_t *next = timer->next;
+        timer->next = NULL;
+        timer->pprev = NULL;
+        timer_internal_add(timer);
+        timer = next;
+    }
+
+    return index;
+}
+
+// Arms timer to fire once jiffies reaches expires
+void timer_add(timer_t *timer, uint32_t expires) {
+    uint32_t flags = irq_save();
+
+    if (timer->pprev != NULL) {
+        timer_unlink(timer);
+    }
+    timer->expires = expires;
+    timer_internal_add(timer);
+
+    irq_restore(flags);
+}
+
+// Disarms timer. Returns whether it was still pending.
+bool timer_cancel(timer_t *timer) {
+    uint32_t flags = irq_save();
+
+    bool pending = timer->pprev != NULL;
+    if (pending) {
+        timer_unlink(timer);
+    }
+
+    irq_restore(flags);
+    return pending;
+}
+
+bool timer_pending(timer_t *timer) {
+    return timer->pprev != NULL;
+}
+
+uint64_t get_jiffies_64() {
+    uint32_t flags = irq_save();
+    uint64_t ret = jiffies_64;
+    irq_restore(flags);
+    return ret;
+}
+
+// Called from the timer interrupt, with interrupts disabled
+void timer_tick() {
+    jiffies++;
+    jiffies_64++;
+
+    while (time_after_eq(jiffies, timer_jiffies)) {
+        uint32_t index = timer_jiffies & TVR_MASK;
+
+        //tv1 wrapped, so pull the next batch of timers down from the coarser levels
+        if (index == 0) {
+            for (uint32_t level = 0; level < TVN_LEVELS; level++) {
+                if (timer_cascade(level, TVN_INDEX(timer_jiffies, level)) != 0) {
+                    break;
+                }
+            }
+        }
+        timer_jiffies++;
+
+        timer_t *timer = tv1[index];
+        tv1[index] = NULL;
+        while (timer != NULL) {
+            timer_t *next = timer->next;
+            timer->next = NULL;
+            timer->pprev = NULL;
+            trace(TRACE_TIMER_FIRE, timer->callback, timer->expires);
+            timer->callback(timer->data);
+            timer = next;
+        }
+    }
+}
+
+static void timer_wake_process(void *data) {
+    process_wake((process_t *)data);
+}
+
+// Like sleep_on_since, but gives up after ticks jiffies. Returns the number of ticks left,
+// which is 0 if the timeout expired.
+uint32_t sleep_on_since_timeout(wait_queue_t *queue, uint32_t seq, uint32_t ticks) {
+    timer_t timer;
+    timer_init(&timer, timer_wake_process, current_process);
+
+    uint32_t flags = irq_save();
+
+    uint32_t expires = jiffies + ticks;
+    timer_add(&timer, expires);
+    sleep_on_since(queue, seq);
+    timer_cancel(&timer);
+
+    //if the timer woke us, we're still linked on the queue
+    wait_queue_remove(queue, current_process);
+
+    uint32_t left = time_after(expires, jiffies) ? expires - jiffies : 0;
+
+    irq_restore(flags);
+    return left;
+}
+
+uint32_t sleep_on_timeout(wait_queue_t *queue, uint32_t ticks) {
+    return sleep_on_since_timeout(queue, queue->seq, ticks);
+}
+
+// Sleeps for at least ticks jiffies without using any CPU time
+uint32_t sleep_ticks(uint32_t ticks) {
+    wait_queue_t queue = WAIT_QUEUE_INIT;
+    //the current tick is already partly over, so wait one more to guarantee the full duration
+    return sleep_on_timeout(&queue, ticks + 1);
+}
+
+uint32_t timespec_to_jiffies(timespec_t *ts) {
+    uint32_t ns_per_tick = 1000000000 / HZ;
+    uint32_t max_sec = (0x7FFFFFFF / HZ) - 1;
+    if ((uint32_t)ts->tv_sec > max_sec) {
+        return max_sec * HZ;
+    }
+    return ts->tv_sec * HZ + (ts->tv_nsec + ns_per_tick - 1) / ns_per_tick;
+}
+
+void jiffies_to_timespec(uint32_t ticks, timespec_t *ts) {
+    ts->tv_sec = ticks / HZ;
+    ts->tv_nsec = (ticks % HZ) * (1000000000 / HZ);
+}
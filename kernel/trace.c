@@ -0,0 +1,173 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "include/trace.h"
+#include "include/spinlock.h"
+#include "inc_c/hardware.h"
+#include "inc_c/process.h"
+#include "inc_c/clock.h"
+#include "inc_c/devices.h"
+#include "inc_c/serial.h"
+#include "inc_c/string.h"
+
+trace_event_t trace_buffer[TRACE_BUFFER_EVENTS];
+uint32_t trace_head = 0; //total events ever written
+uint32_t trace_tail = 0; //total events ever read
+uint32_t trace_dropped = 0; //events overwritten before anyone read them
+
+volatile uint32_t trace_mask = (1 << TRACE_CAT_SCHED) | (1 << TRACE_CAT_SYSCALL);
+
+spinlock_t trace_lock = SPINLOCK_INIT(LOCK_LEVEL_TRACE); //the scheduler records events without the big kernel lock
+
+const char *trace_category_names[TRACE_NUM_CATS] = {
+    "sched",
+    "syscall",
+    "irq",
+    "timer",
+};
+
+void trace_record(uint32_t id, uint32_t arg0, uint32_t arg1) {
+    uint32_t flags = spin_lock_irqsave(&trace_lock);
+
+    //when full, the oldest event makes room for the newest
+    if (trace_head - trace_tail == TRACE_BUFFER_EVENTS) {
+        trace_tail++;
+        trace_dropped++;
+    }
+
+    trace_event_t *event = &trace_buffer[trace_head & (TRACE_BUFFER_EVENTS - 1)];
+    event->timestamp = clock_cycles();
+    event->id = id;
+    event->pid = current_process != NULL ? current_process->pid : 0;
+    event->arg0 = arg0;
+    event->arg1 = arg1;
+    trace_head++;
+
+    spin_unlock_irqrestore(&trace_lock, flags);
+}
+
+void trace_enable(uint32_t category, bool enable) {
+    if (category >= TRACE_NUM_CATS) {
+        return;
+    }
+    if (enable) {
+        trace_mask |= 1 << category;
+    } else {
+        trace_mask &= ~(1 << category);
+    }
+}
+
+void trace_clear() {
+    uint32_t flags = spin_lock_irqsave(&trace_lock);
+    trace_tail = trace_head;
+    trace_dropped = 0;
+    spin_unlock_irqrestore(&trace_lock, flags);
+}
+
+// Writes whatever is still buffered to the serial port as text, for tracedump.py to pick up
+// from the serial log. Called on panic, so it mustn't allocate or sleep.
+void trace_dump() {
+    serial_printf("trace: dump %d events, %d dropped, %d kHz\n", trace_head - trace_tail, trace_dropped, clock_cycles_khz());
+    for (uint32_t i = trace_tail; i != trace_head; i++) {
+        trace_event_t *event = &trace_buffer[i & (TRACE_BUFFER_EVENTS - 1)];
+        serial_printf("trace: %x %x %x %x %x %x\n", (uint32_t)(event->timestamp >> 32), (uint32_t)event->timestamp,
+            event->id, event->pid, event->arg0, event->arg1);
+    }
+    serial_printf("trace: end\n");
+}
+
+// Reading /dev/trace drains whole events in binary, oldest first
+int trace_device_read(void *ptr, uint32_t size) {
+    uint32_t flags = spin_lock_irqsave(&trace_lock);
+
+    uint32_t count = 0;
+    while ((count + 1) * sizeof(trace_event_t) <= size && trace_tail != trace_head) {
+        memcpy((trace_event_t *)ptr + count, &trace_buffer[trace_tail & (TRACE_BUFFER_EVENTS - 1)], sizeof(trace_event_t));
+        trace_tail++;
+        count++;
+    }
+
+    spin_unlock_irqrestore(&trace_lock, flags);
+    return count * sizeof(trace_event_t);
+}
+
+static bool trace_word_equals(char *word, uint32_t length, const char *name) {
+    return strlen(name) == length && strncmp(word, name, length) == 0;
+}
+
+static void trace_apply_category(char *word, uint32_t length, bool enable) {
+    if (trace_word_equals(word, length, "all")) {
+        for (uint32_t i = 0; i < TRACE_NUM_CATS; i++) {
+            trace_enable(i, enable);
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < TRACE_NUM_CATS; i++) {
+        if (trace_word_equals(word, length, trace_category_names[i])) {
+            trace_enable(i, enable);
+            return;
+        }
+    }
+}
+
+// Writing to /dev/trace takes text commands, one per line:
+//   enable <category|all>, disable <category|all>, clear
+int trace_device_write(void *ptr, uint32_t size) {
+    char *buf = (char *)ptr;
+    uint32_t pos = 0;
+
+    while (pos < size) {
+        //split the line into a command and an optional argument
+        char *words[2] = {NULL, NULL};
+        uint32_t lengths[2] = {0, 0};
+        uint32_t num_words = 0;
+        while (pos < size && buf[pos] != '\n') {
+            if (buf[pos] == ' ' || buf[pos] == '\t') {
+                pos++;
+                continue;
+            }
+            uint32_t start = pos;
+            while (pos < size && buf[pos] != ' ' && buf[pos] != '\t' && buf[pos] != '\n') {
+                pos++;
+            }
+            if (num_words < 2) {
+                words[num_words] = &buf[start];
+                lengths[num_words] = pos - start;
+                num_words++;
+            }
+        }
+        pos++;
+
+        if (num_words == 0) {
+            continue;
+        }
+        if (trace_word_equals(words[0], lengths[0], "clear")) {
+            trace_clear();
+        } else if (num_words == 2 && trace_word_equals(words[0], lengths[0], "enable")) {
+            trace_apply_category(words[1], lengths[1], true);
+        } else if (num_words == 2 && trace_word_equals(words[0], lengths[0], "disable")) {
+            trace_apply_category(words[1], lengths[1], false);
+        }
+    }
+
+    return size;
+}
+
+device_t trace_device = {
+    .name = "trace",
+    .flags = 0,
+    .read = trace_device_read,
+    .write = trace_device_write,
+    .seek = device_seek_empty,
+    .tell = device_tell_empty,
+    .read_queue = NULL, //draining an empty buffer shouldn't block
+    .next = NULL,
+};
+
+void trace_initialize() {
+    trace_head = 0;
+    trace_tail = 0;
+    trace_dropped = 0;
+    register_device(&trace_device);
+}
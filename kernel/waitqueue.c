@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "include/waitqueue.h"
+#include "inc_c/hardware.h"
+#include "inc_c/process.h"
+
+void wait_queue_init(wait_queue_t *queue) {
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->seq = 0;
+}
+
+// Puts the current process to sleep on the queue, unless the queue has been woken since seq was read.
+void sleep_on_since(wait_queue_t *queue, uint32_t seq) {
+    uint32_t flags = irq_save();
+
+    if (queue->seq == seq) {
+        current_process->wait_next = NULL;
+        if (queue->tail == NULL) {
+            queue->head = current_process;
+        } else {
+            queue->tail->wait_next = current_process;
+        }
+        queue->tail = current_process;
+
+        //doesn't return until someone wakes us up
+        process_block();
+    }
+
+    irq_restore(flags);
+}
+
+void sleep_on(wait_queue_t *queue) {
+    sleep_on_since(queue, queue->seq);
+}
+
+void wake_up(wait_queue_t *queue) {
+    uint32_t flags = irq_save();
+
+    queue->seq++;
+    process_t *process = queue->head;
+    queue->head = NULL;
+    queue->tail = NULL;
+    while (process != NULL) {
+        process_t *next = process->wait_next;
+        process->wait_next = NULL;
+        process_wake(process);
+        process = next;
+    }
+
+    irq_restore(flags);
+}
+
+void wake_up_one(wait_queue_t *queue) {
+    uint32_t flags = irq_save();
+
+    queue->seq++;
+    process_t *process = queue->head;
+    if (process != NULL) {
+        queue->head = process->wait_next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+        process->wait_next = NULL;
+        process_wake(process);
+    }
+
+    irq_restore(flags);
+}
+
+// Unlinks a sleeper that was woken by something other than the queue (e.g. a timeout).
+bool wait_queue_remove(wait_queue_t *queue, process_t *process) {
+    uint32_t flags = irq_save();
+
+    process_t *prev = NULL;
+    process_t *cur = queue->head;
+    while (cur != NULL && cur != process) {
+        prev = cur;
+        cur = cur->wait_next;
+    }
+
+    if (cur != NULL) {
+        if (prev == NULL) {
+            queue->head = cur->wait_next;
+        } else {
+            prev->wait_next = cur->wait_next;
+        }
+        if (queue->tail == cur) {
+            queue->tail = prev;
+        }
+        cur->wait_next = NULL;
+    }
+
+    irq_restore(flags);
+    return cur != NULL;
+}